@@ -0,0 +1,351 @@
+#include "batch.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+static std::expected<std::string, SweepError> read_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return std::unexpected(SweepError{SweepError::Code::open_failed, path});
+
+  file.seekg(0, std::ios::end);
+  std::streampos end = file.tellg();
+  if (end < 0)
+    return std::unexpected(SweepError{SweepError::Code::read_failed, path});
+
+  std::string contents(static_cast<size_t>(end), '\0');
+  file.seekg(0, std::ios::beg);
+  if (!contents.empty() && !file.read(contents.data(), static_cast<std::streamsize>(contents.size())))
+    return std::unexpected(SweepError{SweepError::Code::read_failed, path});
+
+  return contents;
+}
+
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+    s.remove_suffix(1);
+  return s;
+}
+
+static void split_fields(std::string_view line, std::vector<std::string_view>& fields) {
+  fields.clear();
+  while (true) {
+    size_t comma = line.find(',');
+    fields.push_back(trim(line.substr(0, comma)));
+    if (comma == std::string_view::npos)
+      break;
+    line.remove_prefix(comma + 1);
+  }
+}
+
+static bool parse_value(std::string_view s, double& out) {
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+  return !s.empty() && ec == std::errc() && ptr == s.data() + s.size();
+}
+
+std::expected<BindingTable, SweepError> BindingTable::from_csv(const std::string& path, const Circuit& circ) {
+  if (circ.inputs.empty())
+    return std::unexpected(SweepError{SweepError::Code::no_inputs, path});
+
+  auto contents = read_file(path);
+  if (!contents)
+    return std::unexpected(contents.error());
+
+  BindingTable table;
+  table.width = circ.inputs.size();
+
+  // column_of[i] is the csv column holding input i
+  std::vector<size_t> column_of(table.width);
+  for (size_t i = 0; i < table.width; i++)
+    column_of[i] = i;
+
+  std::vector<std::string_view> fields;
+  std::string_view rest = *contents;
+  bool first = true;
+  size_t line_no = 0;
+
+  while (!rest.empty()) {
+    size_t nl = rest.find('\n');
+    std::string_view line = trim(rest.substr(0, nl));
+    rest.remove_prefix(nl == std::string_view::npos ? rest.size() : nl + 1);
+    ++line_no;
+    if (line.empty())
+      continue;
+
+    split_fields(line, fields);
+    if (fields.size() != table.width)
+      return std::unexpected(SweepError{SweepError::Code::wrong_width, path, line_no});
+
+    double v;
+    if (first && !parse_value(fields[0], v)) {
+      // header row, map input names to columns
+      for (size_t i = 0; i < table.width; i++) {
+        auto it = std::find(fields.begin(), fields.end(), circ.inputs[i]);
+        if (it == fields.end())
+          return std::unexpected(SweepError{SweepError::Code::bad_header, path, line_no});
+        column_of[i] = static_cast<size_t>(it - fields.begin());
+      }
+      first = false;
+      continue;
+    }
+    first = false;
+
+    for (size_t i = 0; i < table.width; i++) {
+      if (!parse_value(fields[column_of[i]], v))
+        return std::unexpected(SweepError{SweepError::Code::bad_value, path, line_no});
+      table.values.push_back(v);
+    }
+  }
+
+  return table;
+}
+
+std::expected<BindingTable, SweepError> BindingTable::from_binary(const std::string& path, const Circuit& circ) {
+  if (circ.inputs.empty())
+    return std::unexpected(SweepError{SweepError::Code::no_inputs, path});
+
+  auto contents = read_file(path);
+  if (!contents)
+    return std::unexpected(contents.error());
+
+  BindingTable table;
+  table.width = circ.inputs.size();
+  if (contents->size() % (table.width * sizeof(double)) != 0)
+    return std::unexpected(SweepError{SweepError::Code::wrong_width, path});
+
+  table.values.resize(contents->size() / sizeof(double));
+  std::copy_n(contents->data(), contents->size(), reinterpret_cast<char*>(table.values.data()));
+  return table;
+}
+
+std::expected<BindingTable, SweepError> BindingTable::from_file(const std::string& path, const Circuit& circ) {
+  if (path.ends_with(".bin"))
+    return from_binary(path, circ);
+  return from_csv(path, circ);
+}
+
+static uint64_t pack_clbits(std::span<const uint8_t> clbits) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < clbits.size(); i++)
+    v |= static_cast<uint64_t>(clbits[i]) << i;
+  return v;
+}
+
+static void append_row(std::string& buf, size_t binding, uint64_t outcome, size_t num_clbits, size_t count) {
+  char num[24];
+  auto end = std::to_chars(num, num + sizeof(num), binding).ptr;
+  buf.append(num, end);
+  buf.push_back(',');
+  for (size_t i = num_clbits; i-- > 0;)
+    buf.push_back(((outcome >> i) & 1) ? '1' : '0');
+  buf.push_back(',');
+  end = std::to_chars(num, num + sizeof(num), count).ptr;
+  buf.append(num, end);
+  buf.push_back('\n');
+}
+
+std::expected<void, SweepError> run_sweep(const Circuit& circ, const BindingTable& bindings,
+                                          const std::string& out_path, const SweepOptions& opts) {
+  if (circ.num_clbits > 64)
+    return std::unexpected(SweepError{SweepError::Code::too_many_clbits, out_path});
+
+  std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+  if (!out)
+    return std::unexpected(SweepError{SweepError::Code::open_failed, out_path});
+  out << "binding,outcome,count\n";
+
+  const size_t num_bindings = bindings.size();
+  const size_t chunk = std::max<size_t>(opts.chunk_size, 1);
+  size_t num_threads = opts.num_threads ? opts.num_threads : std::thread::hardware_concurrency();
+  num_threads = std::min(std::max<size_t>(num_threads, 1), std::max<size_t>((num_bindings + chunk - 1) / chunk, 1));
+
+  const Rng base = opts.seed ? Rng(*opts.seed) : Rng::from_entropy();
+  std::atomic<size_t> next = 0;
+  std::mutex out_mtx;
+
+  // small circuits step batch_size shots through the gates together; shot k still
+  // draws from stream k, so the choice of engine doesn't change which stream a shot sees
+  const size_t batch = (circ.num_qubits <= BATCH_MAX_QUBITS) ? opts.batch_size : 0;
+
+  auto worker = [&]() {
+    // everything a run touches is owned by the worker and reused across bindings
+    QuantumState qs(circ.num_qubits, 0, base);
+    std::optional<BatchState> bs;
+    if (batch)
+      bs.emplace(circ.num_qubits, batch);
+    std::vector<double> param_vals, chunk_params, batch_params;
+    std::vector<uint8_t> clbits;
+    std::vector<std::map<uint64_t, size_t>> hists(chunk);
+    std::string buf;
+    const size_t stride = circ.params.size();
+
+    while (true) {
+      size_t begin = next.fetch_add(chunk);
+      if (begin >= num_bindings)
+        break;
+      size_t end = std::min(begin + chunk, num_bindings);
+
+      for (size_t b = begin; b < end; b++)
+        hists[b - begin].clear();
+
+      if (batch) {
+        chunk_params.resize((end - begin) * stride);
+        for (size_t b = begin; b < end; b++) {
+          circ.bind(bindings.row(b), param_vals);
+          std::copy(param_vals.begin(), param_vals.end(), chunk_params.begin() + (b - begin) * stride);
+        }
+
+        // the last group is padded with extra shots whose results are dropped
+        batch_params.resize(batch * stride);
+        const size_t first_shot = begin * opts.shots, last_shot = end * opts.shots;
+        for (size_t k0 = first_shot; k0 < last_shot; k0 += batch) {
+          for (size_t j = 0; j < batch; j++) {
+            size_t k = std::min(k0 + j, last_shot - 1);
+            size_t row = k / opts.shots - begin;
+            std::copy_n(chunk_params.begin() + row * stride, stride, batch_params.begin() + j * stride);
+            bs->rngs[j] = base.stream(k);
+          }
+          bs->init();
+          circ.execute_batch(*bs, batch_params, clbits);
+          for (size_t j = 0; j < batch && k0 + j < last_shot; j++) {
+            size_t row = (k0 + j) / opts.shots - begin;
+            hists[row][pack_clbits(std::span(clbits).subspan(j * circ.num_clbits, circ.num_clbits))]++;
+          }
+        }
+      }
+      else {
+        for (size_t b = begin; b < end; b++) {
+          circ.bind(bindings.row(b), param_vals);
+          for (size_t s = 0; s < opts.shots; s++) {
+            qs.init(circ.num_qubits, 0);
+            qs.rng = base.stream(b * opts.shots + s);
+            circ.execute(qs, param_vals, clbits);
+            hists[b - begin][pack_clbits(clbits)]++;
+          }
+        }
+      }
+
+      buf.clear();
+      for (size_t b = begin; b < end; b++) {
+        for (auto [outcome, count] : hists[b - begin])
+          append_row(buf, b, outcome, circ.num_clbits, count);
+      }
+
+      std::lock_guard lock(out_mtx);
+      out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_threads; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+
+  out.flush();
+  if (!out)
+    return std::unexpected(SweepError{SweepError::Code::write_failed, out_path});
+  return {};
+}
+
+void run_shots(const Circuit& circ, std::span<const double> param_vals, Histogram& hist, ShotWriter* writer,
+               const SweepOptions& opts, bool stabilizer_sum) {
+  const size_t shots = opts.shots;
+  const size_t batch = (!stabilizer_sum && circ.num_qubits <= BATCH_MAX_QUBITS) ? opts.batch_size : 0;
+  // whole batches per chunk, so only the last batch of the run is padded
+  const size_t chunk = batch ? (SHOT_CHUNK + batch - 1) / batch * batch : SHOT_CHUNK;
+  const size_t num_chunks = (shots + chunk - 1) / chunk;
+  size_t num_threads = opts.num_threads ? opts.num_threads : std::thread::hardware_concurrency();
+  num_threads = std::min(std::max<size_t>(num_threads, 1), std::max<size_t>(num_chunks, 1));
+
+  const Rng base = opts.seed ? Rng(*opts.seed) : Rng::from_entropy();
+  std::atomic<size_t> next = 0;
+  std::mutex out_mtx;
+  // chunks finished ahead of the one the writer is waiting for
+  std::map<size_t, std::vector<uint8_t>> done;
+  size_t next_write = 0;
+
+  auto worker = [&]() {
+    std::optional<QuantumState> qs;
+    std::optional<BatchState> bs;
+    if (batch)
+      bs.emplace(circ.num_qubits, batch);
+    else if (!stabilizer_sum)
+      qs.emplace(circ.num_qubits, 0, base);
+    std::vector<double> batch_params;
+    for (size_t j = 0; j < batch; j++)
+      batch_params.insert(batch_params.end(), param_vals.begin(), param_vals.end());
+    std::vector<uint8_t> clbits, packed;
+    Histogram local(circ.num_clbits);
+
+    auto record = [&](std::span<const uint8_t> bits) {
+      local.add(bits);
+      if (writer)
+        pack_shot(bits, packed);
+    };
+
+    while (true) {
+      const size_t c = next.fetch_add(1);
+      if (c >= num_chunks)
+        break;
+      const size_t begin = c * chunk, end = std::min(begin + chunk, shots);
+      packed.clear();
+
+      if (batch) {
+        // padding shots repeat the last stream and are dropped
+        for (size_t k0 = begin; k0 < end; k0 += batch) {
+          for (size_t j = 0; j < batch; j++)
+            bs->rngs[j] = base.stream(std::min(k0 + j, end - 1));
+          bs->init();
+          circ.execute_batch(*bs, batch_params, clbits);
+          for (size_t j = 0; j < batch && k0 + j < end; j++)
+            record(std::span(clbits).subspan(j * circ.num_clbits, circ.num_clbits));
+        }
+      }
+      else {
+        for (size_t s = begin; s < end; s++) {
+          if (stabilizer_sum) {
+            // shots already keep every thread busy
+            StabilizerSum ss(circ.num_qubits, base.stream(s));
+            ss.num_threads = 1;
+            circ.execute(ss, param_vals, clbits);
+          }
+          else {
+            qs->init(circ.num_qubits, 0);
+            qs->rng = base.stream(s);
+            circ.execute(*qs, param_vals, clbits);
+          }
+          record(clbits);
+        }
+      }
+
+      if (writer) {
+        std::lock_guard lock(out_mtx);
+        done.emplace(c, std::move(packed));
+        packed = {};
+        for (auto it = done.find(next_write); it != done.end(); it = done.find(++next_write)) {
+          writer->add_packed(it->second);
+          done.erase(it);
+        }
+      }
+    }
+
+    std::lock_guard lock(out_mtx);
+    hist.merge(local);
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_threads; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+}
@@ -0,0 +1,256 @@
+#include "batch_state.h"
+#include "profiler.h"
+#include <algorithm>
+#include <stdexcept>
+
+static constexpr double EPS = 1e-12;
+
+// gcc can't tell the per-state matrices apart from the amplitudes even with
+// __restrict, which keeps it from vectorizing the per-state kernel
+#if defined(__GNUC__) && !defined(__clang__)
+#define IVDEP _Pragma("GCC ivdep")
+#else
+#define IVDEP
+#endif
+
+BatchState::BatchState(size_t num_qubits, size_t batch_size)
+  : n(num_qubits), batch(batch_size), rngs(batch_size, Rng(0)) {
+  init();
+}
+
+void BatchState::init() {
+  re.assign((1ULL << n) * batch, 0.0);
+  im.assign((1ULL << n) * batch, 0.0);
+  std::fill_n(re.begin(), batch, 1.0);
+}
+
+void BatchState::apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11,
+                                  std::span<const uint8_t> active) {
+  unitary_1q(qubit, 0, u00, u01, u10, u11, active);
+}
+
+void BatchState::apply_unitary_1q(size_t qubit, std::span<const std::array<Complex, 4>> u) {
+  unitary_1q(qubit, 0, u);
+}
+
+void BatchState::apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11,
+                                             std::span<const uint8_t> active) {
+  unitary_1q(qubit, 1ULL << cntrl, u00, u01, u10, u11, active);
+}
+
+void BatchState::apply_controlled_unitary_1q(size_t cntrl, size_t qubit, std::span<const std::array<Complex, 4>> u) {
+  unitary_1q(qubit, 1ULL << cntrl, u);
+}
+
+void BatchState::unitary_1q(size_t qubit, size_t cmask, Complex u00, Complex u01, Complex u10, Complex u11,
+                            std::span<const uint8_t> active) {
+  if (!active.empty()) {
+    // states left out get the identity
+    std::vector<std::array<Complex, 4>> u(batch, { 1.0, 0.0, 0.0, 1.0 });
+    for (size_t b = 0; b < batch; b++) {
+      if (active[b])
+        u[b] = { u00, u01, u10, u11 };
+    }
+    unitary_1q(qubit, cmask, u);
+    return;
+  }
+
+  PROFILE_SCOPE("batch_unitary_1q", qubit, 2 * (re.size() + im.size()) * sizeof(double));
+  const size_t bit = 1ULL << qubit;
+  const size_t dim = 1ULL << n;
+  const double a_r = u00.real(), a_i = u00.imag(), b_r = u01.real(), b_i = u01.imag();
+  const double c_r = u10.real(), c_i = u10.imag(), d_r = u11.real(), d_i = u11.imag();
+
+  for (size_t i = 0; i < dim; i++) {
+    if ((i & bit) != 0 || (i & cmask) != cmask)
+      continue;
+    double* __restrict xr = &re[i * batch];
+    double* __restrict xi = &im[i * batch];
+    double* __restrict yr = &re[(i | bit) * batch];
+    double* __restrict yi = &im[(i | bit) * batch];
+    for (size_t b = 0; b < batch; b++) {
+      double pr = xr[b], pi = xi[b], qr = yr[b], qi = yi[b];
+      xr[b] = a_r * pr - a_i * pi + b_r * qr - b_i * qi;
+      xi[b] = a_r * pi + a_i * pr + b_r * qi + b_i * qr;
+      yr[b] = c_r * pr - c_i * pi + d_r * qr - d_i * qi;
+      yi[b] = c_r * pi + c_i * pr + d_r * qi + d_i * qr;
+    }
+  }
+}
+
+void BatchState::unitary_1q(size_t qubit, size_t cmask, std::span<const std::array<Complex, 4>> u) {
+  PROFILE_SCOPE("batch_unitary_1q", qubit, 2 * (re.size() + im.size()) * sizeof(double));
+  // split into one array per matrix element and part so the inner loop stays contiguous
+  mat_buf.resize(8 * batch);
+  for (size_t b = 0; b < batch; b++) {
+    for (size_t k = 0; k < 4; k++) {
+      mat_buf[2 * k * batch + b] = u[b][k].real();
+      mat_buf[(2 * k + 1) * batch + b] = u[b][k].imag();
+    }
+  }
+  const double* ar = &mat_buf[0];
+  const double* ai = &mat_buf[batch];
+  const double* br = &mat_buf[2 * batch];
+  const double* bi = &mat_buf[3 * batch];
+  const double* cr = &mat_buf[4 * batch];
+  const double* ci = &mat_buf[5 * batch];
+  const double* dr = &mat_buf[6 * batch];
+  const double* di = &mat_buf[7 * batch];
+
+  const size_t bit = 1ULL << qubit;
+  const size_t dim = 1ULL << n;
+  for (size_t i = 0; i < dim; i++) {
+    if ((i & bit) != 0 || (i & cmask) != cmask)
+      continue;
+    double* __restrict xr = &re[i * batch];
+    double* __restrict xi = &im[i * batch];
+    double* __restrict yr = &re[(i | bit) * batch];
+    double* __restrict yi = &im[(i | bit) * batch];
+    IVDEP
+    for (size_t b = 0; b < batch; b++) {
+      double pr = xr[b], pi = xi[b], qr = yr[b], qi = yi[b];
+      xr[b] = ar[b] * pr - ai[b] * pi + br[b] * qr - bi[b] * qi;
+      xi[b] = ar[b] * pi + ai[b] * pr + br[b] * qi + bi[b] * qr;
+      yr[b] = cr[b] * pr - ci[b] * pi + dr[b] * qr - di[b] * qi;
+      yi[b] = cr[b] * pi + ci[b] * pr + dr[b] * qi + di[b] * qr;
+    }
+  }
+}
+
+void BatchState::swap_blocks(size_t i, size_t j, std::span<const uint8_t> active) {
+  double* ar = &re[i * batch];
+  double* ai = &im[i * batch];
+  double* br = &re[j * batch];
+  double* bi = &im[j * batch];
+  if (active.empty()) {
+    std::swap_ranges(ar, ar + batch, br);
+    std::swap_ranges(ai, ai + batch, bi);
+    return;
+  }
+  for (size_t b = 0; b < batch; b++) {
+    if (active[b]) {
+      std::swap(ar[b], br[b]);
+      std::swap(ai[b], bi[b]);
+    }
+  }
+}
+
+void BatchState::apply_x(size_t qubit, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_x", qubit, 2 * (re.size() + im.size()) * sizeof(double));
+  const size_t bit = 1ULL << qubit;
+  for (size_t i = 0; i < (1ULL << n); i++) {
+    if ((i & bit) == 0)
+      swap_blocks(i, i | bit, active);
+  }
+}
+
+void BatchState::apply_cnot(size_t cntrl, size_t qubit, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_cnot", qubit, (re.size() + im.size()) * sizeof(double));
+  const size_t bit = 1ULL << qubit;
+  const size_t control_bit = 1ULL << cntrl;
+  for (size_t i = 0; i < (1ULL << n); i++) {
+    if ((i & control_bit) != 0 && (i & bit) == 0)
+      swap_blocks(i, i | bit, active);
+  }
+}
+
+void BatchState::apply_swap(size_t qubit1, size_t qubit2, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_swap", qubit1, (re.size() + im.size()) * sizeof(double));
+  const size_t bit1 = 1ULL << qubit1;
+  const size_t bit2 = 1ULL << qubit2;
+  for (size_t i = 0; i < (1ULL << n); i++) {
+    if ((i & bit1) != 0 && (i & bit2) == 0)
+      swap_blocks(i, i ^ bit1 ^ bit2, active);
+  }
+}
+
+void BatchState::apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_toffoli", qubit, (re.size() + im.size()) * sizeof(double) / 2);
+  const size_t bit = 1ULL << qubit;
+  const size_t control_bits = (1ULL << cntrl1) | (1ULL << cntrl2);
+  for (size_t i = 0; i < (1ULL << n); i++) {
+    if ((i & control_bits) == control_bits && (i & bit) == 0)
+      swap_blocks(i, i | bit, active);
+  }
+}
+
+void BatchState::apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_cswap", qubit1, (re.size() + im.size()) * sizeof(double) / 4);
+  const size_t bit1 = 1ULL << qubit1;
+  const size_t bit2 = 1ULL << qubit2;
+  const size_t control_bit = 1ULL << cntrl;
+  for (size_t i = 0; i < (1ULL << n); i++) {
+    if ((i & control_bit) != 0 && (i & bit1) != 0 && (i & bit2) == 0)
+      swap_blocks(i, i ^ bit1 ^ bit2, active);
+  }
+}
+
+// same sampling as QuantumState::measure: one uniform per measured state from its own rng
+void BatchState::measure(size_t qubit, std::span<uint8_t> results, std::span<const uint8_t> active) {
+  PROFILE_SCOPE("batch_measure", qubit, 3 * (re.size() + im.size()) * sizeof(double) / 2);
+  const size_t bit = 1ULL << qubit;
+  const size_t dim = 1ULL << n;
+
+  auto& prob = prob_buf; // [0, batch) outcome 0, [batch, 2 * batch) outcome 1
+  prob.assign(2 * batch, 0.0);
+  for (size_t i = 0; i < dim; i++) {
+    double* p = &prob[((i & bit) != 0) * batch];
+    const double* xr = &re[i * batch];
+    const double* xi = &im[i * batch];
+    for (size_t b = 0; b < batch; b++)
+      p[b] += xr[b] * xr[b] + xi[b] * xi[b];
+  }
+
+  // scale[b] for amplitudes with the bit clear, scale[batch + b] with it set
+  auto& scale = scale_buf;
+  scale.assign(2 * batch, 1.0);
+  for (size_t b = 0; b < batch; b++) {
+    if (!active.empty() && !active[b])
+      continue;
+    double p0 = prob[b], p1 = prob[batch + b];
+    if (p0 < EPS && p1 < EPS) {
+      throw std::runtime_error("At least one probability must be non-zero");
+    }
+    else if (p0 < EPS) {
+      p0 = 0.0;
+      p1 = 1.0;
+    }
+    else if (p1 < EPS) {
+      p0 = 1.0;
+      p1 = 0.0;
+    }
+    else {
+      const double norm = 1 / (p0 + p1);
+      p0 *= norm;
+      p1 *= norm;
+    }
+
+    size_t res = (rngs[b].uniform() < p1) ? 1 : 0;
+    results[b] = static_cast<uint8_t>(res);
+    scale[b] = res ? 0.0 : 1.0 / std::sqrt(p0);
+    scale[batch + b] = res ? 1.0 / std::sqrt(p1) : 0.0;
+  }
+
+  for (size_t i = 0; i < dim; i++) {
+    const double* s = &scale[((i & bit) != 0) * batch];
+    double* xr = &re[i * batch];
+    double* xi = &im[i * batch];
+    for (size_t b = 0; b < batch; b++) {
+      xr[b] *= s[b];
+      xi[b] *= s[b];
+    }
+  }
+}
+
+void BatchState::reset(size_t qubit, std::span<const uint8_t> active) {
+  results_buf.assign(batch, 0);
+  measure(qubit, results_buf, active);
+  // measure leaves inactive states' results at 0, so they're never flipped
+  apply_x(qubit, results_buf);
+}
+
+void BatchState::extract(size_t b, QuantumState& qs) const {
+  qs.init_dense(n);
+  for (size_t i = 0; i < qs.psi.size(); i++)
+    qs.psi.set(i, Complex(re[i * batch + b], im[i * batch + b]));
+}
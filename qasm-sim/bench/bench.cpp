@@ -0,0 +1,290 @@
+// qasm-sim-bench: gate kernel throughput, lexer throughput and end-to-end
+// circuit timings, written as one JSON document so runs can be diffed across releases
+
+#include "batch.h"
+#include "circuit.h"
+#include "lexer.h"
+#include "quantum_state.h"
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <format>
+#include <numbers>
+#include <optional>
+#include <print>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  size_t max_qubits = 22;
+  double min_time = 0.2;  // seconds per measurement
+  size_t lexer_mb = 64;   // size of the generated lexer input
+  std::string out_path;   // stdout when empty
+};
+
+static double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// runs fn until min_time has passed, returns (reps, seconds)
+static std::pair<size_t, double> time_reps(double min_time, const std::function<void()>& fn) {
+  fn(); // warm up, faults in pages
+  size_t reps = 0;
+  auto start = Clock::now();
+  double elapsed = 0.0;
+  do {
+    fn();
+    ++reps;
+    elapsed = seconds_since(start);
+  } while (elapsed < min_time);
+  return { reps, elapsed };
+}
+
+struct KernelCase {
+  std::string_view name;
+  std::function<void(QuantumState&, size_t)> apply;
+};
+
+static std::vector<KernelCase> kernel_cases() {
+  const double c = std::cos(0.3), s = std::sin(0.3);
+  return {
+    { "apply_unitary_1q", [=](QuantumState& qs, size_t t) { qs.apply_unitary_1q(t, c, -s, s, c); } },
+    { "apply_controlled_unitary_1q", [=](QuantumState& qs, size_t t) { qs.apply_controlled_unitary_1q((t + 1) % qs.n, t, c, -s, s, c); } },
+    { "apply_phase", [=](QuantumState& qs, size_t t) { qs.apply_unitary_1q(t, 1.0, 0.0, 0.0, Complex(c, s)); } },
+    { "apply_hadamard", [](QuantumState& qs, size_t t) { qs.apply_hadamard(t); } },
+    { "apply_s", [](QuantumState& qs, size_t t) { qs.apply_s(t); } },
+    { "apply_x", [](QuantumState& qs, size_t t) { qs.apply_x(t); qs.flush(); } },
+    { "apply_y", [](QuantumState& qs, size_t t) { qs.apply_y(t); } },
+    { "apply_z", [](QuantumState& qs, size_t t) { qs.apply_z(t); } },
+    { "apply_cnot", [](QuantumState& qs, size_t t) { qs.apply_cnot((t + 1) % qs.n, t); qs.flush(); } },
+    { "apply_toffoli", [](QuantumState& qs, size_t t) { qs.apply_toffoli((t + 1) % qs.n, (t + 2) % qs.n, t); qs.flush(); } },
+  };
+}
+
+static void bench_kernels(const BenchOptions& opts, std::vector<std::string>& rows) {
+  for (size_t n = 10; n <= opts.max_qubits; n += 4) {
+    QuantumState qs(n, 0, Rng(1));
+    // spread the amplitude so no kernel sees a trivially sparse state
+    for (size_t q = 0; q < n; q++)
+      qs.apply_hadamard(q);
+
+    const double bytes = 2.0 * static_cast<double>(qs.psi.size() * sizeof(Complex)); // read + write
+    for (const auto& k : kernel_cases()) {
+      for (size_t t : { size_t(0), size_t(1), size_t(3), n / 2, n - 1 }) {
+        auto [reps, secs] = time_reps(opts.min_time, [&] { k.apply(qs, t); });
+        double gates_per_s = reps / secs;
+        rows.push_back(std::format(
+          "{{\"kernel\": \"{}\", \"qubits\": {}, \"target\": {}, \"gates_per_s\": {:.1f}, \"gb_per_s\": {:.3f}}}",
+          k.name, n, t, gates_per_s, gates_per_s * bytes / 1e9));
+      }
+    }
+  }
+}
+
+// representative program text: declarations, comments, gate calls with float params
+static std::string generate_qasm(size_t target_bytes) {
+  std::string src = "OPENQASM 3.0;\ninclude \"stdgates.inc\";\n// generated benchmark input\nqubit[32] q;\nbit[32] c;\n";
+  Rng rng(7);
+  size_t line = 0;
+  while (src.size() < target_bytes) {
+    size_t a = rng() % 32, b = (a + 1 + rng() % 31) % 32;
+    switch (line++ % 6) {
+    case 0: src += std::format("h q[{}];\n", a); break;
+    case 1: src += std::format("rz({:.12f}) q[{}];\n", rng.uniform() * std::numbers::pi, a); break;
+    case 2: src += std::format("cx q[{}], q[{}];\n", a, b); break;
+    case 3: src += std::format("U({:.6f}, {:.6f}, 0.5e-3) q[{}]; // rotation {}\n", rng.uniform(), rng.uniform(), a, line); break;
+    case 4: src += "/* block comment\n   spanning lines */\n"; break;
+    case 5: src += std::format("c[{}] = measure q[{}];\n", a, a); break;
+    }
+  }
+  return src;
+}
+
+static void bench_lexer(const BenchOptions& opts, std::vector<std::string>& rows) {
+  const std::string src = generate_qasm(opts.lexer_mb << 20);
+  size_t num_toks = 0;
+  auto [reps, secs] = time_reps(opts.min_time, [&] {
+    Lexer lex(src);
+    if (auto ok = lex.lex_all(); !ok)
+      ok.error().print();
+    num_toks = lex.toks.size();
+  });
+  double per_run = secs / reps;
+  rows.push_back(std::format(
+    "{{\"bytes\": {}, \"tokens\": {}, \"mb_per_s\": {:.2f}, \"tokens_per_s\": {:.1f}}}",
+    src.size(), num_toks, src.size() / per_run / 1e6, num_toks / per_run));
+}
+
+static std::string qft_source(size_t n) {
+  std::string src = std::format("include \"stdgates.inc\";\nqubit[{}] q;\n", n);
+  for (size_t i = 0; i < n; i++) {
+    src += std::format("h q[{}];\n", i);
+    for (size_t j = i + 1; j < n; j++) {
+      double theta = std::numbers::pi / static_cast<double>(1ULL << (j - i));
+      src += std::format("cp({}) q[{}], q[{}];\n", theta, j, i);
+    }
+  }
+  return src;
+}
+
+static std::string ghz_source(size_t n) {
+  std::string src = std::format("include \"stdgates.inc\";\nqubit[{}] q;\nbit[{}] c;\nh q[0];\n", n, n);
+  for (size_t i = 1; i < n; i++)
+    src += std::format("cx q[0], q[{}];\n", i);
+  src += "c = measure q;\n";
+  return src;
+}
+
+static std::string random_source(size_t n, size_t depth) {
+  std::string src = std::format("include \"stdgates.inc\";\nqubit[{}] q;\n", n);
+  Rng rng(1234);
+  for (size_t d = 0; d < depth; d++) {
+    for (size_t i = 0; i < n; i++) {
+      switch (rng() % 5) {
+      case 0: src += std::format("h q[{}];\n", i); break;
+      case 1: src += std::format("t q[{}];\n", i); break;
+      case 2: src += std::format("rx({}) q[{}];\n", rng.uniform(), i); break;
+      case 3: src += std::format("rz({}) q[{}];\n", rng.uniform(), i); break;
+      case 4: src += std::format("cx q[{}], q[{}];\n", i, (i + 1 + rng() % (n - 1)) % n); break;
+      }
+    }
+  }
+  return src;
+}
+
+static void bench_circuit(const BenchOptions& opts, std::string_view name, const std::string& src, std::vector<std::string>& rows) {
+  std::optional<Circuit> circ;
+  auto [fe_reps, fe_secs] = time_reps(opts.min_time, [&] {
+    Lexer lex(src);
+    if (auto ok = lex.lex_all(); !ok) {
+      ok.error().print();
+      return;
+    }
+    auto c = Circuit::compile(lex);
+    if (!c) {
+      c.error().print();
+      return;
+    }
+    circ = std::move(*c);
+  });
+  if (!circ)
+    return;
+
+  QuantumState qs(circ->num_qubits, 0, Rng(1));
+  std::vector<double> param_vals;
+  std::vector<uint8_t> clbits;
+  circ->bind({}, param_vals);
+  auto [ex_reps, ex_secs] = time_reps(opts.min_time, [&] {
+    qs.init(circ->num_qubits, 0);
+    circ->execute(qs, param_vals, clbits);
+    qs.flush();
+  });
+
+  // per-state time when run through the batched engine the way sweeps run small circuits
+  std::string batch_ms = "null";
+  if (circ->num_qubits <= BATCH_MAX_QUBITS) {
+    const size_t batch = SweepOptions{}.batch_size;
+    BatchState bs(circ->num_qubits, batch);
+    std::vector<double> batch_params;
+    for (size_t b = 0; b < batch; b++)
+      batch_params.insert(batch_params.end(), param_vals.begin(), param_vals.end());
+    auto [b_reps, b_secs] = time_reps(opts.min_time, [&] {
+      bs.init();
+      circ->execute_batch(bs, batch_params, clbits);
+    });
+    batch_ms = std::format("{:.4f}", 1e3 * b_secs / b_reps / batch);
+  }
+
+  rows.push_back(std::format(
+    "{{\"circuit\": \"{}\", \"qubits\": {}, \"ops\": {}, \"frontend_ms\": {:.4f}, \"execute_ms\": {:.4f}, \"batch_execute_ms\": {}}}",
+    name, circ->num_qubits, circ->ops.size(), 1e3 * fe_secs / fe_reps, 1e3 * ex_secs / ex_reps, batch_ms));
+}
+
+static void bench_circuits(const BenchOptions& opts, std::vector<std::string>& rows) {
+  for (size_t n = 8; n <= opts.max_qubits; n += 6) {
+    bench_circuit(opts, std::format("qft_{}", n), qft_source(n), rows);
+    bench_circuit(opts, std::format("ghz_{}", n), ghz_source(n), rows);
+    bench_circuit(opts, std::format("random_{}x{}", n, 20), random_source(n, 20), rows);
+  }
+
+  std::error_code ec;
+  for (const auto& entry : std::filesystem::directory_iterator(QASM_SIM_EXAMPLES_DIR, ec)) {
+    if (entry.path().extension() != ".qasm")
+      continue;
+    std::ifstream file(entry.path(), std::ios::binary);
+    std::string src((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    bench_circuit(opts, entry.path().filename().string(), src, rows);
+  }
+}
+
+static std::string json_array(const std::vector<std::string>& rows) {
+  std::string out = "[";
+  for (size_t i = 0; i < rows.size(); i++) {
+    out += (i == 0) ? "\n    " : ",\n    ";
+    out += rows[i];
+  }
+  out += "\n  ]";
+  return out;
+}
+
+static bool parse_args(int argc, char** argv, BenchOptions& opts) {
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    if (i + 1 >= argc)
+      return false;
+    const char* val = argv[++i];
+    const char* end = val + std::strlen(val);
+    std::from_chars_result res{end, std::errc()};
+
+    if (arg == "--out")
+      opts.out_path = val;
+    else if (arg == "--max-qubits")
+      res = std::from_chars(val, end, opts.max_qubits);
+    else if (arg == "--min-time")
+      res = std::from_chars(val, end, opts.min_time);
+    else if (arg == "--lexer-mb")
+      res = std::from_chars(val, end, opts.lexer_mb);
+    else
+      return false;
+
+    if (res.ec != std::errc() || res.ptr != end)
+      return false;
+  }
+  return opts.max_qubits >= 10;
+}
+
+int main(int argc, char** argv) {
+  BenchOptions opts;
+  if (!parse_args(argc, argv, opts)) {
+    std::println(stderr, "usage: qasm-sim-bench [--out results.json] [--max-qubits n (>= 10)] [--min-time seconds] [--lexer-mb n]");
+    return 1;
+  }
+
+  std::vector<std::string> kernels, lexer, circuits;
+  bench_kernels(opts, kernels);
+  bench_lexer(opts, lexer);
+  bench_circuits(opts, circuits);
+
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  std::string json = std::format(
+    "{{\n  \"timestamp\": {},\n  \"max_qubits\": {},\n  \"kernels\": {},\n  \"lexer\": {},\n  \"circuits\": {}\n}}\n",
+    std::chrono::duration_cast<std::chrono::seconds>(now).count(), opts.max_qubits,
+    json_array(kernels), json_array(lexer), json_array(circuits));
+
+  if (opts.out_path.empty()) {
+    std::print("{}", json);
+    return 0;
+  }
+  std::ofstream out(opts.out_path, std::ios::binary);
+  out << json;
+  if (!out) {
+    std::println(stderr, "Error writing {}", opts.out_path);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,211 @@
+#include "checkpoint.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+static constexpr char CKPT_MAGIC[8] = { 'Q', 'S', 'I', 'M', 'C', 'K', 'P', 'T' };
+static constexpr uint32_t CKPT_VERSION = 3; // 1 stored an mt19937 state, 2 every qubit densely
+static constexpr uint64_t CKPT_COMPRESSED = 1;
+static constexpr size_t CKPT_CHUNK_AMPS = 1ULL << 16; // 1 MiB of amplitudes
+static constexpr size_t CKPT_ALIGN = 4096;
+static constexpr uint64_t CKPT_OUTSIDE = UINT64_MAX;
+
+// runs fn(chunk) for every chunk in [0, num_chunks), spread over num_threads threads
+template <typename Fn>
+static void parallel_chunks(size_t num_chunks, size_t num_threads, Fn fn) {
+  if (num_threads == 0)
+    num_threads = std::thread::hardware_concurrency();
+  num_threads = std::clamp<size_t>(num_threads, 1, num_chunks);
+
+  auto work = [&](size_t t) {
+    for (size_t c = t; c < num_chunks; c += num_threads)
+      fn(c);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; t++)
+    threads.emplace_back(work, t);
+  work(0);
+  for (auto& th : threads)
+    th.join();
+}
+
+static size_t align_up(size_t v, size_t a) {
+  return (v + a - 1) / a * a;
+}
+
+std::expected<void, CheckpointError> save_state(const QuantumState& qs, const std::string& path,
+                                                const CheckpointInfo& info, const CheckpointOptions& opts) {
+  if (qs.n > CHECKPOINT_MAX_QUBITS)
+    return std::unexpected(CheckpointError{CheckpointError::Code::too_wide, path});
+  qs.flush();
+  std::vector<uint64_t> qubit_map(qs.n);
+  for (size_t q = 0; q < qs.n; q++)
+    qubit_map[q] = qs.qubit_map[q] == QuantumState::UNALLOCATED ? CKPT_OUTSIDE : qs.qubit_map[q];
+
+  const size_t num_amps = qs.psi.size();
+  const size_t chunk_amps = std::min(CKPT_CHUNK_AMPS, num_amps);
+  const size_t num_chunks = (num_amps + chunk_amps - 1) / chunk_amps;
+  auto chunk_len = [&](size_t c) { return std::min(chunk_amps, num_amps - c * chunk_amps); };
+
+  // chunk table and where each stored chunk lands in the data section
+  std::vector<uint8_t> stored(num_chunks, 1);
+  if (opts.compress) {
+    parallel_chunks(num_chunks, opts.num_threads, [&](size_t c) {
+      stored[c] = !qs.psi.is_zero(c * chunk_amps, chunk_len(c));
+    });
+  }
+  std::vector<size_t> dest(num_chunks);
+  size_t data_len = 0;
+  for (size_t c = 0; c < num_chunks; c++) {
+    dest[c] = data_len;
+    data_len += stored[c] ? chunk_len(c) * sizeof(Complex) : 0;
+  }
+
+  CheckpointHeader hdr = {};
+  std::memcpy(hdr.magic, CKPT_MAGIC, sizeof(CKPT_MAGIC));
+  hdr.version = CKPT_VERSION;
+  hdr.precision = sizeof(Complex::value_type);
+  hdr.num_qubits = qs.n;
+  hdr.width = qs.width;
+  hdr.chunk_amps = chunk_amps;
+  hdr.num_chunks = num_chunks;
+  hdr.flags = opts.compress ? CKPT_COMPRESSED : 0;
+  hdr.next_op = info.next_op;
+  hdr.num_clbits = info.clbits.size();
+  hdr.rng_len = sizeof(Rng);
+  size_t meta_len = sizeof(hdr) + hdr.rng_len + hdr.num_clbits + qs.n * (sizeof(uint64_t) + 1) + (opts.compress ? num_chunks : 0);
+  hdr.data_offset = align_up(meta_len, CKPT_ALIGN);
+
+  const std::string tmp_path = path + ".tmp";
+  {
+    MappedFile out;
+    if (!out.create(tmp_path, hdr.data_offset + data_len))
+      return std::unexpected(CheckpointError{CheckpointError::Code::open_failed, tmp_path});
+
+    char* p = out.data;
+    std::memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    std::memcpy(p, &qs.rng, sizeof(Rng));
+    p += sizeof(Rng);
+    std::memcpy(p, info.clbits.data(), info.clbits.size());
+    p += info.clbits.size();
+    std::memcpy(p, qubit_map.data(), qs.n * sizeof(uint64_t));
+    p += qs.n * sizeof(uint64_t);
+    std::memcpy(p, qs.basis_vals.data(), qs.n);
+    p += qs.n;
+    if (opts.compress)
+      std::memcpy(p, stored.data(), num_chunks);
+
+    // the file always holds interleaved amplitudes, whatever the in-memory layout
+    char* data = out.data + hdr.data_offset;
+    parallel_chunks(num_chunks, opts.num_threads, [&](size_t c) {
+      if (stored[c])
+        qs.psi.read(c * chunk_amps, std::span<Complex>(reinterpret_cast<Complex*>(data + dest[c]), chunk_len(c)));
+    });
+
+    if (!out.sync())
+      return std::unexpected(CheckpointError{CheckpointError::Code::write_failed, tmp_path});
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec)
+    return std::unexpected(CheckpointError{CheckpointError::Code::write_failed, path});
+  return {};
+}
+
+std::expected<CheckpointInfo, CheckpointError> load_state(QuantumState& qs, const std::string& path, size_t num_qubits,
+                                                          size_t num_clbits, size_t num_threads) {
+  MappedFile in;
+  if (!in.open_read(path))
+    return std::unexpected(CheckpointError{CheckpointError::Code::open_failed, path});
+
+  CheckpointHeader hdr;
+  if (in.size < sizeof(hdr))
+    return std::unexpected(CheckpointError{CheckpointError::Code::truncated, path});
+  std::memcpy(&hdr, in.data, sizeof(hdr));
+
+  if (std::memcmp(hdr.magic, CKPT_MAGIC, sizeof(CKPT_MAGIC)) != 0)
+    return std::unexpected(CheckpointError{CheckpointError::Code::bad_magic, path});
+  if (hdr.version != CKPT_VERSION)
+    return std::unexpected(CheckpointError{CheckpointError::Code::bad_version, path});
+  if (hdr.precision != sizeof(Complex::value_type))
+    return std::unexpected(CheckpointError{CheckpointError::Code::bad_precision, path});
+
+  if (hdr.num_qubits > CHECKPOINT_MAX_QUBITS || hdr.width > hdr.num_qubits)
+    return std::unexpected(CheckpointError{CheckpointError::Code::corrupt, path});
+  const bool compressed = (hdr.flags & CKPT_COMPRESSED) != 0;
+  const size_t num_amps = 1ULL << hdr.width;
+  if (hdr.rng_len != sizeof(Rng) || hdr.chunk_amps == 0 || hdr.num_chunks != (num_amps + hdr.chunk_amps - 1) / hdr.chunk_amps)
+    return std::unexpected(CheckpointError{CheckpointError::Code::corrupt, path});
+  if (hdr.num_qubits != num_qubits || hdr.num_clbits != num_clbits)
+    return std::unexpected(CheckpointError{CheckpointError::Code::wrong_size, path});
+
+  size_t meta_len = sizeof(hdr) + hdr.rng_len + hdr.num_clbits + hdr.num_qubits * (sizeof(uint64_t) + 1) +
+                    (compressed ? hdr.num_chunks : 0);
+  if (in.size < meta_len || hdr.data_offset < meta_len || in.size < hdr.data_offset)
+    return std::unexpected(CheckpointError{CheckpointError::Code::truncated, path});
+
+  const char* p = in.data + sizeof(hdr);
+  Rng rng;
+  std::memcpy(&rng, p, sizeof(Rng));
+  p += sizeof(Rng);
+
+  CheckpointInfo info;
+  info.next_op = hdr.next_op;
+  info.clbits.assign(p, p + hdr.num_clbits);
+  p += hdr.num_clbits;
+
+  // every qubit in the amplitudes on a bit of its own, every bit below width taken
+  std::vector<size_t> qubit_map(hdr.num_qubits);
+  std::vector<uint8_t> basis_vals(p + hdr.num_qubits * sizeof(uint64_t), p + hdr.num_qubits * (sizeof(uint64_t) + 1));
+  uint64_t taken = 0;
+  for (size_t q = 0; q < hdr.num_qubits; q++) {
+    uint64_t pos;
+    std::memcpy(&pos, p + q * sizeof(uint64_t), sizeof(pos));
+    if (pos == CKPT_OUTSIDE) {
+      qubit_map[q] = QuantumState::UNALLOCATED;
+      basis_vals[q] &= 1;
+      continue;
+    }
+    if (pos >= hdr.width || (taken >> pos) & 1)
+      return std::unexpected(CheckpointError{CheckpointError::Code::corrupt, path});
+    taken |= uint64_t(1) << pos;
+    qubit_map[q] = pos;
+    basis_vals[q] = 0;
+  }
+  if (taken != num_amps - 1)
+    return std::unexpected(CheckpointError{CheckpointError::Code::corrupt, path});
+  p += hdr.num_qubits * (sizeof(uint64_t) + 1);
+
+  const size_t num_chunks = hdr.num_chunks;
+  const size_t chunk_amps = hdr.chunk_amps;
+  auto chunk_len = [&](size_t c) { return std::min(chunk_amps, num_amps - c * chunk_amps); };
+
+  std::vector<uint8_t> stored(num_chunks, 1);
+  if (compressed)
+    std::memcpy(stored.data(), p, num_chunks);
+  std::vector<size_t> src(num_chunks);
+  size_t data_len = 0;
+  for (size_t c = 0; c < num_chunks; c++) {
+    src[c] = data_len;
+    data_len += stored[c] ? chunk_len(c) * sizeof(Complex) : 0;
+  }
+  if (in.size - hdr.data_offset < data_len)
+    return std::unexpected(CheckpointError{CheckpointError::Code::truncated, path});
+
+  qs.init_layout(qubit_map, basis_vals, hdr.width);
+  const char* data = in.data + hdr.data_offset;
+  parallel_chunks(num_chunks, num_threads, [&](size_t c) {
+    if (stored[c])
+      qs.psi.write(c * chunk_amps, std::span<const Complex>(reinterpret_cast<const Complex*>(data + src[c]), chunk_len(c)));
+    else
+      qs.psi.fill(c * chunk_amps, chunk_len(c), Complex(0.0, 0.0));
+  });
+
+  qs.rng = rng;
+  return info;
+}
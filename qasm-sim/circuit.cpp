@@ -0,0 +1,1493 @@
+#include "circuit.h"
+#include "parser.h"
+#include "profiler.h"
+#include <bit>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <optional>
+#include <unordered_map>
+
+struct GateEntry {
+  std::string_view text;
+  OpKind kind;
+};
+
+// stdgates.inc names that map to the same op, plus the builtin U
+static constexpr GateEntry gate_aliases[] = {
+  {"CX", OpKind::CX},
+  {"u1", OpKind::P},
+  {"u3", OpKind::U},
+  {"phase", OpKind::P},
+  {"cphase", OpKind::CP},
+};
+
+struct ConstEntry {
+  std::string_view text;
+  double val;
+};
+
+static constexpr ConstEntry const_lut[] = {
+  {"pi", std::numbers::pi},
+  {"tau", 2.0 * std::numbers::pi},
+  {"euler", std::numbers::e},
+};
+
+struct FuncEntry {
+  std::string_view text;
+  ParamInstr::Code code;
+};
+
+static constexpr FuncEntry func_lut[] = {
+  {"sin", ParamInstr::Code::SIN},
+  {"cos", ParamInstr::Code::COS},
+  {"tan", ParamInstr::Code::TAN},
+  {"arcsin", ParamInstr::Code::ARCSIN},
+  {"arccos", ParamInstr::Code::ARCCOS},
+  {"arctan", ParamInstr::Code::ARCTAN},
+  {"exp", ParamInstr::Code::EXP},
+  {"ln", ParamInstr::Code::LN},
+  {"sqrt", ParamInstr::Code::SQRT},
+};
+
+static constexpr size_t MAX_EXPR_DEPTH = ParamExpr::MAX_DEPTH;
+
+double ParamExpr::eval(std::span<const double> inputs) const {
+  double stack[MAX_EXPR_DEPTH];
+  size_t top = 0;
+
+  for (const auto& in : code) {
+    using enum ParamInstr::Code;
+    switch (in.code) {
+    case CONST: stack[top++] = in.val; break;
+    case INPUT: stack[top++] = inputs[in.input]; break;
+    case NEG: stack[top - 1] = -stack[top - 1]; break;
+    case ADD: --top; stack[top - 1] += stack[top]; break;
+    case SUB: --top; stack[top - 1] -= stack[top]; break;
+    case MUL: --top; stack[top - 1] *= stack[top]; break;
+    case DIV: --top; stack[top - 1] /= stack[top]; break;
+    case POW: --top; stack[top - 1] = std::pow(stack[top - 1], stack[top]); break;
+    case SIN: stack[top - 1] = std::sin(stack[top - 1]); break;
+    case COS: stack[top - 1] = std::cos(stack[top - 1]); break;
+    case TAN: stack[top - 1] = std::tan(stack[top - 1]); break;
+    case ARCSIN: stack[top - 1] = std::asin(stack[top - 1]); break;
+    case ARCCOS: stack[top - 1] = std::acos(stack[top - 1]); break;
+    case ARCTAN: stack[top - 1] = std::atan(stack[top - 1]); break;
+    case EXP: stack[top - 1] = std::exp(stack[top - 1]); break;
+    case LN: stack[top - 1] = std::log(stack[top - 1]); break;
+    case SQRT: stack[top - 1] = std::sqrt(stack[top - 1]); break;
+    }
+  }
+
+  return stack[0];
+}
+
+bool Condition::holds(std::span<const uint8_t> clbits) const {
+  uint64_t v = 0;
+  for (uint32_t i = 0; i < num_clbits; i++) {
+    v |= static_cast<uint64_t>(clbits[first_clbit + i]) << i;
+  }
+  return (v == value) != negate;
+}
+
+void Circuit::bind(std::span<const double> input_vals, std::vector<double>& param_vals) const {
+  param_vals.resize(params.size());
+  for (size_t i = 0; i < params.size(); i++) {
+    param_vals[i] = params[i].eval(input_vals);
+  }
+}
+
+void Circuit::execute(QuantumState& qs, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const {
+  clbits.assign(num_clbits, 0);
+  execute_range(qs, param_vals, clbits, 0, ops.size());
+}
+
+// { u00, u01, u10, u11 } for the single qubit gates other than x,
+// and the matrix applied to the target for the controlled ones
+static std::array<Complex, 4> gate_matrix(OpKind kind, std::array<double, 4> p) {
+  static const double SQRT1_2 = 1.0 / std::sqrt(2.0);
+  static const Complex I(0.0, 1.0);
+
+  switch (kind) {
+  case OpKind::H:
+    return { SQRT1_2, SQRT1_2, SQRT1_2, -SQRT1_2 };
+  case OpKind::Y:
+    return { 0.0, -I, I, 0.0 };
+  case OpKind::Z:
+    return { 1.0, 0.0, 0.0, -1.0 };
+  case OpKind::S:
+    return { 1.0, 0.0, 0.0, I };
+  case OpKind::SDG:
+    return { 1.0, 0.0, 0.0, -I };
+  case OpKind::T:
+    return { 1.0, 0.0, 0.0, Complex(SQRT1_2, SQRT1_2) };
+  case OpKind::TDG:
+    return { 1.0, 0.0, 0.0, Complex(SQRT1_2, -SQRT1_2) };
+  case OpKind::SX:
+    return { Complex(0.5, 0.5), Complex(0.5, -0.5), Complex(0.5, -0.5), Complex(0.5, 0.5) };
+  case OpKind::RX: {
+    double c = std::cos(p[0] / 2), s = std::sin(p[0] / 2);
+    return { c, Complex(0.0, -s), Complex(0.0, -s), c };
+  }
+  case OpKind::RY: {
+    double c = std::cos(p[0] / 2), s = std::sin(p[0] / 2);
+    return { c, -s, s, c };
+  }
+  case OpKind::RZ:
+    return { std::polar(1.0, -p[0] / 2), 0.0, 0.0, std::polar(1.0, p[0] / 2) };
+  case OpKind::P:
+    return { 1.0, 0.0, 0.0, std::polar(1.0, p[0]) };
+  case OpKind::U: {
+    double theta = p[0], phi = p[1], lambda = p[2];
+    double c = std::cos(theta / 2), s = std::sin(theta / 2);
+    return { c, -std::polar(s, lambda), std::polar(s, phi), std::polar(c, phi + lambda) };
+  }
+  case OpKind::U2:
+    return gate_matrix(OpKind::U, { std::numbers::pi / 2, p[0], p[1] });
+  case OpKind::CY:
+    return gate_matrix(OpKind::Y, p);
+  case OpKind::CZ:
+    return gate_matrix(OpKind::Z, p);
+  case OpKind::CP:
+    return gate_matrix(OpKind::P, p);
+  case OpKind::CRX:
+    return gate_matrix(OpKind::RX, p);
+  case OpKind::CRY:
+    return gate_matrix(OpKind::RY, p);
+  case OpKind::CRZ:
+    return gate_matrix(OpKind::RZ, p);
+  case OpKind::CH:
+    return gate_matrix(OpKind::H, p);
+  case OpKind::CU: {
+    // U(theta, phi, lambda) with the global phase gamma, which the control makes relative
+    auto u = gate_matrix(OpKind::U, p);
+    for (auto& x : u)
+      x *= std::polar(1.0, p[3]);
+    return u;
+  }
+  default:
+    return { 1.0, 0.0, 0.0, 1.0 };
+  }
+}
+
+// the qubits of a qft or iqft op, most significant first
+static std::vector<size_t> qft_qubits(const Op& op) {
+  std::vector<size_t> a(op.count);
+  for (size_t k = 0; k < a.size(); k++)
+    a[k] = op.qubits[1] ? op.qubit(a.size() - 1 - k) : op.qubit(k);
+  return a;
+}
+
+static void apply_op(QuantumState& qs, const Op& op, std::span<const double> param_vals, std::vector<uint8_t>& clbits) {
+  auto& q = op.qubits;
+  auto param = [&](size_t k) { return k < gate_info[size_t(op.kind)].num_params ? param_vals[op.params[k]] : 0.0; };
+
+  // a transform's count is its width, not a broadcast
+  const bool transform = op.kind == OpKind::QFT || op.kind == OpKind::IQFT;
+  if (op.count > 1 && !transform) {
+    std::vector<size_t> reg(op.count);
+    for (size_t k = 0; k < reg.size(); k++)
+      reg[k] = op.qubit(k);
+    if (op.kind == OpKind::MEASURE) {
+      std::vector<uint8_t> res(op.count);
+      qs.measure_register(reg, res);
+      if (op.clbit != NO_CLBIT)
+        std::copy(res.begin(), res.end(), clbits.begin() + op.clbit);
+    }
+    else if (op.kind == OpKind::RESET)
+      qs.reset_register(reg);
+    else if (op.kind == OpKind::H)
+      qs.apply_hadamard_register(reg);
+    else if (op.kind != OpKind::ID) {
+      auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+      qs.apply_unitary_register(reg, u[0], u[1], u[2], u[3]);
+    }
+    return;
+  }
+
+  switch (op.kind) {
+  case OpKind::ID:
+    break;
+  case OpKind::H:
+    qs.apply_hadamard(q[0]);
+    break;
+  case OpKind::X:
+    qs.apply_x(q[0]);
+    break;
+  case OpKind::Y:
+    qs.apply_y(q[0]);
+    break;
+  case OpKind::Z:
+    qs.apply_z(q[0]);
+    break;
+  case OpKind::S:
+    qs.apply_s(q[0]);
+    break;
+  case OpKind::SDG:
+  case OpKind::T:
+  case OpKind::TDG:
+  case OpKind::SX:
+  case OpKind::RX:
+  case OpKind::RY:
+  case OpKind::RZ:
+  case OpKind::P:
+  case OpKind::U:
+  case OpKind::U2: {
+    auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+    qs.apply_unitary_1q(q[0], u[0], u[1], u[2], u[3]);
+    break;
+  }
+  case OpKind::CX:
+    qs.apply_cnot(q[0], q[1]);
+    break;
+  case OpKind::CZ:
+    qs.apply_controlled_phase(q[0], q[1], -1.0);
+    break;
+  case OpKind::CP:
+    qs.apply_controlled_phase(q[0], q[1], std::polar(1.0, param(0)));
+    break;
+  case OpKind::CY:
+  case OpKind::CRX:
+  case OpKind::CRY:
+  case OpKind::CRZ:
+  case OpKind::CH:
+  case OpKind::CU: {
+    auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+    qs.apply_controlled_unitary_1q(q[0], q[1], u[0], u[1], u[2], u[3]);
+    break;
+  }
+  case OpKind::SWAP:
+    qs.apply_swap(q[0], q[1]);
+    break;
+  case OpKind::CCX:
+    qs.apply_toffoli(q[0], q[1], q[2]);
+    break;
+  case OpKind::CSWAP:
+    qs.apply_cswap(q[0], q[1], q[2]);
+    break;
+  case OpKind::MEASURE: {
+    size_t res = qs.measure(q[0]);
+    if (op.clbit != NO_CLBIT)
+      clbits[op.clbit] = static_cast<uint8_t>(res);
+    break;
+  }
+  case OpKind::RESET:
+    qs.reset(q[0]);
+    break;
+  case OpKind::BARRIER:
+    break;
+  case OpKind::QFT:
+  case OpKind::IQFT:
+    qs.apply_qft(qft_qubits(op), op.kind == OpKind::IQFT);
+    break;
+  }
+}
+
+// a broadcast single qubit gate, which back to back ones on the same register can merge into
+static bool is_register_gate(const Op& op) {
+  return op.cond == NO_COND && op.count > 1 && op.kind < OpKind::MEASURE;
+}
+
+// single qubit gates that go through the unitary kernels, which a layer can take over.
+// x is left out since it's queued as a permutation anyway
+static bool is_layer_gate(const Op& op) {
+  if (op.cond != NO_COND || op.count > 1 || op.kind >= OpKind::MEASURE || op.kind == OpKind::ID || op.kind == OpKind::X)
+    return false;
+  return gate_info[size_t(op.kind)].num_qubits == 1;
+}
+
+// picks out a layer of single qubit gates on distinct qubits from the ops after
+// first, which can all be applied before the ops they skip over. a gate is taken
+// if no skipped op touched its qubit, so every skipped op either shares no qubit
+// with the layer or comes after the layer's gate on it. measurements, resets and
+// conditioned ops end the search, since what follows depends on their outcome
+struct LayerScan {
+  static constexpr size_t WINDOW = 256; // ops looked at per layer
+
+  std::vector<uint8_t> taken;   // per qubit
+  std::vector<uint8_t> blocked; // per qubit, touched by a skipped op
+  std::vector<uint32_t> touched;
+  std::vector<uint32_t> gates; // op indices in the layer, ascending
+
+  LayerScan(size_t num_qubits) : taken(num_qubits, 0), blocked(num_qubits, 0) {}
+
+  // fills gates, returns the end of the ops scanned
+  size_t scan(std::span<const Op> ops, size_t first, size_t last) {
+    for (auto q : touched)
+      taken[q] = blocked[q] = 0;
+    touched.clear();
+    gates.clear();
+
+    size_t i = first;
+    for (; i < last && i - first < WINDOW && gates.size() < QuantumState::LAYER_MAX_QUBITS; i++) {
+      const Op& op = ops[i];
+      if (op.cond != NO_COND || op.kind == OpKind::MEASURE || op.kind == OpKind::RESET)
+        break;
+      if (is_layer_gate(op) && !taken[op.qubits[0]] && !blocked[op.qubits[0]]) {
+        taken[op.qubits[0]] = 1;
+        touched.push_back(op.qubits[0]);
+        gates.push_back(static_cast<uint32_t>(i));
+        continue;
+      }
+      for (size_t k = 0; k < op.num_qubits(); k++) {
+        blocked[op.qubit(k)] = 1;
+        touched.push_back(op.qubit(k));
+      }
+    }
+    return i;
+  }
+};
+
+void Circuit::execute_range(QuantumState& qs, std::span<const double> param_vals, std::vector<uint8_t>& clbits,
+                            size_t first_op, size_t last_op) const {
+  PROFILE_SCOPE("execute", PROFILE_NO_QUBIT, 0);
+
+  auto run = [&](size_t i) {
+    const Op& op = ops[i];
+    if (op.cond != NO_COND && !conds[op.cond].holds(clbits))
+      return;
+    // a gate right before a measurement of its qubit sums the probabilities for it
+    if (i + 1 < last_op && ops[i + 1].kind == OpKind::MEASURE && ops[i + 1].count == 1 && op.count == 1 &&
+        op.kind < OpKind::MEASURE && gate_info[size_t(op.kind)].num_qubits == 1 && ops[i + 1].qubits[0] == op.qubits[0])
+      qs.expect_measure(op.qubits[0]);
+    apply_op(qs, op, param_vals, clbits);
+  };
+
+  // below this many qubits psi stays in cache and a pass per gate is cheap
+  static constexpr size_t LAYER_MIN_QUBITS = 12;
+  if (qs.n < LAYER_MIN_QUBITS) {
+    for (size_t i = first_op; i < last_op; i++)
+      run(i);
+    return;
+  }
+
+  auto matrix = [&](const Op& op) {
+    auto param = [&](size_t k) { return k < gate_info[size_t(op.kind)].num_params ? param_vals[op.params[k]] : 0.0; };
+    return gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+  };
+
+  LayerScan layer(qs.n);
+  std::vector<size_t> qubits;
+  std::vector<std::array<Complex, 4>> mats;
+  size_t i = first_op;
+  while (i < last_op) {
+    if (is_register_gate(ops[i])) {
+      // h q; rz(t) q; ... is one pass over psi with the product of the matrices
+      const Op& op = ops[i];
+      size_t end = i + 1;
+      while (end < last_op && is_register_gate(ops[end]) && ops[end].qubits[0] == op.qubits[0] && ops[end].count == op.count)
+        end++;
+      if (end - i < 2) {
+        run(i++);
+        continue;
+      }
+      auto m = matrix(op);
+      for (size_t j = i + 1; j < end; j++) {
+        auto a = matrix(ops[j]);
+        m = { a[0] * m[0] + a[1] * m[2], a[0] * m[1] + a[1] * m[3],
+              a[2] * m[0] + a[3] * m[2], a[2] * m[1] + a[3] * m[3] };
+      }
+      qubits.clear();
+      for (size_t k = 0; k < op.count; k++)
+        qubits.push_back(op.qubit(k));
+      qs.apply_unitary_register(qubits, m[0], m[1], m[2], m[3]);
+      i = end;
+      continue;
+    }
+    if (!is_layer_gate(ops[i])) {
+      run(i++);
+      continue;
+    }
+    size_t end = layer.scan(ops, i, last_op);
+    if (layer.gates.size() < 2) {
+      run(i++);
+      continue;
+    }
+
+    qubits.clear();
+    mats.clear();
+    for (auto g : layer.gates) {
+      qubits.push_back(ops[g].qubits[0]);
+      mats.push_back(matrix(ops[g]));
+    }
+    qs.apply_unitary_layer(qubits, mats);
+
+    size_t next = 0;
+    for (; i < end; i++) {
+      if (next < layer.gates.size() && layer.gates[next] == i)
+        next++;
+      else
+        run(i);
+    }
+  }
+}
+
+// a qft or iqft op as the gates it stands for, for states the transform doesn't pay
+// off on. h(q) applies a hadamard and cp(c, t, theta) a controlled phase
+template <typename H, typename CP>
+static void qft_gates(const Op& op, H h, CP cp) {
+  const auto a = qft_qubits(op);
+  const bool inverse = op.kind == OpKind::IQFT;
+  for (size_t n = 0; n < a.size(); n++) {
+    const size_t j = inverse ? a.size() - 1 - n : n;
+    if (!inverse)
+      h(a[j]);
+    for (size_t k = j + 1; k < a.size(); k++)
+      cp(a[k], a[j], std::ldexp(inverse ? -std::numbers::pi : std::numbers::pi, -static_cast<int>(k - j)));
+    if (inverse)
+      h(a[j]);
+  }
+}
+
+void Circuit::execute_batch(BatchState& bs, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const {
+  PROFILE_SCOPE("execute_batch", PROFILE_NO_QUBIT, 0);
+  const size_t batch = bs.batch;
+  const size_t stride = params.size();
+  clbits.assign(batch * num_clbits, 0);
+  std::vector<uint8_t> active(batch), results(batch);
+  std::vector<std::array<Complex, 4>> mats(batch);
+
+  for (const auto& op : ops) {
+    // states whose condition fails sit this op out
+    std::span<const uint8_t> mask;
+    if (op.cond != NO_COND) {
+      size_t count = 0;
+      for (size_t b = 0; b < batch; b++) {
+        active[b] = conds[op.cond].holds(std::span(clbits).subspan(b * num_clbits, num_clbits));
+        count += active[b];
+      }
+      if (count == 0)
+        continue;
+      if (count < batch)
+        mask = active;
+    }
+
+    const size_t num_params = op.kind < OpKind::MEASURE ? gate_info[size_t(op.kind)].num_params : 0;
+    auto param = [&](size_t b, size_t k) { return k < num_params ? param_vals[b * stride + op.params[k]] : 0.0; };
+
+    if (op.kind == OpKind::QFT || op.kind == OpKind::IQFT) {
+      // batch states are too small for the transform to pay off
+      const double s = 1.0 / std::sqrt(2.0);
+      qft_gates(op, [&](size_t q) { bs.apply_unitary_1q(q, s, s, s, -s, mask); },
+                [&](size_t c, size_t t, double theta) {
+                  bs.apply_controlled_unitary_1q(c, t, 1.0, 0.0, 0.0, std::polar(1.0, theta), mask);
+                });
+      continue;
+    }
+
+    // register wide ops run qubit by qubit here, batch states are small
+    for (uint32_t r = 0; r < op.count; r++) {
+      auto q = op.qubits;
+      q[0] += r;
+      switch (op.kind) {
+      case OpKind::ID:
+        break;
+      case OpKind::X:
+        bs.apply_x(q[0], mask);
+        break;
+      case OpKind::CX:
+        bs.apply_cnot(q[0], q[1], mask);
+        break;
+      case OpKind::SWAP:
+        bs.apply_swap(q[0], q[1], mask);
+        break;
+      case OpKind::CCX:
+        bs.apply_toffoli(q[0], q[1], q[2], mask);
+        break;
+      case OpKind::CSWAP:
+        bs.apply_cswap(q[0], q[1], q[2], mask);
+        break;
+      case OpKind::MEASURE:
+        bs.measure(q[0], results, mask);
+        if (op.clbit != NO_CLBIT) {
+          for (size_t b = 0; b < batch; b++) {
+            if (mask.empty() || mask[b])
+              clbits[b * num_clbits + op.clbit + r] = results[b];
+          }
+        }
+        break;
+      case OpKind::RESET:
+        bs.reset(q[0], mask);
+        break;
+      case OpKind::BARRIER:
+        break;
+      default: {
+        // single qubit gates, and the controlled ones with the control in q[0]
+        const bool controlled = gate_info[size_t(op.kind)].num_qubits == 2;
+        // gates whose parameters don't depend on inputs are the same matrix for every state
+        bool uniform = true;
+        for (size_t k = 0; k < num_params; k++)
+          uniform = uniform && params[op.params[k]].is_const();
+
+        if (uniform) {
+          auto u = gate_matrix(op.kind, { param(0, 0), param(0, 1), param(0, 2), param(0, 3) });
+          if (controlled)
+            bs.apply_controlled_unitary_1q(q[0], q[1], u[0], u[1], u[2], u[3], mask);
+          else
+            bs.apply_unitary_1q(q[0], u[0], u[1], u[2], u[3], mask);
+          break;
+        }
+        for (size_t b = 0; b < batch; b++) {
+          if (mask.empty() || mask[b])
+            mats[b] = gate_matrix(op.kind, { param(b, 0), param(b, 1), param(b, 2), param(b, 3) });
+          else
+            mats[b] = { 1.0, 0.0, 0.0, 1.0 };
+        }
+        if (controlled)
+          bs.apply_controlled_unitary_1q(q[0], q[1], mats);
+        else
+          bs.apply_unitary_1q(q[0], mats);
+        break;
+      }
+      }
+    }
+  }
+}
+
+static bool is_stabilizer_op(OpKind k) {
+  switch (k) {
+  case OpKind::ID:
+  case OpKind::H:
+  case OpKind::X:
+  case OpKind::Y:
+  case OpKind::Z:
+  case OpKind::S:
+  case OpKind::SDG:
+  case OpKind::SX:
+  case OpKind::CX:
+  case OpKind::CY:
+  case OpKind::CZ:
+  case OpKind::SWAP:
+  case OpKind::MEASURE:
+  case OpKind::RESET:
+  case OpKind::BARRIER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// one op on a single qubit range element, broadcasts having been split up by the caller
+static void apply_op(StabilizerSum& ss, const Op& op, std::span<const double> param_vals, std::vector<uint8_t>& clbits) {
+  auto& q = op.qubits;
+  auto param = [&](size_t k) { return k < gate_info[size_t(op.kind)].num_params ? param_vals[op.params[k]] : 0.0; };
+
+  switch (op.kind) {
+  case OpKind::ID:
+  case OpKind::BARRIER:
+  case OpKind::QFT:
+  case OpKind::IQFT:
+    break;
+  case OpKind::H:
+    ss.apply_hadamard(q[0]);
+    break;
+  case OpKind::X:
+    ss.apply_unitary_1q(q[0], 0.0, 1.0, 1.0, 0.0);
+    break;
+  case OpKind::Y:
+  case OpKind::Z:
+  case OpKind::S:
+  case OpKind::SDG:
+  case OpKind::T:
+  case OpKind::TDG:
+  case OpKind::SX:
+  case OpKind::RX:
+  case OpKind::RY:
+  case OpKind::RZ:
+  case OpKind::P:
+  case OpKind::U:
+  case OpKind::U2: {
+    auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+    ss.apply_unitary_1q(q[0], u[0], u[1], u[2], u[3]);
+    break;
+  }
+  case OpKind::CX:
+    ss.apply_cnot(q[0], q[1]);
+    break;
+  case OpKind::CZ:
+    ss.apply_cz(q[0], q[1]);
+    break;
+  case OpKind::CP:
+    ss.apply_controlled_phase(q[0], q[1], std::polar(1.0, param(0)));
+    break;
+  case OpKind::CY:
+  case OpKind::CRX:
+  case OpKind::CRY:
+  case OpKind::CRZ:
+  case OpKind::CH:
+  case OpKind::CU: {
+    auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+    ss.apply_controlled_unitary_1q(q[0], q[1], u[0], u[1], u[2], u[3]);
+    break;
+  }
+  case OpKind::SWAP:
+    ss.apply_swap(q[0], q[1]);
+    break;
+  case OpKind::CCX:
+    ss.apply_toffoli(q[0], q[1], q[2]);
+    break;
+  case OpKind::CSWAP:
+    ss.apply_cswap(q[0], q[1], q[2]);
+    break;
+  case OpKind::MEASURE: {
+    size_t res = ss.measure(q[0]);
+    if (op.clbit != NO_CLBIT)
+      clbits[op.clbit] = static_cast<uint8_t>(res);
+    break;
+  }
+  case OpKind::RESET:
+    ss.reset(q[0]);
+    break;
+  }
+}
+
+void Circuit::execute(StabilizerSum& ss, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const {
+  PROFILE_SCOPE("execute_stabilizer", PROFILE_NO_QUBIT, 0);
+  clbits.assign(num_clbits, 0);
+  for (const auto& op : ops) {
+    if (op.cond != NO_COND && !conds[op.cond].holds(clbits))
+      continue;
+    if (op.kind == OpKind::QFT || op.kind == OpKind::IQFT) {
+      qft_gates(op, [&](size_t q) { ss.apply_hadamard(q); },
+                [&](size_t c, size_t t, double theta) { ss.apply_controlled_phase(c, t, std::polar(1.0, theta)); });
+      continue;
+    }
+    Op one = op;
+    one.count = 1;
+    for (size_t r = 0; r < op.count; r++) {
+      one.qubits[0] = op.qubit(r);
+      if (op.kind == OpKind::MEASURE && op.clbit != NO_CLBIT)
+        one.clbit = op.clbit + static_cast<uint32_t>(r);
+      apply_op(ss, one, param_vals, clbits);
+    }
+  }
+}
+
+size_t Circuit::stabilizer_rank(std::span<const double> param_vals) const {
+  static constexpr double EPS = 1e-12;
+  size_t rank = 0;
+  for (const auto& op : ops) {
+    if (is_stabilizer_op(op.kind))
+      continue;
+    if (op.kind == OpKind::QFT || op.kind == OpKind::IQFT) {
+      // every controlled phase but the cz between neighbours, two bits each
+      rank += (op.count - 1) * (op.count - 2);
+      continue;
+    }
+    auto param = [&](size_t k) { return k < gate_info[size_t(op.kind)].num_params ? param_vals[op.params[k]] : 0.0; };
+    auto u = gate_matrix(op.kind, { param(0), param(1), param(2), param(3) });
+    size_t bits = 0;
+    switch (gate_info[size_t(op.kind)].num_qubits) {
+    case 1:
+      if (!StabilizerSum::is_clifford_1q(u))
+        bits = std::bit_width(StabilizerSum::num_paulis(u) - 1);
+      break;
+    case 2:
+      // diagonal controlled gates are 4 paulis, the others up to 8
+      if (op.kind == OpKind::CP)
+        bits = std::abs(u[3] - 1.0) < EPS || std::abs(u[3] + 1.0) < EPS ? 0 : 2;
+      else
+        bits = std::abs(u[1]) < EPS && std::abs(u[2]) < EPS ? 2 : 3;
+      break;
+    default:
+      bits = 3;
+      break;
+    }
+    rank += bits * op.count;
+  }
+  return rank;
+}
+
+// below this many qubits the state vector is cheap whatever the circuit
+static constexpr size_t STABILIZER_MIN_QUBITS = 16;
+// log2 of the most terms, with a margin below the qubits so the terms stay
+// well under the 2^n amplitudes they stand in for
+static constexpr size_t STABILIZER_MAX_RANK = 20;
+static constexpr size_t STABILIZER_RANK_MARGIN = 4;
+
+bool Circuit::prefers_stabilizer_sum(std::span<const double> param_vals) const {
+  if (num_qubits < STABILIZER_MIN_QUBITS)
+    return false;
+  const size_t rank = stabilizer_rank(param_vals);
+  return rank <= STABILIZER_MAX_RANK && rank + STABILIZER_RANK_MARGIN <= num_qubits;
+}
+
+void Circuit::write_cregs(OutputBuffer& out, std::span<const uint8_t> clbits) const {
+  for (const auto& reg : cregs) {
+    out.put(reg.name);
+    out.put(" = ");
+    out.put_bits(clbits.subspan(reg.first, reg.size));
+    out.put('\n');
+  }
+}
+
+// a user include file, lexed once per process and reused until it changes on disk.
+// compiles hold on to the entries they use, so replacing one doesn't pull the text
+// out from under them
+struct IncludeFile {
+  std::string path;
+  std::filesystem::file_time_type mtime;
+  Lexer lex;
+};
+
+static std::mutex include_mutex;
+static std::unordered_map<std::string, std::shared_ptr<IncludeFile>> include_cache;
+
+static std::shared_ptr<IncludeFile> load_include(const std::filesystem::path& path) {
+  std::error_code ec;
+  auto canon = std::filesystem::weakly_canonical(path, ec);
+  if (ec)
+    return nullptr;
+  auto mtime = std::filesystem::last_write_time(canon, ec);
+  if (ec)
+    return nullptr;
+  std::string key = canon.string();
+  {
+    std::lock_guard lock(include_mutex);
+    auto it = include_cache.find(key);
+    if (it != include_cache.end() && it->second->mtime == mtime)
+      return it->second;
+  }
+
+  auto l = Lexer::from_file(key);
+  if (!l || !l->lex_all())
+    return nullptr;
+  auto file = std::make_shared<IncludeFile>(key, mtime, std::move(*l));
+  std::lock_guard lock(include_mutex);
+  include_cache[key] = file;
+  return file;
+}
+
+// a contiguous run of qubits or clbits named by an operand
+struct Slice {
+  uint32_t first;
+  uint32_t size;
+  bool is_reg; // whole register, broadcast over its elements
+};
+
+// lowers the token stream straight to ops. this only covers the straight-line
+// subset of the language; anything else is reported as unsupported
+struct Compiler {
+  static constexpr size_t MAX_INCLUDE_DEPTH = 32;
+
+  Lexer& lex;
+  NameTable& names; // the main file's, names from included files are added to it
+  size_t pos = 0;
+  Circuit circ;
+  std::unordered_map<NameId, size_t> qreg_ids;
+  std::unordered_map<NameId, size_t> creg_ids;
+  std::unordered_map<NameId, uint32_t> input_ids;
+  uint32_t cur_cond = NO_COND;
+
+  std::filesystem::path include_dir;
+  size_t include_depth = 0;
+  std::string file;                               // included file being compiled, for errors
+  std::vector<NameId> remap;                      // its name ids -> ids in names
+  std::vector<std::shared_ptr<IncludeFile>> held; // included files whose names are in use
+
+  Compiler(Lexer& l, NameTable& n, std::filesystem::path dir) : lex(l), names(n), include_dir(std::move(dir)) {}
+
+  NameId name_id(const Token& tok) const { return remap.empty() ? tok.name_id : remap[tok.name_id]; }
+
+  bool at_end() const { return pos >= lex.toks.size(); }
+
+  bool at(TokenKind k, size_t lookahead = 0) const {
+    return pos + lookahead < lex.toks.size() && lex.toks[pos + lookahead].kind == k;
+  }
+
+  std::string_view text(const Token& tok) { return lex.str_from_span(tok.span); }
+
+  CompileError err(CompileError::Code code) {
+    CompileError e;
+    e.code = code;
+    if (at_end()) {
+      e.code = CompileError::Code::unexpected_eof;
+      e.span = {lex.len, 0};
+      e.contents = {};
+    }
+    else {
+      e.span = lex.toks[pos].span;
+      e.contents = lex.str_from_span(e.span);
+    }
+    e.file = file;
+    return e;
+  }
+
+  std::expected<Token, CompileError> expect(TokenKind k) {
+    if (!at(k))
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    return lex.toks[pos++];
+  }
+
+  bool accept(TokenKind k) {
+    if (!at(k))
+      return false;
+    ++pos;
+    return true;
+  }
+
+  std::expected<uint64_t, CompileError> int_lit() {
+    if (!at(TokenKind::DEC_LIT) && !at(TokenKind::HEX_LIT) && !at(TokenKind::OCT_LIT) && !at(TokenKind::BIN_LIT))
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    return lex.toks[pos++].int_val;
+  }
+
+  // optional `[n]` designator, returns dflt when absent
+  std::expected<uint64_t, CompileError> designator(uint64_t dflt) {
+    if (!accept(TokenKind::LBRACKET))
+      return dflt;
+    auto v = int_lit();
+    if (!v)
+      return v;
+    if (auto ok = expect(TokenKind::RBRACKET); !ok)
+      return std::unexpected(ok.error());
+    return v;
+  }
+
+  std::expected<NameId, CompileError> new_name() {
+    if (!at(TokenKind::IDENT))
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    NameId id = name_id(lex.toks[pos]);
+    if (qreg_ids.contains(id) || creg_ids.contains(id) || input_ids.contains(id))
+      return std::unexpected(err(CompileError::Code::redeclared));
+    ++pos;
+    return id;
+  }
+
+  void declare(bool quantum, NameId id, uint64_t size) {
+    auto& regs = quantum ? circ.qregs : circ.cregs;
+    auto& total = quantum ? circ.num_qubits : circ.num_clbits;
+    (quantum ? qreg_ids : creg_ids).emplace(id, regs.size());
+    regs.push_back({std::string(names.get_name(id)), static_cast<uint32_t>(total), static_cast<uint32_t>(size)});
+    total += size;
+  }
+
+  // qubit[n] name; / bit[n] name;
+  std::expected<void, CompileError> new_style_decl(bool quantum) {
+    ++pos;
+    auto size = designator(1);
+    if (!size)
+      return std::unexpected(size.error());
+    auto id = new_name();
+    if (!id)
+      return std::unexpected(id.error());
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+    declare(quantum, *id, *size);
+    return {};
+  }
+
+  // qreg name[n]; / creg name[n];
+  std::expected<void, CompileError> old_style_decl(bool quantum) {
+    ++pos;
+    auto id = new_name();
+    if (!id)
+      return std::unexpected(id.error());
+    auto size = designator(1);
+    if (!size)
+      return std::unexpected(size.error());
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+    declare(quantum, *id, *size);
+    return {};
+  }
+
+  // input float[64] name;
+  std::expected<void, CompileError> input_decl() {
+    ++pos;
+    if (!at(TokenKind::FLOAT) && !at(TokenKind::ANGLE) && !at(TokenKind::INT) && !at(TokenKind::UINT))
+      return std::unexpected(err(CompileError::Code::unsupported));
+    ++pos;
+    if (auto size = designator(0); !size)
+      return std::unexpected(size.error());
+    auto id = new_name();
+    if (!id)
+      return std::unexpected(id.error());
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+    input_ids.emplace(*id, static_cast<uint32_t>(circ.inputs.size()));
+    circ.inputs.emplace_back(names.get_name(*id));
+    return {};
+  }
+
+  std::expected<Slice, CompileError> operand(bool quantum) {
+    if (!at(TokenKind::IDENT))
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    auto& ids = quantum ? qreg_ids : creg_ids;
+    auto it = ids.find(name_id(lex.toks[pos]));
+    if (it == ids.end())
+      return std::unexpected(err(CompileError::Code::unknown_name));
+    ++pos;
+
+    const auto& reg = (quantum ? circ.qregs : circ.cregs)[it->second];
+    if (!at(TokenKind::LBRACKET))
+      return Slice{reg.first, reg.size, true};
+
+    ++pos;
+    size_t idx_pos = pos;
+    auto idx = int_lit();
+    if (!idx)
+      return std::unexpected(idx.error());
+    if (*idx >= reg.size) {
+      pos = idx_pos;
+      return std::unexpected(err(CompileError::Code::bad_index));
+    }
+    if (auto ok = expect(TokenKind::RBRACKET); !ok)
+      return std::unexpected(ok.error());
+    return Slice{reg.first + static_cast<uint32_t>(*idx), 1, false};
+  }
+
+  // broadcast size of a set of operands: registers must agree, single elements repeat
+  std::expected<uint32_t, CompileError> broadcast_size(std::span<const Slice> slices, size_t err_pos) {
+    uint32_t n = 1;
+    for (const auto& s : slices) {
+      if (!s.is_reg)
+        continue;
+      if (n != 1 && s.size != n) {
+        pos = err_pos;
+        return std::unexpected(err(CompileError::Code::bad_operand));
+      }
+      n = s.size;
+    }
+    return n;
+  }
+
+  void emit(Op op) {
+    op.cond = cur_cond;
+    circ.is_stable &= is_stabilizer_op(op.kind);
+    circ.ops.push_back(op);
+  }
+
+  void emit_measure(Slice q, std::optional<Slice> c, uint32_t n) {
+    // a whole register into a whole register is one op, see reset_stmt
+    if (q.is_reg && (!c || c->is_reg) && n > 1 && n <= UINT16_MAX) {
+      Op op{OpKind::MEASURE};
+      op.qubits[0] = q.first;
+      op.count = static_cast<uint16_t>(n);
+      if (c)
+        op.clbit = c->first;
+      emit(op);
+      return;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      Op op{OpKind::MEASURE};
+      op.qubits[0] = q.first + (q.is_reg ? i : 0);
+      if (c)
+        op.clbit = c->first + (c->is_reg ? i : 0);
+      emit(op);
+    }
+  }
+
+  // measure q -> c; / measure q;
+  std::expected<void, CompileError> measure_stmt() {
+    ++pos;
+    size_t op_pos = pos;
+    auto q = operand(true);
+    if (!q)
+      return std::unexpected(q.error());
+
+    std::optional<Slice> c;
+    if (accept(TokenKind::ARROW)) {
+      auto cs = operand(false);
+      if (!cs)
+        return std::unexpected(cs.error());
+      c = *cs;
+    }
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+
+    Slice slices[2] = {*q, c.value_or(*q)};
+    if (c && q->size != c->size) {
+      pos = op_pos;
+      return std::unexpected(err(CompileError::Code::bad_operand));
+    }
+    auto n = broadcast_size(slices, op_pos);
+    if (!n)
+      return std::unexpected(n.error());
+    emit_measure(*q, c, *n);
+    return {};
+  }
+
+  // c = measure q;
+  std::expected<void, CompileError> measure_assign_stmt() {
+    size_t op_pos = pos;
+    auto c = operand(false);
+    if (!c)
+      return std::unexpected(c.error());
+    if (auto ok = expect(TokenKind::EQUALS); !ok)
+      return std::unexpected(ok.error());
+    if (!at(TokenKind::MEASURE))
+      return std::unexpected(err(CompileError::Code::unsupported));
+    ++pos;
+    auto q = operand(true);
+    if (!q)
+      return std::unexpected(q.error());
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+
+    if (q->size != c->size) {
+      pos = op_pos;
+      return std::unexpected(err(CompileError::Code::bad_operand));
+    }
+    emit_measure(*q, *c, q->size);
+    return {};
+  }
+
+  std::expected<void, CompileError> reset_stmt() {
+    ++pos;
+    auto q = operand(true);
+    if (!q)
+      return std::unexpected(q.error());
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+    if (q->size > 1 && q->size <= UINT16_MAX) {
+      Op op{OpKind::RESET};
+      op.qubits[0] = q->first;
+      op.count = static_cast<uint16_t>(q->size);
+      emit(op);
+      return {};
+    }
+    for (uint32_t i = 0; i < q->size; i++) {
+      Op op{OpKind::RESET};
+      op.qubits[0] = q->first + i;
+      emit(op);
+    }
+    return {};
+  }
+
+  // barrier q, r[0]; / barrier; for every qubit declared so far
+  std::expected<void, CompileError> barrier_stmt() {
+    ++pos;
+    std::vector<Slice> slices;
+    if (!at(TokenKind::SEMICOLON)) {
+      do {
+        auto q = operand(true);
+        if (!q)
+          return std::unexpected(q.error());
+        slices.push_back(*q);
+      } while (accept(TokenKind::COMMA));
+    }
+    else {
+      slices.push_back({0, static_cast<uint32_t>(circ.num_qubits), true});
+    }
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+
+    for (const auto& s : slices) {
+      for (uint32_t i = 0; i < s.size; i++) {
+        Op op{OpKind::BARRIER};
+        op.qubits[0] = s.first + i;
+        emit(op);
+      }
+    }
+    return {};
+  }
+
+  std::expected<void, CompileError> expr_primary(ParamExpr& e, size_t depth) {
+    if (depth >= MAX_EXPR_DEPTH)
+      return std::unexpected(err(CompileError::Code::unsupported));
+
+    if (at_end())
+      return std::unexpected(err(CompileError::Code::unexpected_eof));
+
+    const Token& tok = lex.toks[pos];
+    switch (tok.kind) {
+    case TokenKind::DEC_LIT:
+    case TokenKind::HEX_LIT:
+    case TokenKind::OCT_LIT:
+    case TokenKind::BIN_LIT: {
+      auto v = int_lit();
+      if (!v)
+        return std::unexpected(v.error());
+      e.code.push_back({ParamInstr::Code::CONST, 0, static_cast<double>(*v)});
+      return {};
+    }
+    case TokenKind::FLOAT_LIT:
+      ++pos;
+      e.code.push_back({ParamInstr::Code::CONST, 0, tok.float_val});
+      return {};
+    case TokenKind::LPAREN: {
+      ++pos;
+      if (auto ok = expr(e, depth + 1); !ok)
+        return ok;
+      if (auto ok = expect(TokenKind::RPAREN); !ok)
+        return std::unexpected(ok.error());
+      return {};
+    }
+    case TokenKind::IDENT:
+      break;
+    default:
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    }
+
+    std::string_view name = text(tok);
+    for (const auto& c : const_lut) {
+      if (name == c.text) {
+        ++pos;
+        e.code.push_back({ParamInstr::Code::CONST, 0, c.val});
+        return {};
+      }
+    }
+    for (const auto& f : func_lut) {
+      if (name == f.text) {
+        ++pos;
+        if (auto ok = expect(TokenKind::LPAREN); !ok)
+          return std::unexpected(ok.error());
+        if (auto ok = expr(e, depth + 1); !ok)
+          return ok;
+        if (auto ok = expect(TokenKind::RPAREN); !ok)
+          return std::unexpected(ok.error());
+        e.code.push_back({f.code});
+        return {};
+      }
+    }
+    auto it = input_ids.find(name_id(tok));
+    if (it == input_ids.end())
+      return std::unexpected(err(CompileError::Code::unknown_name));
+    ++pos;
+    e.code.push_back({ParamInstr::Code::INPUT, it->second});
+    return {};
+  }
+
+  std::expected<void, CompileError> expr_unary(ParamExpr& e, size_t depth) {
+    if (accept(TokenKind::MINUS)) {
+      if (auto ok = expr_unary(e, depth + 1); !ok)
+        return ok;
+      e.code.push_back({ParamInstr::Code::NEG});
+      return {};
+    }
+    if (auto ok = expr_primary(e, depth); !ok)
+      return ok;
+    // ** is right associative and binds tighter than unary minus on its left
+    if (accept(TokenKind::DOUBLE_ASTERISK)) {
+      if (auto ok = expr_unary(e, depth + 1); !ok)
+        return ok;
+      e.code.push_back({ParamInstr::Code::POW});
+    }
+    return {};
+  }
+
+  std::expected<void, CompileError> expr_mul(ParamExpr& e, size_t depth) {
+    if (auto ok = expr_unary(e, depth); !ok)
+      return ok;
+    while (at(TokenKind::ASTERISK) || at(TokenKind::SLASH)) {
+      auto code = at(TokenKind::ASTERISK) ? ParamInstr::Code::MUL : ParamInstr::Code::DIV;
+      ++pos;
+      if (auto ok = expr_unary(e, depth + 1); !ok)
+        return ok;
+      e.code.push_back({code});
+    }
+    return {};
+  }
+
+  std::expected<void, CompileError> expr(ParamExpr& e, size_t depth) {
+    if (auto ok = expr_mul(e, depth); !ok)
+      return ok;
+    while (at(TokenKind::PLUS) || at(TokenKind::MINUS)) {
+      auto code = at(TokenKind::PLUS) ? ParamInstr::Code::ADD : ParamInstr::Code::SUB;
+      ++pos;
+      if (auto ok = expr_mul(e, depth + 1); !ok)
+        return ok;
+      e.code.push_back({code});
+    }
+    return {};
+  }
+
+  std::expected<ParamId, CompileError> param() {
+    ParamExpr e;
+    if (auto ok = expr(e, 0); !ok)
+      return std::unexpected(ok.error());
+
+    bool is_const = true;
+    for (const auto& in : e.code)
+      is_const &= (in.code != ParamInstr::Code::INPUT);
+    if (is_const)
+      e.code = {{ParamInstr::Code::CONST, 0, e.eval({})}};
+
+    circ.params.push_back(std::move(e));
+    return static_cast<ParamId>(circ.params.size() - 1);
+  }
+
+  std::expected<OpKind, CompileError> gate_kind(std::string_view name) {
+    for (size_t i = 0; i < std::size(gate_info); i++) {
+      if (name == gate_info[i].text)
+        return static_cast<OpKind>(i);
+    }
+    for (const auto& a : gate_aliases) {
+      if (name == a.text)
+        return a.kind;
+    }
+    return std::unexpected(err(CompileError::Code::unknown_gate));
+  }
+
+  // name(params) operands;
+  std::expected<void, CompileError> gate_call() {
+    auto kind = gate_kind(text(lex.toks[pos]));
+    if (!kind)
+      return std::unexpected(kind.error());
+    const auto& info = gate_info[static_cast<size_t>(*kind)];
+    size_t call_pos = pos++;
+
+    Op op{*kind};
+    size_t num_params = 0;
+    if (accept(TokenKind::LPAREN)) {
+      while (!at(TokenKind::RPAREN)) {
+        if (num_params == info.num_params) {
+          pos = call_pos;
+          return std::unexpected(err(CompileError::Code::wrong_num_params));
+        }
+        auto p = param();
+        if (!p)
+          return std::unexpected(p.error());
+        op.params[num_params++] = *p;
+        if (!accept(TokenKind::COMMA))
+          break;
+      }
+      if (auto ok = expect(TokenKind::RPAREN); !ok)
+        return std::unexpected(ok.error());
+    }
+    if (num_params != info.num_params) {
+      pos = call_pos;
+      return std::unexpected(err(CompileError::Code::wrong_num_params));
+    }
+
+    size_t op_pos = pos;
+    Slice slices[3];
+    for (size_t i = 0; i < info.num_qubits; i++) {
+      if (i > 0) {
+        if (auto ok = expect(TokenKind::COMMA); !ok)
+          return std::unexpected(ok.error());
+      }
+      auto s = operand(true);
+      if (!s)
+        return std::unexpected(s.error());
+      slices[i] = *s;
+    }
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+
+    auto n = broadcast_size(std::span(slices, info.num_qubits), op_pos);
+    if (!n)
+      return std::unexpected(n.error());
+
+    // a single qubit gate on a whole register becomes one register wide op. x is
+    // left per qubit since it's queued as a permutation anyway
+    if (info.num_qubits == 1 && *n > 1 && *n <= UINT16_MAX && op.kind != OpKind::X) {
+      op.qubits[0] = slices[0].first;
+      op.count = static_cast<uint16_t>(*n);
+      emit(op);
+      return {};
+    }
+
+    for (uint32_t i = 0; i < *n; i++) {
+      for (size_t k = 0; k < info.num_qubits; k++)
+        op.qubits[k] = slices[k].first + (slices[k].is_reg ? i : 0);
+      for (size_t a = 0; a < info.num_qubits; a++) {
+        for (size_t b = a + 1; b < info.num_qubits; b++) {
+          if (op.qubits[a] == op.qubits[b]) {
+            pos = op_pos;
+            return std::unexpected(err(CompileError::Code::bad_operand));
+          }
+        }
+      }
+      emit(op);
+    }
+    return {};
+  }
+
+  // (c == n), (c[i] == n), (int[k](c) == n), and their != forms
+  std::expected<Condition, CompileError> condition() {
+    if (auto ok = expect(TokenKind::LPAREN); !ok)
+      return std::unexpected(ok.error());
+
+    bool cast = false;
+    if (at(TokenKind::INT) || at(TokenKind::UINT)) {
+      ++pos;
+      if (auto size = designator(0); !size)
+        return std::unexpected(size.error());
+      if (auto ok = expect(TokenKind::LPAREN); !ok)
+        return std::unexpected(ok.error());
+      cast = true;
+    }
+    size_t op_pos = pos;
+    auto c = operand(false);
+    if (!c)
+      return std::unexpected(c.error());
+    if (cast) {
+      if (auto ok = expect(TokenKind::RPAREN); !ok)
+        return std::unexpected(ok.error());
+    }
+    if (c->size > 64) {
+      pos = op_pos;
+      return std::unexpected(err(CompileError::Code::bad_operand));
+    }
+
+    bool negate;
+    if (accept(TokenKind::EQEQ))
+      negate = false;
+    else if (accept(TokenKind::NOTEQ))
+      negate = true;
+    else
+      return std::unexpected(err(CompileError::Code::unsupported));
+
+    uint64_t value;
+    if (at(TokenKind::BOOL_LIT)) {
+      value = (text(lex.toks[pos]) == "true");
+      ++pos;
+    }
+    else {
+      auto v = int_lit();
+      if (!v)
+        return std::unexpected(v.error());
+      value = *v;
+    }
+
+    if (auto ok = expect(TokenKind::RPAREN); !ok)
+      return std::unexpected(ok.error());
+    return Condition{c->first, c->size, value, negate};
+  }
+
+  std::expected<void, CompileError> body() {
+    if (!accept(TokenKind::LBRACE))
+      return stmt();
+    while (!accept(TokenKind::RBRACE)) {
+      if (at_end())
+        return std::unexpected(err(CompileError::Code::unexpected_eof));
+      if (auto ok = stmt(); !ok)
+        return ok;
+    }
+    return {};
+  }
+
+  std::expected<void, CompileError> if_stmt() {
+    // nested conditions would need a conjunction of conditions per op
+    if (cur_cond != NO_COND)
+      return std::unexpected(err(CompileError::Code::unsupported));
+    ++pos;
+    auto cond = condition();
+    if (!cond)
+      return std::unexpected(cond.error());
+
+    circ.conds.push_back(*cond);
+    cur_cond = static_cast<uint32_t>(circ.conds.size() - 1);
+    if (auto ok = body(); !ok)
+      return ok;
+
+    if (accept(TokenKind::ELSE)) {
+      cond->negate = !cond->negate;
+      circ.conds.push_back(*cond);
+      cur_cond = static_cast<uint32_t>(circ.conds.size() - 1);
+      if (auto ok = body(); !ok)
+        return ok;
+    }
+    cur_cond = NO_COND;
+    return {};
+  }
+
+  // moves the program built so far over from another compiler, in and out of included files
+  void take_state(Compiler& from) {
+    circ = std::move(from.circ);
+    qreg_ids = std::move(from.qreg_ids);
+    creg_ids = std::move(from.creg_ids);
+    input_ids = std::move(from.input_ids);
+    held = std::move(from.held);
+    cur_cond = from.cur_cond;
+  }
+
+  // compiles an included file's statements in place, with its names mapped onto ours
+  std::expected<void, CompileError> include_file(std::string_view name) {
+    if (include_depth >= MAX_INCLUDE_DEPTH)
+      return std::unexpected(err(CompileError::Code::include_failed));
+    std::filesystem::path path(name);
+    std::error_code ec;
+    if (path.is_relative() && std::filesystem::exists(include_dir / path, ec))
+      path = include_dir / path;
+    auto inc = load_include(path);
+    if (!inc)
+      return std::unexpected(err(CompileError::Code::include_failed));
+
+    Compiler sub(inc->lex, names, std::filesystem::path(inc->path).parent_path());
+    sub.include_depth = include_depth + 1;
+    sub.file = inc->path;
+    const auto& inc_names = inc->lex.names.id_to_text;
+    sub.remap.resize(inc_names.size());
+    for (size_t id = 0; id < inc_names.size(); id++)
+      sub.remap[id] = names.get_id(inc_names[id]);
+
+    sub.take_state(*this);
+    auto ok = sub.program();
+    take_state(sub);
+    circ.includes.push_back(inc->path);
+    held.push_back(std::move(inc));
+    return ok;
+  }
+
+  // include "file"; the stdgates.inc gates are built in
+  std::expected<void, CompileError> include_stmt() {
+    ++pos;
+    if (!at(TokenKind::STR_LIT))
+      return std::unexpected(err(CompileError::Code::unexpected_token));
+    auto path = text(lex.toks[pos]);
+    path = path.substr(1, path.size() - 2);
+    if (path != "stdgates.inc") {
+      if (auto ok = include_file(path); !ok)
+        return ok;
+    }
+    ++pos;
+    if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+      return std::unexpected(ok.error());
+    return {};
+  }
+
+  std::expected<void, CompileError> stmt() {
+    if (at_end())
+      return std::unexpected(err(CompileError::Code::unexpected_eof));
+    switch (lex.toks[pos].kind) {
+    case TokenKind::OPENQASM: {
+      ++pos;
+      if (auto ok = expect(TokenKind::VERSION_ID); !ok)
+        return std::unexpected(ok.error());
+      if (auto ok = expect(TokenKind::SEMICOLON); !ok)
+        return std::unexpected(ok.error());
+      return {};
+    }
+    case TokenKind::INCLUDE: return include_stmt();
+    case TokenKind::QUBIT: return new_style_decl(true);
+    case TokenKind::BIT: return new_style_decl(false);
+    case TokenKind::QREG: return old_style_decl(true);
+    case TokenKind::CREG: return old_style_decl(false);
+    case TokenKind::INPUT: return input_decl();
+    case TokenKind::MEASURE: return measure_stmt();
+    case TokenKind::RESET: return reset_stmt();
+    case TokenKind::BARRIER: return barrier_stmt();
+    case TokenKind::IF: return if_stmt();
+    case TokenKind::IDENT:
+      if (creg_ids.contains(name_id(lex.toks[pos])))
+        return measure_assign_stmt();
+      return gate_call();
+    default:
+      return std::unexpected(err(CompileError::Code::unsupported));
+    }
+  }
+
+  std::expected<void, CompileError> program() {
+    while (!at_end()) {
+      if (auto ok = stmt(); !ok)
+        return ok;
+    }
+    return {};
+  }
+};
+
+std::expected<Circuit, CompileError> Circuit::compile(Lexer& lex, const std::filesystem::path& include_dir) {
+  PROFILE_SCOPE("compile", PROFILE_NO_QUBIT, lex.len);
+  Compiler c(lex, lex.names, include_dir);
+  const NameId num_names = lex.names.next_id;
+  auto ok = c.program();
+  // names only seen in included files view into their text, which may go once c does
+  lex.names.truncate(num_names);
+  if (!ok)
+    return std::unexpected(ok.error());
+  return std::move(c.circ);
+}
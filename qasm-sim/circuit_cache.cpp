@@ -0,0 +1,342 @@
+#include "circuit_cache.h"
+#include "mapped_file.h"
+#include "profiler.h"
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <format>
+
+#ifndef QASM_SIM_VERSION
+#define QASM_SIM_VERSION "unknown"
+#endif
+
+static constexpr char CACHE_MAGIC[8] = { 'Q', 'S', 'I', 'M', 'C', 'I', 'R', 'C' };
+static constexpr uint32_t CACHE_VERSION = 6; // bump when Circuit or its parts change shape
+static constexpr uint64_t CACHE_STABLE = 1;
+
+static constexpr uint64_t H1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t H2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t H3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t in) {
+  acc += in * H2;
+  return std::rotl(acc, 31) * H1;
+}
+
+static inline uint64_t load64(const char* p) {
+  uint64_t w;
+  std::memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// four independent lanes over 32 byte blocks, then the tail, then a final mix
+uint64_t source_hash(std::string_view source) {
+  PROFILE_SCOPE("source_hash", PROFILE_NO_QUBIT, source.size());
+  const char* p = source.data();
+  const size_t n = source.size();
+  uint64_t v[4] = { H1 + H2, H2, 0, 0 - H1 };
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (size_t k = 0; k < 4; k++)
+      v[k] = hash_round(v[k], load64(p + i + 8 * k));
+  }
+  uint64_t h = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) + std::rotl(v[3], 18) + n;
+  for (; i + 8 <= n; i += 8)
+    h = std::rotl(h ^ hash_round(0, load64(p + i)), 27) * H1 + H3;
+  for (; i < n; i++)
+    h = std::rotl(h ^ (static_cast<unsigned char>(p[i]) * H3), 11) * H1;
+  h ^= h >> 33;
+  h *= H2;
+  h ^= h >> 29;
+  h *= H3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t gate_table_hash() {
+  std::string table;
+  for (const auto& g : gate_info)
+    table += std::format("{}/{}/{};", g.text, g.num_params, g.num_qubits);
+  return source_hash(table);
+}
+
+std::string cache_path(const std::string& dir, std::string_view source) {
+  return (std::filesystem::path(dir) / std::format("{:016x}.qcirc", source_hash(source))).string();
+}
+
+static size_t align_up(size_t v, size_t a) {
+  return (v + a - 1) / a * a;
+}
+
+// where each section starts, shared by save and load
+struct CacheLayout {
+  size_t ops;
+  size_t conds;
+  size_t param_offsets;
+  size_t instrs;
+  size_t regs;
+  size_t inputs;
+  size_t strings;
+  size_t total;
+};
+
+// false if the counts in hdr can't describe a file that fits in max_len bytes
+static bool cache_layout(const CacheHeader& hdr, size_t max_len, CacheLayout& out) {
+  if (hdr.num_params >= max_len || hdr.num_qregs >= max_len || hdr.num_cregs >= max_len)
+    return false;
+  size_t end = align_up(sizeof(CacheHeader), 8);
+  auto section = [&](uint64_t count, size_t elem, size_t& at) {
+    if (count > max_len / elem)
+      return false;
+    at = end;
+    end = align_up(end + count * elem, 8);
+    return end <= max_len;
+  };
+  return section(hdr.num_ops, sizeof(Op), out.ops) &&
+         section(hdr.num_conds, sizeof(Condition), out.conds) &&
+         section(hdr.num_params + 1, sizeof(uint64_t), out.param_offsets) &&
+         section(hdr.num_instrs, sizeof(ParamInstr), out.instrs) &&
+         section(hdr.num_qregs + hdr.num_cregs, sizeof(CacheReg), out.regs) &&
+         section(hdr.num_inputs, sizeof(CacheStr), out.inputs) &&
+         section(hdr.strings_len, 1, out.strings) &&
+         ((out.total = end), true);
+}
+
+static uint64_t file_checksum(CacheHeader hdr, std::string_view payload) {
+  hdr.checksum = 0;
+  return hash_round(source_hash({ reinterpret_cast<const char*>(&hdr), sizeof(hdr) }), source_hash(payload));
+}
+
+static void fill_identity(CacheHeader& hdr, std::string_view source) {
+  std::memcpy(hdr.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  hdr.version = CACHE_VERSION;
+  hdr.op_size = sizeof(Op);
+  std::strncpy(hdr.sim_version, QASM_SIM_VERSION, sizeof(hdr.sim_version) - 1);
+  hdr.gate_table = gate_table_hash();
+  hdr.source_hash = source_hash(source);
+  hdr.source_len = source.size();
+}
+
+std::expected<void, CacheError> save_circuit(const Circuit& circ, std::string_view source, const std::string& path) {
+  PROFILE_SCOPE("save_circuit", PROFILE_NO_QUBIT, circ.ops.size() * sizeof(Op));
+  std::string strings;
+  auto add_str = [&](std::string_view s) {
+    CacheStr r{ static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(s.size()) };
+    strings += s;
+    return r;
+  };
+  std::vector<CacheReg> regs;
+  for (const auto* list : { &circ.qregs, &circ.cregs }) {
+    for (const auto& reg : *list)
+      regs.push_back({ add_str(reg.name), reg.first, reg.size });
+  }
+  std::vector<CacheStr> inputs;
+  for (const auto& in : circ.inputs)
+    inputs.push_back(add_str(in));
+  std::vector<uint64_t> param_offsets = { 0 };
+  for (const auto& p : circ.params)
+    param_offsets.push_back(param_offsets.back() + p.code.size());
+
+  CacheHeader hdr = {};
+  fill_identity(hdr, source);
+  hdr.num_qubits = circ.num_qubits;
+  hdr.num_clbits = circ.num_clbits;
+  hdr.flags = circ.is_stable ? CACHE_STABLE : 0;
+  hdr.num_ops = circ.ops.size();
+  hdr.num_conds = circ.conds.size();
+  hdr.num_params = circ.params.size();
+  hdr.num_instrs = param_offsets.back();
+  hdr.num_qregs = circ.qregs.size();
+  hdr.num_cregs = circ.cregs.size();
+  hdr.num_inputs = circ.inputs.size();
+  hdr.strings_len = strings.size();
+
+  CacheLayout at;
+  cache_layout(hdr, SIZE_MAX, at);
+
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+  const std::string tmp_path = path + ".tmp";
+  {
+    MappedFile out;
+    if (!out.create(tmp_path, at.total))
+      return std::unexpected(CacheError{CacheError::Code::open_failed, tmp_path});
+
+    char* p = out.data;
+    std::memcpy(p + at.ops, circ.ops.data(), circ.ops.size() * sizeof(Op));
+    std::memcpy(p + at.conds, circ.conds.data(), circ.conds.size() * sizeof(Condition));
+    std::memcpy(p + at.param_offsets, param_offsets.data(), param_offsets.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < circ.params.size(); i++) {
+      const auto& code = circ.params[i].code;
+      std::memcpy(p + at.instrs + param_offsets[i] * sizeof(ParamInstr), code.data(), code.size() * sizeof(ParamInstr));
+    }
+    std::memcpy(p + at.regs, regs.data(), regs.size() * sizeof(CacheReg));
+    std::memcpy(p + at.inputs, inputs.data(), inputs.size() * sizeof(CacheStr));
+    std::memcpy(p + at.strings, strings.data(), strings.size());
+    hdr.checksum = file_checksum(hdr, { p + at.ops, at.total - at.ops });
+    std::memcpy(p, &hdr, sizeof(hdr));
+
+    if (!out.sync())
+      return std::unexpected(CacheError{CacheError::Code::write_failed, tmp_path});
+  }
+
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec)
+    return std::unexpected(CacheError{CacheError::Code::write_failed, path});
+  return {};
+}
+
+// every index in circ stays inside the arrays it points into
+// replays the stack depth eval would reach, which must stay within its fixed stack,
+// never pop an empty one and end on exactly the result
+static bool expr_valid(const ParamExpr& p, size_t num_inputs) {
+  size_t depth = 0;
+  for (const auto& in : p.code) {
+    using enum ParamInstr::Code;
+    switch (in.code) {
+    case INPUT:
+      if (in.input >= num_inputs)
+        return false;
+      [[fallthrough]];
+    case CONST:
+      if (++depth > ParamExpr::MAX_DEPTH)
+        return false;
+      break;
+    case ADD: case SUB: case MUL: case DIV: case POW:
+      if (depth < 2)
+        return false;
+      depth--;
+      break;
+    case NEG: case SIN: case COS: case TAN: case ARCSIN: case ARCCOS: case ARCTAN: case EXP: case LN: case SQRT:
+      if (depth < 1)
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return depth == 1;
+}
+
+static bool indices_valid(const Circuit& circ) {
+  for (const auto& op : circ.ops) {
+    size_t num_qubits = 1;
+    const bool transform = op.kind == OpKind::QFT || op.kind == OpKind::IQFT;
+    if (op.count == 0 || (transform && op.qubits[1] > 1))
+      return false;
+    if (op.count > 1 && op.kind != OpKind::RESET && op.kind != OpKind::MEASURE && !transform && (op.kind >= OpKind::MEASURE || gate_info[static_cast<size_t>(op.kind)].num_qubits != 1))
+      return false;
+    if (op.kind < OpKind::MEASURE) {
+      const auto& info = gate_info[static_cast<size_t>(op.kind)];
+      num_qubits = info.num_qubits;
+      for (size_t k = 0; k < info.num_params; k++) {
+        if (op.params[k] >= circ.params.size())
+          return false;
+      }
+    }
+    else if (op.kind > OpKind::IQFT) {
+      return false;
+    }
+    if (op.count > 1 && op.qubits[0] + static_cast<uint64_t>(op.count) > circ.num_qubits)
+      return false;
+    for (size_t k = 0; k < num_qubits; k++) {
+      if (op.qubits[k] >= circ.num_qubits)
+        return false;
+    }
+    if (op.kind == OpKind::MEASURE && op.clbit != NO_CLBIT && op.clbit + static_cast<uint64_t>(op.count) > circ.num_clbits)
+      return false;
+    if (op.cond != NO_COND && op.cond >= circ.conds.size())
+      return false;
+  }
+  for (const auto& c : circ.conds) {
+    if (c.num_clbits > 64 || c.first_clbit + static_cast<uint64_t>(c.num_clbits) > circ.num_clbits)
+      return false;
+  }
+  for (const auto& p : circ.params) {
+    if (!expr_valid(p, circ.inputs.size()))
+      return false;
+  }
+  return true;
+}
+
+std::expected<Circuit, CacheError> load_circuit(std::string_view source, const std::string& path) {
+  MappedFile in;
+  if (!in.open_read(path))
+    return std::unexpected(CacheError{CacheError::Code::open_failed, path});
+  PROFILE_SCOPE("load_circuit", PROFILE_NO_QUBIT, in.size);
+
+  CacheHeader hdr;
+  if (in.size < sizeof(hdr))
+    return std::unexpected(CacheError{CacheError::Code::truncated, path});
+  std::memcpy(&hdr, in.data, sizeof(hdr));
+  if (std::memcmp(hdr.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+    return std::unexpected(CacheError{CacheError::Code::bad_magic, path});
+
+  CacheHeader want = {};
+  fill_identity(want, source);
+  if (hdr.version != want.version || hdr.op_size != want.op_size ||
+      std::memcmp(hdr.sim_version, want.sim_version, sizeof(hdr.sim_version)) != 0 ||
+      hdr.gate_table != want.gate_table || hdr.source_len != want.source_len || hdr.source_hash != want.source_hash)
+    return std::unexpected(CacheError{CacheError::Code::stale, path});
+
+  CacheLayout at;
+  if (!cache_layout(hdr, in.size, at))
+    return std::unexpected(CacheError{CacheError::Code::truncated, path});
+  const char* p = in.data;
+  if (file_checksum(hdr, { p + at.ops, at.total - at.ops }) != hdr.checksum)
+    return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+
+  // registers are declared back to back from bit 0, so they have to add up to the
+  // qubit and clbit counts. checked before either count sizes anything
+  Circuit circ;
+  std::string_view strings(p + at.strings, hdr.strings_len);
+  auto get_str = [&](CacheStr s, std::string& out) {
+    if (s.offset > strings.size() || s.len > strings.size() - s.offset)
+      return false;
+    out = strings.substr(s.offset, s.len);
+    return true;
+  };
+  const auto* regs = reinterpret_cast<const CacheReg*>(p + at.regs);
+  uint64_t reg_qubits = 0, reg_clbits = 0;
+  for (size_t i = 0; i < hdr.num_qregs + hdr.num_cregs; i++) {
+    const bool quantum = i < hdr.num_qregs;
+    uint64_t& total = quantum ? reg_qubits : reg_clbits;
+    Register reg{ {}, regs[i].first, regs[i].size };
+    if (!get_str(regs[i].name, reg.name) || reg.first != total)
+      return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+    total += reg.size;
+    (quantum ? circ.qregs : circ.cregs).push_back(std::move(reg));
+  }
+  if (reg_qubits != hdr.num_qubits || reg_clbits != hdr.num_clbits)
+    return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+
+  circ.num_qubits = hdr.num_qubits;
+  circ.num_clbits = hdr.num_clbits;
+  circ.is_stable = (hdr.flags & CACHE_STABLE) != 0;
+  circ.ops.resize(hdr.num_ops);
+  std::memcpy(circ.ops.data(), p + at.ops, circ.ops.size() * sizeof(Op));
+  circ.conds.resize(hdr.num_conds);
+  std::memcpy(circ.conds.data(), p + at.conds, circ.conds.size() * sizeof(Condition));
+
+  std::vector<uint64_t> param_offsets(hdr.num_params + 1);
+  std::memcpy(param_offsets.data(), p + at.param_offsets, param_offsets.size() * sizeof(uint64_t));
+  const auto* instrs = reinterpret_cast<const ParamInstr*>(p + at.instrs);
+  circ.params.resize(hdr.num_params);
+  for (size_t i = 0; i < circ.params.size(); i++) {
+    if (param_offsets[i] > param_offsets[i + 1] || param_offsets[i + 1] > hdr.num_instrs)
+      return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+    circ.params[i].code.assign(instrs + param_offsets[i], instrs + param_offsets[i + 1]);
+  }
+
+  const auto* inputs = reinterpret_cast<const CacheStr*>(p + at.inputs);
+  circ.inputs.resize(hdr.num_inputs);
+  for (size_t i = 0; i < circ.inputs.size(); i++) {
+    if (!get_str(inputs[i], circ.inputs[i]))
+      return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+  }
+
+  if (!indices_valid(circ))
+    return std::unexpected(CacheError{CacheError::Code::corrupt, path});
+  return circ;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+// storage for state vector amplitudes, picked at compile time.
+// interleaved keeps std::complex values (re, im, re, im, ...).
+// split keeps the real and imaginary parts in separate arrays, so a kernel can
+// load a full vector register of either part and complex multiplies need no shuffles.
+//
+// both expose the same element interface. the hot kernels in quantum_state.cpp
+// branch on the layout to work on the raw arrays, everything else goes through
+// get/set. code outside the state only sees Complex values (read/write/get),
+// so checkpoints and printed output don't depend on the layout
+
+#include <algorithm>
+#include <complex>
+#include <span>
+#include <vector>
+
+using Complex = std::complex<double>;
+
+enum class AmpLayout { interleaved, split };
+
+template <AmpLayout L>
+struct AmpVector;
+
+template <>
+struct AmpVector<AmpLayout::interleaved> {
+  std::vector<Complex> amps;
+
+  size_t size() const { return amps.size(); }
+  void resize(size_t n) { amps.resize(n); }
+  void assign(size_t n, Complex c) { amps.assign(n, c); }
+  void swap(AmpVector& other) { amps.swap(other.amps); }
+  size_t capacity() const { return amps.capacity(); }
+  void shrink_to_fit() { amps.shrink_to_fit(); }
+
+  Complex get(size_t i) const { return amps[i]; }
+  void set(size_t i, Complex c) { amps[i] = c; }
+  double norm(size_t i) const { return std::norm(amps[i]); }
+  void scale(size_t i, double s) { amps[i] *= s; }
+  void swap_amps(size_t i, size_t j) { std::swap(amps[i], amps[j]); }
+
+  // amplitudes [first, first + out.size()) as Complex
+  void read(size_t first, std::span<Complex> out) const {
+    std::copy_n(amps.begin() + first, out.size(), out.begin());
+  }
+  void write(size_t first, std::span<const Complex> in) {
+    std::copy(in.begin(), in.end(), amps.begin() + first);
+  }
+  void fill(size_t first, size_t count, Complex c) {
+    std::fill_n(amps.begin() + first, count, c);
+  }
+  bool is_zero(size_t first, size_t count) const {
+    return std::all_of(amps.begin() + first, amps.begin() + first + count, [](const Complex& a) { return a == Complex(0.0, 0.0); });
+  }
+};
+
+template <>
+struct AmpVector<AmpLayout::split> {
+  std::vector<double> re;
+  std::vector<double> im;
+
+  size_t size() const { return re.size(); }
+  void resize(size_t n) {
+    re.resize(n);
+    im.resize(n);
+  }
+  void assign(size_t n, Complex c) {
+    re.assign(n, c.real());
+    im.assign(n, c.imag());
+  }
+  void swap(AmpVector& other) {
+    re.swap(other.re);
+    im.swap(other.im);
+  }
+  size_t capacity() const { return re.capacity(); }
+  void shrink_to_fit() {
+    re.shrink_to_fit();
+    im.shrink_to_fit();
+  }
+
+  Complex get(size_t i) const { return Complex(re[i], im[i]); }
+  void set(size_t i, Complex c) {
+    re[i] = c.real();
+    im[i] = c.imag();
+  }
+  double norm(size_t i) const { return re[i] * re[i] + im[i] * im[i]; }
+  void scale(size_t i, double s) {
+    re[i] *= s;
+    im[i] *= s;
+  }
+  void swap_amps(size_t i, size_t j) {
+    std::swap(re[i], re[j]);
+    std::swap(im[i], im[j]);
+  }
+
+  void read(size_t first, std::span<Complex> out) const {
+    for (size_t k = 0; k < out.size(); k++)
+      out[k] = Complex(re[first + k], im[first + k]);
+  }
+  void write(size_t first, std::span<const Complex> in) {
+    for (size_t k = 0; k < in.size(); k++) {
+      re[first + k] = in[k].real();
+      im[first + k] = in[k].imag();
+    }
+  }
+  void fill(size_t first, size_t count, Complex c) {
+    std::fill_n(re.begin() + first, count, c.real());
+    std::fill_n(im.begin() + first, count, c.imag());
+  }
+  bool is_zero(size_t first, size_t count) const {
+    return std::all_of(re.begin() + first, re.begin() + first + count, [](double v) { return v == 0.0; }) &&
+           std::all_of(im.begin() + first, im.begin() + first + count, [](double v) { return v == 0.0; });
+  }
+};
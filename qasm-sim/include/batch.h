@@ -0,0 +1,99 @@
+#pragma once
+
+#include "circuit.h"
+#include "results.h"
+#include <expected>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+struct SweepError {
+  enum class Code { open_failed, read_failed, write_failed, no_inputs, bad_header, bad_value, wrong_width, too_many_clbits };
+  Code code;
+  std::string path;
+  size_t line = 0;
+
+  std::string_view err_str() const {
+    switch (code) {
+    case Code::open_failed:
+      return "Error opening file";
+    case Code::read_failed:
+      return "Error reading file";
+    case Code::write_failed:
+      return "Error writing file";
+    case Code::no_inputs:
+      return "Program declares no inputs";
+    case Code::bad_header:
+      return "Header does not name the program's inputs";
+    case Code::bad_value:
+      return "Bad value";
+    case Code::wrong_width:
+      return "Wrong number of values";
+    case Code::too_many_clbits:
+      return "Sweeps support at most 64 classical bits";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() const {
+    if (line != 0)
+      std::println(stderr, "Error: {} in {} line {}", err_str(), path, line);
+    else
+      std::println(stderr, "Error: {} in {}", err_str(), path);
+  }
+};
+
+// input values for a sweep, one row per run, one column per circuit input
+struct BindingTable {
+  size_t width = 0;
+  std::vector<double> values;
+
+  size_t size() const { return values.size() / width; }
+
+  std::span<const double> row(size_t i) const {
+    return std::span(values).subspan(i * width, width);
+  }
+
+  // csv with an optional header row naming the circuit's inputs.
+  // without a header, columns are taken in declaration order
+  static std::expected<BindingTable, SweepError> from_csv(const std::string& path, const Circuit& circ);
+
+  // raw float64 values in host byte order, row major
+  static std::expected<BindingTable, SweepError> from_binary(const std::string& path, const Circuit& circ);
+
+  // picks the format from the extension: .bin is binary, anything else is csv
+  static std::expected<BindingTable, SweepError> from_file(const std::string& path, const Circuit& circ);
+};
+
+// circuits this small run through BatchState rather than one QuantumState per shot
+static constexpr size_t BATCH_MAX_QUBITS = 14;
+
+struct SweepOptions {
+  size_t num_threads = 0; // 0 uses every hardware thread
+  size_t shots = 1;       // runs per binding
+  size_t chunk_size = 64; // bindings claimed by a worker at a time
+  size_t batch_size = 64; // shots stepped together on small circuits, 0 runs each shot alone
+  std::optional<uint64_t> seed; // unset seeds from std::random_device
+};
+
+// runs circ shots times for every binding, spread across worker threads that
+// each own a state buffer. each finished chunk is appended to out_path as
+// "binding,outcome,count" rows, outcome being the classical bits, highest first.
+// rows of different chunks may be interleaved out of binding order.
+// shot s of binding b draws from stream b * shots + s, so a seeded sweep gives
+// the same results whatever the thread count
+std::expected<void, SweepError> run_sweep(const Circuit& circ, const BindingTable& bindings,
+                                          const std::string& out_path, const SweepOptions& opts);
+
+// shots a run_shots worker claims at a time
+static constexpr size_t SHOT_CHUNK = 1 << 12;
+
+// runs circ opts.shots times with one set of parameter values, counting the outcomes
+// into hist and, unless writer is null, appending every shot to it in shot order.
+// shot s draws from stream s like the shots of binding 0 of a sweep, so seeded runs
+// give the same results whatever the thread count. with stabilizer_sum each shot runs
+// on a StabilizerSum rather than a state vector
+void run_shots(const Circuit& circ, std::span<const double> param_vals, Histogram& hist, ShotWriter* writer,
+               const SweepOptions& opts, bool stabilizer_sum = false);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "quantum_state.h"
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// many independent states of the same width, stepped through the same gates together.
+// amplitudes are stored amplitude-major with real and imaginary parts split:
+// re[i * batch + b] is the real part of amplitude i of state b, so every kernel's
+// inner loop runs over contiguous doubles across the batch and vectorizes without shuffles.
+// meant for small circuits run many times, where per-state overhead dominates.
+//
+// kernels taking an `active` mask (batch entries, nonzero = apply) leave the other
+// states untouched; an empty mask applies to all of them
+struct BatchState {
+  size_t n;
+  size_t batch;
+  std::vector<double> re;
+  std::vector<double> im;
+  std::vector<Rng> rngs; // one per state, measurements draw from their own stream
+
+  BatchState(size_t num_qubits, size_t batch_size);
+
+  // every state to |00...0>, keeps the rngs
+  void init();
+
+  // the same 2x2 unitary on every state
+  void apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11, std::span<const uint8_t> active = {});
+
+  // a different unitary per state, u[b] = { u00, u01, u10, u11 }
+  void apply_unitary_1q(size_t qubit, std::span<const std::array<Complex, 4>> u);
+
+  // the same, applied where cntrl is |1>
+  void apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11,
+                                   std::span<const uint8_t> active = {});
+  void apply_controlled_unitary_1q(size_t cntrl, size_t qubit, std::span<const std::array<Complex, 4>> u);
+
+  void apply_x(size_t qubit, std::span<const uint8_t> active = {});
+  void apply_cnot(size_t cntrl, size_t qubit, std::span<const uint8_t> active = {});
+  void apply_swap(size_t qubit1, size_t qubit2, std::span<const uint8_t> active = {});
+  void apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit, std::span<const uint8_t> active = {});
+  void apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2, std::span<const uint8_t> active = {});
+
+  // measures qubit in every active state, collapsing each one; results[b] is left alone for inactive states
+  void measure(size_t qubit, std::span<uint8_t> results, std::span<const uint8_t> active = {});
+
+  // measures and flips back to |0> where the qubit was found in |1>
+  void reset(size_t qubit, std::span<const uint8_t> active = {});
+
+  // copies state b into qs, for printing or checkpointing one member of the batch
+  void extract(size_t b, QuantumState& qs) const;
+
+private:
+  std::vector<uint8_t> results_buf;
+  std::vector<double> mat_buf; // per-state matrices split into 8 arrays of batch doubles
+  std::vector<double> prob_buf;
+  std::vector<double> scale_buf;
+
+  // the unitary kernels, touching only amplitude blocks with every bit of cmask set
+  void unitary_1q(size_t qubit, size_t cmask, Complex u00, Complex u01, Complex u10, Complex u11, std::span<const uint8_t> active);
+  void unitary_1q(size_t qubit, size_t cmask, std::span<const std::array<Complex, 4>> u);
+
+  // swaps amplitude blocks i and j where active
+  void swap_blocks(size_t i, size_t j, std::span<const uint8_t> active);
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "quantum_state.h"
+#include <cstdint>
+#include <expected>
+#include <print>
+#include <string>
+#include <vector>
+
+struct CheckpointError {
+  enum class Code { open_failed, write_failed, bad_magic, bad_version, bad_precision, corrupt, truncated, wrong_size, too_wide };
+  Code code;
+  std::string path;
+
+  std::string_view err_str() const {
+    switch (code) {
+    case Code::open_failed:
+      return "Error opening checkpoint";
+    case Code::write_failed:
+      return "Error writing checkpoint";
+    case Code::bad_magic:
+      return "Not a checkpoint file";
+    case Code::bad_version:
+      return "Unsupported checkpoint version";
+    case Code::bad_precision:
+      return "Checkpoint precision does not match this build";
+    case Code::corrupt:
+      return "Corrupt checkpoint header";
+    case Code::truncated:
+      return "Truncated checkpoint";
+    case Code::wrong_size:
+      return "Checkpoint qubit count does not match the program";
+    case Code::too_wide:
+      return "Checkpoints hold at most 63 qubits";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() const {
+    std::println(stderr, "Error: {}: {}", err_str(), path);
+  }
+};
+
+static constexpr size_t CHECKPOINT_MAX_QUBITS = 63;
+
+// classical progress saved alongside the state so a run can pick up where it stopped
+struct CheckpointInfo {
+  uint64_t next_op = 0;        // ops already applied to the saved state
+  std::vector<uint8_t> clbits; // classical bits at that point
+};
+
+struct CheckpointOptions {
+  bool compress = false;  // skip chunks that are entirely zero
+  size_t num_threads = 0; // 0 uses every hardware thread
+};
+
+// file layout, all in host byte order:
+//   CheckpointHeader
+//   rng state (the Rng struct), rng_len bytes
+//   clbits, num_clbits bytes
+//   qubit map, num_qubits uint64_t: the bit of the amplitude index holding each qubit,
+//     or UINT64_MAX for a qubit outside the stored amplitudes
+//   basis values, num_qubits bytes: the value of each qubit outside them
+//   chunk table, num_chunks bytes (compressed only): 1 if the chunk is stored, 0 if it is all zero
+//   amplitudes from data_offset (page aligned), stored chunks back to back, 1 << width
+//     of them as QuantumState holds them, so a state that only touched a few qubits
+//     saves only those
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t precision; // bytes per real component
+  uint64_t num_qubits;
+  uint64_t width; // qubits held in the amplitudes
+  uint64_t chunk_amps; // amplitudes per chunk, the last chunk may be short
+  uint64_t num_chunks;
+  uint64_t flags;
+  uint64_t next_op;
+  uint64_t num_clbits;
+  uint64_t rng_len;
+  uint64_t data_offset;
+};
+
+// writes qs (amplitudes, qubit layout and rng) to path, leaving qs as it is apart from
+// applying queued permutations. the file is written under a temporary name and renamed
+// into place, so an interrupted save never clobbers an older checkpoint
+std::expected<void, CheckpointError> save_state(const QuantumState& qs, const std::string& path,
+                                                const CheckpointInfo& info = {}, const CheckpointOptions& opts = {});
+
+// replaces qs with the state stored at path, which has to hold num_qubits qubits and
+// num_clbits classical bits. a file of any other size is rejected before qs is touched
+std::expected<CheckpointInfo, CheckpointError> load_state(QuantumState& qs, const std::string& path, size_t num_qubits,
+                                                          size_t num_clbits, size_t num_threads = 0);
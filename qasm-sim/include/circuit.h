@@ -1,9 +1,211 @@
 #pragma once
+
+#include "lexer.h"
 #include "quantum_state.h"
+#include "batch_state.h"
+#include "stabilizer.h"
+#include <array>
+#include <cstdint>
+#include <expected>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <vector>
+
+enum class OpKind : uint8_t {
+#define DEF_GATE(name, text, num_params, num_qubits) name,
+#include "gates.inc"
+#undef DEF_GATE
+  MEASURE,
+  RESET,
+  BARRIER, // one per qubit, keeps the optimizer from moving gates across it
+  // fourier transform and its inverse over a register, put in by the optimizer in
+  // place of the gates making one up. see QuantumState::apply_qft
+  QFT,
+  IQFT
+};
+
+struct GateInfo {
+  std::string_view text;
+  uint8_t num_params;
+  uint8_t num_qubits;
+};
+
+// indexed by OpKind, gates only
+inline constexpr GateInfo gate_info[] = {
+#define DEF_GATE(name, text, num_params, num_qubits) {text, num_params, num_qubits},
+#include "gates.inc"
+#undef DEF_GATE
+};
+
+constexpr std::string_view to_string(OpKind k) {
+  switch (k) {
+  case OpKind::MEASURE: return "measure";
+  case OpKind::RESET: return "reset";
+  case OpKind::BARRIER: return "barrier";
+  case OpKind::QFT: return "qft";
+  case OpKind::IQFT: return "iqft";
+  default: return gate_info[static_cast<size_t>(k)].text;
+  }
+}
+
+struct CompileError {
+  enum class Code { unexpected_token, unexpected_eof, bad_literal, unknown_gate, unknown_name, redeclared, wrong_num_params, bad_operand, bad_index, unsupported, include_failed };
+  Code code;
+  Span span;
+  std::string_view contents;
+  std::string file; // set when the error is in an included file
+
+  std::string_view err_str() {
+    switch (code) {
+    case Code::unexpected_token:
+      return "Unexpected token";
+    case Code::unexpected_eof:
+      return "Unexpected end of file";
+    case Code::bad_literal:
+      return "Bad literal";
+    case Code::unknown_gate:
+      return "Unknown gate";
+    case Code::unknown_name:
+      return "Unknown name";
+    case Code::redeclared:
+      return "Name already declared";
+    case Code::wrong_num_params:
+      return "Wrong number of gate parameters";
+    case Code::bad_operand:
+      return "Bad operand";
+    case Code::bad_index:
+      return "Index out of range";
+    case Code::unsupported:
+      return "Unsupported statement";
+    case Code::include_failed:
+      return "Could not include file";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() {
+    if (file.empty())
+      std::println(stderr, "Error: {} at pos {}: {}", err_str(), span.pos, contents);
+    else
+      std::println(stderr, "Error: {} at pos {} in {}: {}", err_str(), span.pos, file, contents);
+  }
+};
+
+using ParamId = uint32_t;
+
+static constexpr uint32_t NO_CLBIT = UINT32_MAX;
+static constexpr uint32_t NO_COND = UINT32_MAX;
+
+// one step of a gate parameter expression, stored in postfix order
+struct ParamInstr {
+  enum class Code : uint8_t { CONST, INPUT, NEG, ADD, SUB, MUL, DIV, POW, SIN, COS, TAN, ARCSIN, ARCCOS, ARCTAN, EXP, LN, SQRT };
+  Code code;
+  uint32_t input = 0;
+  double val = 0.0;
+};
+
+// gate parameters are kept as expressions over the program's `input` declarations
+// so a compiled circuit can be rebound without going back through the frontend.
+// expressions without inputs are folded to a single CONST when compiled
+struct ParamExpr {
+  static constexpr size_t MAX_DEPTH = 32; // values eval can hold on its stack
+
+  std::vector<ParamInstr> code;
+
+  double eval(std::span<const double> inputs) const;
+
+  bool is_const() const { return code.size() == 1 && code[0].code == ParamInstr::Code::CONST; }
+};
 
+// classical condition: (value of clbits [first_clbit, first_clbit + num_clbits) == value) != negate
+// clbit first_clbit is the least significant bit of the value
+struct Condition {
+  uint32_t first_clbit;
+  uint32_t num_clbits;
+  uint64_t value;
+  bool negate;
+
+  bool holds(std::span<const uint8_t> clbits) const;
+};
+
+struct Op {
+  OpKind kind;
+  // above 1 for a single qubit gate, reset or measurement on a whole register, applied
+  // to qubits [qubits[0], qubits[0] + count) by one register wide kernel. a measurement
+  // writes clbits [clbit, clbit + count). qft and iqft
+  // always use the range, with qubits[1] = 1 if its last qubit is the most significant
+  uint16_t count = 1;
+  std::array<uint32_t, 3> qubits = { 0, 0, 0 };
+  std::array<ParamId, 4> params = { 0, 0, 0, 0 };
+  uint32_t clbit = NO_CLBIT; // measurement destination
+  uint32_t cond = NO_COND;   // index into Circuit::conds
+
+  size_t num_qubits() const {
+    if (count > 1)
+      return count;
+    return kind >= OpKind::MEASURE ? 1 : gate_info[static_cast<size_t>(kind)].num_qubits;
+  }
+  // the k-th qubit touched, k < num_qubits()
+  uint32_t qubit(size_t k) const { return count > 1 ? qubits[0] + static_cast<uint32_t>(k) : qubits[k]; }
+};
+
+struct Register {
+  std::string name;
+  uint32_t first;
+  uint32_t size;
+};
+
+// a program lowered to a flat op stream, independent of the lexer that produced it
 struct Circuit {
-	size_t num_qubits;
-	size_t num_regs;
-	QuantumState qs;
-	bool is_stable = true;
-};
\ No newline at end of file
+  size_t num_qubits = 0;
+  size_t num_clbits = 0;
+  std::vector<Op> ops;
+  std::vector<ParamExpr> params;
+  std::vector<Condition> conds;
+  std::vector<std::string> inputs; // names of `input` declarations, in declaration order
+  std::vector<Register> qregs;
+  std::vector<Register> cregs;
+  bool is_stable = true; // only stabilizer gates, see stabilizer.h
+  // files pulled in by `include` other than stdgates.inc. not saved by the circuit
+  // cache, which only hashes the main source
+  std::vector<std::string> includes;
+
+  // evaluates every gate parameter for one set of input values
+  void bind(std::span<const double> input_vals, std::vector<double>& param_vals) const;
+
+  // runs the op stream on qs, which must hold num_qubits qubits
+  // measurement results are written to clbits, which is resized to num_clbits
+  void execute(QuantumState& qs, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const;
+
+  // runs ops [first_op, last_op) only, continuing from the given clbits
+  // lets a run be split up around checkpoints
+  void execute_range(QuantumState& qs, std::span<const double> param_vals, std::vector<uint8_t>& clbits,
+                     size_t first_op, size_t last_op) const;
+
+  // runs the op stream on every state of bs together. state b reads its parameters from
+  // param_vals[b * params.size(), (b + 1) * params.size()) and writes its measurements to
+  // clbits[b * num_clbits, (b + 1) * num_clbits), which is resized to bs.batch * num_clbits.
+  // bs must hold num_qubits qubits
+  void execute_batch(BatchState& bs, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const;
+
+  // runs the op stream on a sum of stabilizer states, see stabilizer.h. ss must hold
+  // num_qubits qubits, clbits is resized to num_clbits
+  void execute(StabilizerSum& ss, std::span<const double> param_vals, std::vector<uint8_t>& clbits) const;
+
+  // log2 of the most terms execute on a StabilizerSum can reach with these parameters,
+  // summed over the gates that aren't cliffords. 0 for a stabilizer circuit
+  size_t stabilizer_rank(std::span<const double> param_vals) const;
+
+  // few enough non-clifford gates that a StabilizerSum beats a state vector, which
+  // grows with the qubits instead
+  bool prefers_stabilizer_sum(std::span<const double> param_vals) const;
+
+  // "name = bits" per classical register, highest bit first
+  void write_cregs(OutputBuffer& out, std::span<const uint8_t> clbits) const;
+
+  // lowers a fully lexed program. relative include paths are looked up in
+  // include_dir first, then in the working directory
+  static std::expected<Circuit, CompileError> compile(Lexer& lex, const std::filesystem::path& include_dir = {});
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "circuit.h"
+#include <cstdint>
+#include <expected>
+#include <print>
+#include <string>
+#include <string_view>
+
+// compiled circuits saved to disk so repeat runs of the same program skip the frontend.
+// files are named by a hash of the source and checked against it, the simulator
+// version and the gate table on load, so a stale entry is never used, and carry a
+// checksum so a damaged one is recompiled rather than trusted
+
+struct CacheError {
+  enum class Code { open_failed, write_failed, bad_magic, stale, corrupt, truncated };
+  Code code;
+  std::string path;
+
+  std::string_view err_str() const {
+    switch (code) {
+    case Code::open_failed:
+      return "Error opening circuit cache";
+    case Code::write_failed:
+      return "Error writing circuit cache";
+    case Code::bad_magic:
+      return "Not a circuit cache file";
+    case Code::stale:
+      return "Circuit cache is for another source or simulator version";
+    case Code::corrupt:
+      return "Corrupt circuit cache";
+    case Code::truncated:
+      return "Truncated circuit cache";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() const {
+    std::println(stderr, "Error: {}: {}", err_str(), path);
+  }
+};
+
+// file layout, all in host byte order, every section starting 8 byte aligned:
+//   CacheHeader
+//   ops, num_ops Op structs
+//   conditions, num_conds Condition structs
+//   parameter expressions, num_params + 1 uint64_t offsets into the instructions,
+//     then num_instrs ParamInstr structs
+//   registers, num_qregs then num_cregs CacheReg
+//   inputs, num_inputs CacheStr
+//   names, strings_len bytes that CacheReg and CacheStr point into
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t op_size; // sizeof(Op), catches layout changes between builds
+  char sim_version[16];
+  uint64_t gate_table; // hash of the gate names and arities
+  uint64_t source_hash;
+  uint64_t source_len;
+  uint64_t num_qubits;
+  uint64_t num_clbits;
+  uint64_t flags;
+  uint64_t num_ops;
+  uint64_t num_conds;
+  uint64_t num_params;
+  uint64_t num_instrs;
+  uint64_t num_qregs;
+  uint64_t num_cregs;
+  uint64_t num_inputs;
+  uint64_t strings_len;
+  uint64_t checksum; // of the whole file, taken with this field zero
+};
+
+struct CacheStr {
+  uint32_t offset;
+  uint32_t len;
+};
+
+struct CacheReg {
+  CacheStr name;
+  uint32_t first;
+  uint32_t size;
+};
+
+// 64 bit hash of a source text, fast enough to run over every file on startup
+uint64_t source_hash(std::string_view source);
+
+// where the cached circuit for source lives in dir
+std::string cache_path(const std::string& dir, std::string_view source);
+
+// writes circ, compiled from source, to path. like checkpoints the file is written
+// under a temporary name and renamed into place; missing directories are created
+std::expected<void, CacheError> save_circuit(const Circuit& circ, std::string_view source, const std::string& path);
+
+// the circuit cached at path, if it was compiled from source by this build
+std::expected<Circuit, CacheError> load_circuit(std::string_view source, const std::string& path);
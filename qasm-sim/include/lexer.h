@@ -2,10 +2,14 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <expected>
 #include <string>
 #include <print>
+#include <unordered_map>
+
+using NameId = uint32_t;
 
 struct Span {
   size_t pos;
@@ -89,6 +93,14 @@ return "UNKNOWN";
 struct Token {
   TokenKind kind;
   Span span;
+  // literal value, filled in by the lexer so the compiler never re-reads the text.
+  // int_val for DEC/HEX/OCT/BIN_LIT and IMAG_LIT_DEC, float_val for FLOAT_LIT,
+  // IMAG_LIT_FLOAT and TIME_LIT (the number without its unit), name_id for IDENT
+  union {
+    uint64_t int_val;
+    double float_val;
+    NameId name_id;
+  };
 };  
 
 // struct BitStrLit {
@@ -98,6 +110,36 @@ struct Token {
 
 // using Token = std::variant<FixedTok, IntLit, FloatLit, BoolLit, StrLit, Ident>;
 
+struct NameTable {
+  std::vector<std::string_view> id_to_text;
+  std::unordered_map<std::string_view, NameId> text_to_id;
+  NameId next_id = 0;
+
+  NameId get_id(std::string_view s) {
+    auto it = text_to_id.find(s);
+    if (it != text_to_id.end())
+      return it->second;
+    // id not found, it must be new
+    NameId id = next_id++;
+    id_to_text.push_back(s);
+    text_to_id.emplace(s, id);
+    return id;
+  }
+
+  std::string_view get_name(NameId id) {
+    return id_to_text[id];
+  }
+
+  // forgets ids from n on
+  void truncate(NameId n) {
+    while (next_id > n) {
+      text_to_id.erase(id_to_text.back());
+      id_to_text.pop_back();
+      next_id--;
+    }
+  }
+};  
+
 enum class LexMode {
   NORMAL,
   VERSION_ID,
@@ -108,10 +150,18 @@ enum class LexMode {
 };
 
 struct Lexer {
+  // zero bytes kept after the text. the first one ends every scan, so peek and the
+  // vector scans read ahead without bounds checks
+  static constexpr size_t PAD = 64;
+  // below this many bytes per thread lex_all doesn't split the input
+  static constexpr size_t PARALLEL_MIN_CHUNK = 1ULL << 20;
+
   std::vector<Token> toks;
-  std::string file_contents;
+  std::string file_contents; // the text followed by PAD zero bytes
+  size_t len = 0;            // length of the text
   size_t pos = 0;
   std::vector<LexMode> mode_stack = {LexMode::NORMAL};
+  NameTable names; // identifiers, views into file_contents
 
   Lexer();
   Lexer(const std::string& str);
@@ -125,12 +175,24 @@ struct Lexer {
   // consumes the next token and appends to toks, advances the string cursor
   std::expected<bool, LexError> next_tok();
 
+  // consumes the rest of the input. large inputs lexed from the start are split at
+  // statement boundaries and lexed on up to num_threads threads (0 = one per core),
+  // giving the same tokens and name ids as a single pass
+  std::expected<void, LexError> lex_all(size_t num_threads = 1);
+
+  // pos + lookahead must stay within PAD of the end, which holds as long as
+  // callers stop at the first '\0'
   unsigned char peek(size_t lookahead = 0) const;
   unsigned char peek_back(size_t lookback = 1) const;
 
   bool skip_ws();
   std::expected<bool, LexError> skip_ws_and_comments();
 
+  // offsets splitting the text into num_chunks pieces (fewer if it runs out of
+  // statements), each ending just after a ';' outside comments and strings
+  std::vector<size_t> chunk_bounds(size_t num_chunks) const;
+  std::expected<void, LexError> lex_chunks(const std::vector<size_t>& bounds);
+
   std::string_view str_from_span(Span span);
   LexError get_err(size_t start, LexError::Code code);
 
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+// a whole file mapped into memory, read only or freshly created at a fixed size
+struct MappedFile {
+  char* data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#else
+  int fd = -1;
+#endif
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() { close(); }
+
+  bool create(const std::string& path, size_t len);
+  bool open_read(const std::string& path);
+
+  // flushes dirty pages, returns false if the data didn't make it to the file
+  bool sync();
+
+  void close();
+};
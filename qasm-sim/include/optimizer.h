@@ -0,0 +1,34 @@
+#pragma once
+
+#include "circuit.h"
+
+// peephole pass over a compiled circuit, run before execution so every gate it
+// removes is one less sweep over the state:
+//   - inverse pairs cancel (h h, cx cx, s sdg, ...)
+//   - rotations about the same axis merge by adding angles, the phase gates
+//     (z, s, sdg, t, tdg, p) into one another
+//   - rotations left as the identity are dropped
+//   - the textbook qft circuit and its inverse become one qft or iqft op, which runs
+//     as an fft with a pass per qubit instead of one per gate. matched before the
+//     rest so a pattern isn't broken up by merges at its edges
+//
+// a gate can reach its partner across gates that commute with it. commutation is
+// checked qubit by qubit: two gates commute if on every qubit they share both are
+// diagonal in the same basis, e.g. rz commutes with the control of a cx and rx with
+// its target. measurements, resets, barriers and conditioned gates are never moved past
+//
+// the result has the same effect as the input up to rounding, including global
+// phase. parameters depending on inputs merge into a new expression summing them
+
+struct OptStats {
+  size_t ops_before = 0;
+  size_t ops_after = 0;
+  size_t cancelled = 0; // ops removed as inverse pairs
+  size_t merged = 0;    // ops folded into an earlier rotation
+  size_t dropped = 0;   // identities
+  size_t transforms = 0; // qft and iqft patterns replaced
+
+  size_t removed() const { return ops_before - ops_after; }
+};
+
+OptStats optimize(Circuit& circ);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "lexer.h"
 #include <optional>
 #include <variant>
@@ -5,7 +7,6 @@
 
 using ExprId = uint32_t;
 using StmtId = uint32_t;
-using NameId = uint32_t;
 using BlockId = uint32_t;
 using SymbolId = uint32_t;
 
@@ -200,27 +201,6 @@ struct Program {
   int version = -1; // default val if version not specified
 };
 
-struct NameTable {
-  std::vector<std::string_view> id_to_text;
-  std::unordered_map<std::string_view, NameId> text_to_id;
-  NameId next_id = 0;
-
-  NameId get_id(std::string_view s) {
-    auto it = text_to_id.find(s);
-    if (it != text_to_id.end())
-      return it->second;
-    // id not found, it must be new
-    NameId id = next_id++;
-    id_to_text.push_back(s);
-    text_to_id.emplace(s, id);
-    return id;
-  }
-
-  std::string_view get_name(NameId id) {
-    return id_to_text[id];
-  }
-};  
-
 struct ParseContext {
   std::vector<Stmt> stmt_list;
   std::vector<Expr> expr_list;
@@ -0,0 +1,56 @@
+#pragma once
+
+// x, cnot, swap and toffoli only move amplitudes around, so a run of them can be
+// queued and applied later as one index permutation instead of one pass each.
+//
+// IndexMap composes such a run into the map from a destination index back to the
+// source index it reads from. consecutive x/cnot/swap gates are affine over GF(2)
+// (idx -> A idx ^ mask) and collapse into a single stage evaluated with byte
+// lookup tables; each toffoli starts a new stage.
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// swap uses qubit and cntrl1 as its two qubits
+struct PermGate {
+  enum class Kind : uint8_t { X, CNOT, SWAP, TOFFOLI };
+  Kind kind;
+  uint32_t qubit;
+  uint32_t cntrl1 = 0;
+  uint32_t cntrl2 = 0;
+};
+
+struct IndexMap {
+  struct Stage {
+    bool is_toffoli;
+    bool is_xor;                  // affine with A = identity
+    uint64_t mask;                // affine: xor applied after the linear part. toffoli: target bit
+    uint64_t cntrl_mask;          // toffoli: both control bits
+    std::vector<uint64_t> tables; // affine: 256 entries per byte of the index
+
+    uint64_t eval(uint64_t idx) const {
+      if (is_toffoli)
+        return ((idx & cntrl_mask) == cntrl_mask) ? (idx ^ mask) : idx;
+      uint64_t res = mask;
+      for (size_t b = 0; b < tables.size() / 256; b++)
+        res ^= tables[b * 256 + ((idx >> (8 * b)) & 0xFF)];
+      return res;
+    }
+  };
+
+  std::vector<Stage> stages; // in program order
+
+  // gates in program order, on an n qubit state
+  IndexMap(size_t n, std::span<const PermGate> gates);
+
+  // the index whose amplitude ends up at idx
+  uint64_t source(uint64_t idx) const {
+    for (size_t s = stages.size(); s-- > 0;)
+      idx = stages[s].eval(idx);
+    return idx;
+  }
+
+  // true if the whole map is idx ^ mask, which can be applied in place
+  bool is_xor() const;
+};
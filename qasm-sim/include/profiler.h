@@ -0,0 +1,57 @@
+#pragma once
+
+// opt-in instrumentation for the frontend and the state kernels.
+// configure with -DQASM_SIM_PROFILE=ON to build it in; otherwise PROFILE_SCOPE
+// expands to nothing and its arguments are never evaluated.
+//
+// each scope adds wall time, a call and the bytes it touched to a per-thread
+// table keyed by (name, target qubit), and optionally records a trace event and
+// hardware counters (cycles, instructions, cache misses via perf_event_open, linux only)
+
+#include <cstdint>
+
+static constexpr uint32_t PROFILE_NO_QUBIT = UINT32_MAX;
+
+#ifdef QASM_SIM_PROFILE
+
+#include <chrono>
+#include <string>
+
+struct ThreadProfile;
+
+struct Profiler {
+  static inline bool active = false;
+
+  // starts collecting. counters are ignored if they can't be opened
+  static void enable(bool hw_counters);
+
+  // only call these once instrumented threads have finished
+  static void print_summary();
+  static bool write_trace(const std::string& path);
+};
+
+struct ProfileScope {
+  const char* name;
+  uint32_t qubit;
+  uint64_t bytes;
+  ThreadProfile* prof;
+  std::chrono::steady_clock::time_point start;
+  uint64_t counters[3];
+
+  ProfileScope(const char* n, uint32_t q, uint64_t b);
+  ~ProfileScope();
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name, qubit, bytes) \
+  ProfileScope PROFILE_CONCAT(prof_scope_, __LINE__)((name), static_cast<uint32_t>(qubit), (Profiler::active ? (bytes) : 0))
+
+#else
+
+#define PROFILE_SCOPE(name, qubit, bytes) ((void)0)
+
+#endif
@@ -1,12 +1,14 @@
 #pragma once
 
+#include "amplitudes.h"
+#include "permutation.h"
+#include "results.h"
+#include "rng.h"
 #include <complex>
 #include <vector>
 #include <random>
 #include <array>
 
-using Complex = std::complex<double>;
-
 struct SampleResult {
   size_t results[2] = { 0, 0 };
 
@@ -14,16 +16,71 @@ struct SampleResult {
 };
 
 
-struct QuantumState {
-  size_t n;
-  std::vector<Complex> psi;
-  std::uniform_real_distribution<double> uni;
-  std::mt19937 rng;
+// the amplitude layout is a template parameter so both can be built and compared;
+// QuantumState below is the one the rest of the simulator uses
+template <AmpLayout L>
+struct BasicQuantumState {
+  // psi only holds the qubits in use. a qubit joins it (an in-place tensor product
+  // with its basis state) the first time a gate needs it, and leaves it again once
+  // a measurement or reset has projected it onto a basis state. qubits outside psi
+  // are recorded as classical values in basis_vals.
+  //
+  // qubits in psi are addressed through qubit_map, which gives the bit of the psi
+  // index holding each logical qubit, so a swap only exchanges two entries. indices
+  // seen by callers (measure_all, print_state, checkpoints) are always logical.
+  //
+  // x, cnot and toffoli are queued in pending_perm and applied as one index
+  // permutation the next time the amplitudes are needed. anything reading psi
+  // directly must call normalize() first; the members are mutable because flushing
+  // doesn't change the state the object represents
+  //
+  // a measurement needs the probabilities of its qubit before it can collapse psi.
+  // kernels that sweep psi anyway can sum them on the way into marg: the collapse
+  // of a measurement for every qubit left, a single qubit gate for its own qubit when
+  // told the next op measures it. marg holds until psi next changes, which always
+  // goes through flush() or queue_perm(), so those drop it
+  static constexpr size_t PERM_MIN_GATHER = 3;       // fewer pending gates are applied one by one
+  static constexpr size_t PERM_MAX_PENDING = 64;
+  static constexpr size_t PERM_MAX_LAZY_QUBITS = 28; // above this the scratch buffer costs too much memory
+  static constexpr size_t UNALLOCATED = SIZE_MAX;
+  static constexpr size_t LAYER_MAX_QUBITS = 6;      // 64 amplitudes gathered per block
+  static constexpr size_t REGISTER_BLOCK_BITS = 12;  // contiguous block a register gate finishes in cache
+  static constexpr size_t RESET_MAX_QUBITS = 12;     // marginal table of one reset_register pass
+  static constexpr size_t QUERY_PARTS = 64;          // most parts a query pass is split into
+  static constexpr size_t QUERY_MIN_PART = 1 << 14;  // fewest amplitudes in a part
+  static constexpr size_t MARGINAL_MAX_QUBITS = 24;  // 128 MiB table per query
 
-  QuantumState(size_t num_qubits = 1, size_t init_state = 0);
+  size_t n;
+  mutable size_t width;               // qubits held in psi
+  mutable AmpVector<L> psi;           // 1 << width amplitudes
+  Rng rng;
+  mutable std::vector<PermGate> pending_perm;
+  mutable AmpVector<L> scratch;
+  mutable std::vector<size_t> qubit_map;
+  mutable std::vector<uint8_t> basis_vals;
+  mutable std::vector<double> marg; // per bit of the psi index, probability of |1> or NaN if unknown
+  mutable double marg_total = 0.0;  // the probabilities in marg are out of this
+  size_t marg_hint = UNALLOCATED;   // qubit the next op measures
+  bool keep_capacity = false;       // never trim, for a state reused across runs
+
+  // seeds from std::random_device
+  BasicQuantumState(size_t num_qubits = 1, size_t init_state = 0);
+  // reproducible runs: pass Rng(seed) or a stream derived from it
+  BasicQuantumState(size_t num_qubits, size_t init_state, Rng r);
 
   void init(size_t num_qubits, size_t init_state);
 
+  // holds every qubit in psi in order, leaving the amplitudes for the caller to fill
+  void init_dense(size_t num_qubits);
+
+  // holds the qubits map places in psi on those bits, width of them, and the rest at
+  // their vals, leaving the amplitudes for the caller to fill
+  void init_layout(std::span<const size_t> map, std::span<const uint8_t> vals, size_t psi_width);
+
+  // grows psi's buffer to num_qubits qubits and writes every page of it, so runs that
+  // reuse this state find their memory already faulted in. sets keep_capacity
+  void reserve(size_t num_qubits);
+
   // gets measurement probabilities for a single qubit, normalized
   std::array<double, 2> measurement_probs(size_t qubit) const;
 	
@@ -41,9 +98,43 @@ struct QuantumState {
   // returns the measurement result
   size_t measure_all();
 
+  // measure on every one of qubits, outcomes[k] for qubits[k], drawn in order as by
+  // measure() on each. one pass over psi builds their joint marginals, a second
+  // projects onto the outcome
+  void measure_register(std::span<const size_t> qubits, std::span<uint8_t> outcomes);
+
+  // the next op measures qubit, so a single qubit gate on it before then sums the
+  // probabilities while it sweeps psi and spares the measurement a pass
+  void expect_measure(size_t qubit) { marg_hint = qubit; }
+
+  // measures a single qubit and flips it back to |0> if it was found in |1>
+  void reset(size_t qubit);
+
+  // reset on every one of qubits, outcomes drawn in order as by reset() on each,
+  // in the same two passes as measure_register
+  void reset_register(std::span<const size_t> qubits);
+
   // arbitrary unitary operation on a single qubit
   void apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11);
 
+  // unitaries u[k] = { u00, u01, u10, u11 } on distinct qubits[k], at most
+  // LAYER_MAX_QUBITS of them, applied together in one pass over psi
+  void apply_unitary_layer(std::span<const size_t> qubits, std::span<const std::array<Complex, 4>> u);
+
+  // the same unitary on every one of qubits. qubits in the low bits of psi are all
+  // applied to one contiguous block while it is in cache, the rest in layers
+  void apply_unitary_register(std::span<const size_t> qubits, Complex u00, Complex u01, Complex u10, Complex u11);
+
+  // hadamard on every one of qubits, as a walsh-hadamard transform scaled once at the end
+  void apply_hadamard_register(std::span<const size_t> qubits);
+
+  // quantum fourier transform over qubits, qubits[0] the most significant bit. like
+  // the textbook circuit of hadamards and controlled phases it leaves the result in
+  // reverse qubit order, the swaps fixing that are up to the caller. inverse runs
+  // that circuit backwards. each qubit is one butterfly pass with the phases folded
+  // in as twiddle factors, n passes over psi where the circuit makes n (n + 1) / 2
+  void apply_qft(std::span<const size_t> qubits, bool inverse = false);
+
   // stabilizer gates
   void apply_hadamard(size_t qubit);
   void apply_s(size_t qubit);
@@ -54,12 +145,96 @@ struct QuantumState {
   void apply_y(size_t qubit);
   void apply_z(size_t qubit);
 
+  // exchanges two qubits by relabeling them, psi isn't touched
+  void apply_swap(size_t qubit1, size_t qubit2);
+
   // controlled-controlled not, aka AND gate
   void apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit);
 
+  // 2x2 unitary on qubit where cntrl is |1>, covers the controlled gates of stdgates.inc
+  void apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11);
+
+  // multiplies the amplitudes where both qubits are |1> by phase, cz and cp
+  void apply_controlled_phase(size_t qubit1, size_t qubit2, Complex phase);
+
+  // controlled swap, queued as permutation gates like toffoli
+  void apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2);
+
   // sanity check function to ensure total probability is 1
   double total_probability() const;
 
-  // DEBUG: print current state
-  void print_state() const;
+  // queries reading the state in place, for callers that want a few numbers out of it
+  // rather than all of it. basis states are logical indices, qubit q at bit q, so they
+  // need n <= 64. passes are split into parts on num_threads threads (0 uses every
+  // hardware thread), how many depending only on the size of psi, and the parts are
+  // combined in order, so results don't depend on the thread count
+
+  // the amplitude of every basis state in indices, in the same order
+  std::vector<Complex> amplitudes(std::span<const uint64_t> indices) const;
+
+  // joint probabilities of distinct qubits, entry j for each qubits[b] found as bit b
+  // of j, 2^qubits.size() of them summed in one pass over psi. callers keep qubits.size()
+  // to MARGINAL_MAX_QUBITS
+  std::vector<double> marginal(std::span<const size_t> qubits, size_t num_threads = 0) const;
+
+  // every basis state more likely than threshold, by increasing index
+  std::vector<BasisProb> probabilities_above(double threshold, size_t num_threads = 0) const;
+
+  // the k largest amplitudes, largest first, from one pass that only keeps k of them.
+  // indices are logical, so n has to be at most 64
+  std::vector<BasisAmp> top_amplitudes(size_t k) const;
+
+  // writes every nonzero amplitude, or with top only the top largest
+  void write_state(OutputBuffer& out, size_t top = 0) const;
+  void print_state(size_t top = 0) const {
+    OutputBuffer out;
+    write_state(out, top);
+  }
+
+  // applies any queued permutation gates to psi
+  void flush() const {
+    marg.clear();
+    if (!pending_perm.empty())
+      apply_pending_perm();
+  }
+
+  // flushes, brings every qubit into psi and moves amplitudes so each qubit
+  // sits at its own bit of the index, after which psi can be read directly
+  void normalize() const;
+
+private:
+  // bit of the psi index holding qubit, adding it to psi first if needed
+  size_t alloc(size_t qubit) const;
+  // drops a qubit found in basis state val from psi, scaling the rest by scl.
+  // leaves the probabilities of the qubits still in psi in marg
+  void project_out(size_t qubit, size_t val, double scl);
+  // a diagonal gate on a qubit outside psi only multiplies psi by the entry for its
+  // basis value, so the qubit can stay out. false if the qubit is in psi
+  bool apply_diagonal_outside(size_t qubit, Complex d0, Complex d1);
+  // every amplitude times c
+  void scale_all(Complex c);
+  // gives memory back once psi is down to a quarter of what it holds. the slack
+  // keeps a qubit going in and out of psi from reallocating every time
+  void trim() const;
+  // records the probabilities a kernel summed for the bit pos of the psi index
+  void set_marg(size_t pos, double p0, double p1) const;
+  // measures or resets qubits, writing outcomes unless it's empty
+  void collapse_register(std::span<const size_t> qubits, std::span<uint8_t> outcomes, bool reset);
+  // collapses run, whose qubits in psi sit at bits pos
+  void collapse_run(std::span<const size_t> run, std::span<const size_t> pos, std::span<uint8_t> outcomes, bool reset);
+  // mat[j] = { re, im } of u00, u01, u10, u11 on bit pos[j], at most LAYER_MAX_QUBITS
+  void layer_pass(std::span<const size_t> pos, std::span<const std::array<double, 8>> mat);
+  // mat on every qubit, or hadamards if mat is null
+  void register_pass(std::span<const size_t> qubits, const std::array<double, 8>* mat);
+  // psi index with the bits placed by qubit_map -> logical index
+  size_t to_logical(size_t idx) const;
+  void queue_perm(PermGate g) const;
+  void apply_pending_perm() const;
 };
+
+// configure with -DQASM_SIM_SPLIT_COMPLEX=ON for separate real and imaginary arrays
+#ifdef QASM_SIM_SPLIT_COMPLEX
+using QuantumState = BasicQuantumState<AmpLayout::split>;
+#else
+using QuantumState = BasicQuantumState<AmpLayout::interleaved>;
+#endif
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "amplitudes.h"
+#include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// result output: shot histograms, per-shot bitstrings and amplitude listings.
+// everything is formatted straight into a fixed buffer that goes out in one write
+// whenever it fills, so a row costs no allocation and no call into stdio
+
+struct ResultError {
+  enum class Code { open_failed, write_failed };
+  Code code;
+  std::string path;
+
+  std::string_view err_str() const {
+    switch (code) {
+    case Code::open_failed:
+      return "Error opening file";
+    case Code::write_failed:
+      return "Error writing file";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() const {
+    std::println(stderr, "Error: {}: {}", err_str(), path);
+  }
+};
+
+struct OutputBuffer {
+  static constexpr size_t CAPACITY = 1 << 16;
+  static constexpr size_t MAX_FIELD = 64; // longest single number or amplitude put at once
+
+  std::FILE* file = nullptr;
+  std::string* sink = nullptr; // appended to instead of a file
+  bool owned = false; // closed with the buffer, stdout isn't
+  bool failed = false;
+  std::string path;
+  std::vector<char> buf;
+  size_t len = 0;
+
+  // writes to stdout
+  OutputBuffer();
+  explicit OutputBuffer(std::string& s, size_t capacity = 1 << 12);
+  OutputBuffer(OutputBuffer&& other) noexcept;
+  OutputBuffer& operator=(OutputBuffer&&) = delete;
+  ~OutputBuffer();
+
+  static std::expected<OutputBuffer, ResultError> open(const std::string& path);
+
+  void put(char c) {
+    if (len == buf.size())
+      flush();
+    buf[len++] = c;
+  }
+  void put(std::string_view s);
+  void put_bytes(const void* data, size_t size);
+  void put_uint(uint64_t v);
+  // the low num_bits of v, highest first
+  void put_bits(uint64_t v, size_t num_bits);
+  // bits[i] for i from bits.size() - 1 down to 0
+  void put_bits(std::span<const uint8_t> bits);
+  // to 4 significant digits, like std::format's {:.4}
+  void put_real(double v);
+  // (re + imi) to 4 significant digits, as print_state has always shown them
+  void put_amp(Complex a);
+
+  void flush();
+  // flushes and closes the file, reporting a failure of any earlier write
+  std::expected<void, ResultError> close();
+};
+
+// shot counts per outcome, outcomes being the classical bits packed 64 to a word.
+// counting goes through an open addressing table so a shot allocates nothing once
+// its outcome has been seen
+struct Histogram {
+  size_t num_bits;
+  size_t words;
+  size_t shots = 0;
+  std::vector<uint64_t> keys; // outcome k is keys[k * words, (k + 1) * words)
+  std::vector<uint64_t> counts;
+  std::vector<uint32_t> slots; // outcome + 1 or 0 for empty, a power of two long
+
+  explicit Histogram(size_t num_clbits);
+
+  size_t size() const { return counts.size(); }
+  std::span<const uint64_t> outcome(size_t k) const { return std::span(keys).subspan(k * words, words); }
+
+  void add(std::span<const uint8_t> clbits, uint64_t count = 1);
+  void add_packed(std::span<const uint64_t> key, uint64_t count);
+  void merge(const Histogram& other);
+
+  // outcomes by decreasing count, equal counts by increasing outcome
+  std::vector<size_t> order() const;
+
+  // "outcome,count" rows, outcome being the classical bits highest first
+  void write_csv(OutputBuffer& out) const;
+  // { "clbits": .., "shots": .., "counts": { "outcome": count, .. } }
+  void write_json(OutputBuffer& out) const;
+
+  // picks the format from the extension: .json is json, anything else is csv
+  std::expected<void, ResultError> write(const std::string& path) const;
+
+private:
+  void grow();
+};
+
+// per-shot outcomes as raw bytes for runs too long to keep as text. the file is a
+// ShotFileHeader followed by bytes_per_shot bytes for every shot in shot order,
+// clbit i at bit i % 8 of byte i / 8
+struct ShotFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t bytes_per_shot;
+  uint64_t num_clbits;
+};
+
+struct ShotWriter {
+  OutputBuffer out;
+  size_t num_bits;
+  size_t bytes_per_shot;
+  uint64_t shots = 0;
+
+  static std::expected<ShotWriter, ResultError> open(const std::string& path, size_t num_clbits);
+
+  // clbits of one shot, num_clbits long
+  void add(std::span<const uint8_t> clbits);
+  // shots already packed by pack_shot, bytes_per_shot each
+  void add_packed(std::span<const uint8_t> packed);
+
+  std::expected<void, ResultError> close() { return out.close(); }
+};
+
+// packs one shot as ShotWriter lays it out, appending bytes_per_shot bytes to out
+void pack_shot(std::span<const uint8_t> clbits, std::vector<uint8_t>& out);
+
+// basis state and amplitude, as listed by print_state
+using BasisAmp = std::pair<uint64_t, Complex>;
+// basis state and probability
+using BasisProb = std::pair<uint64_t, double>;
+
+// the order of a top-k listing: larger magnitude first, then lower basis state
+inline bool larger_amp(const BasisAmp& l, const BasisAmp& r) {
+  double nl = std::norm(l.second), nr = std::norm(r.second);
+  return nl != nr ? nl > nr : l.first < r.first;
+}
+
+// the k largest of the amplitudes offered to it, kept as a heap with the smallest on
+// top. most amplitudes don't beat that one, so a scan rarely touches the heap
+struct TopAmps {
+  size_t k;
+  std::vector<BasisAmp> heap;
+
+  explicit TopAmps(size_t k) : k(k) {}
+
+  void offer(uint64_t idx, Complex a) {
+    if (heap.size() == k && (k == 0 || !larger_amp({ idx, a }, heap.front())))
+      return;
+    push(idx, a);
+  }
+
+  // largest first, leaves the heap empty
+  std::vector<BasisAmp> take();
+
+private:
+  void push(uint64_t idx, Complex a);
+};
+
+// "(re + imi)|bits>" and a newline, bits being the low num_qubits of idx
+void put_basis_amp(OutputBuffer& out, uint64_t idx, Complex a, size_t num_qubits);
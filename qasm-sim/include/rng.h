@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <span>
+
+// counter-based generator built on Philox4x32-10 (Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3"). the output is a pure function of
+// (seed, stream, counter), so independent streams for shots or threads are
+// derived by index with no shared state, and any stream is reproducible from its seed.
+//
+// the stream is a sequence of 64-bit words, two per Philox block. uniform(),
+// operator() and fill_uniform() all consume the same sequence
+struct Rng {
+  using result_type = uint64_t;
+
+  uint64_t seed = 0;
+  uint64_t stream_id = 0;
+  uint64_t counter = 0; // next block
+  uint64_t buf = 0;     // second word of the last block, if has_buf
+  bool has_buf = false;
+
+  Rng() = default;
+  explicit Rng(uint64_t s, uint64_t id = 0) : seed(s), stream_id(id) {}
+
+  // seeds from std::random_device, for runs that don't need to be reproducible
+  static Rng from_entropy();
+
+  // an independent stream with the same seed
+  Rng stream(uint64_t id) const { return Rng(seed, id); }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+  struct Block {
+    uint32_t w[4];
+  };
+
+  static inline Block philox(uint64_t ctr, uint64_t id, uint64_t key) {
+    constexpr uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+    constexpr uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+
+    uint32_t c0 = static_cast<uint32_t>(ctr), c1 = static_cast<uint32_t>(ctr >> 32);
+    uint32_t c2 = static_cast<uint32_t>(id), c3 = static_cast<uint32_t>(id >> 32);
+    uint32_t k0 = static_cast<uint32_t>(key), k1 = static_cast<uint32_t>(key >> 32);
+
+    for (int r = 0; r < 10; r++) {
+      uint64_t p0 = static_cast<uint64_t>(M0) * c0;
+      uint64_t p1 = static_cast<uint64_t>(M1) * c2;
+      uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+      uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+      c1 = static_cast<uint32_t>(p1);
+      c3 = static_cast<uint32_t>(p0);
+      c0 = n0;
+      c2 = n2;
+      k0 += W0;
+      k1 += W1;
+    }
+    return { { c0, c1, c2, c3 } };
+  }
+
+  result_type operator()() {
+    if (has_buf) {
+      has_buf = false;
+      return buf;
+    }
+    Block b = philox(counter++, stream_id, seed);
+    buf = b.w[2] | (static_cast<uint64_t>(b.w[3]) << 32);
+    has_buf = true;
+    return b.w[0] | (static_cast<uint64_t>(b.w[1]) << 32);
+  }
+
+  static inline double to_unit(uint64_t w) {
+    return static_cast<double>(w >> 11) * 0x1.0p-53;
+  }
+
+  // uniform double in [0, 1)
+  double uniform() { return to_unit((*this)()); }
+
+  // fills out with uniforms in [0, 1), the same values as out.size() calls to uniform()
+  void fill_uniform(std::span<double> out);
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <print>
+#include <string>
+
+// long-running mode, for many small jobs that would otherwise each pay for process
+// startup, compiling their program, allocating a state and seeding from the entropy
+// source. every line a client sends is a job, written like a command line:
+//   file.qasm [--seed n] [--shots n] [--top k]
+// and answered with "ok <job> <bytes>\n" followed by exactly that many bytes of what a
+// one-off run would print, or "error <job> <message>\n". jobs are numbered from 1 per
+// client and answered as they finish, which may be out of order. "quit" stops the server.
+//
+// jobs go to a pool of worker threads, each taking several at a time off a shared
+// queue when it is long. compiled circuits stay cached until their file changes, and
+// state vectors go back to a pool by qubit count once a job is done with them, their
+// buffers already faulted in for the next job of that size, as long as the pool stays
+// within its memory budget
+
+struct ServerError {
+  enum class Code { socket_failed, bind_failed, unsupported };
+  Code code;
+  std::string path;
+
+  std::string_view err_str() const {
+    switch (code) {
+    case Code::socket_failed:
+      return "Error creating socket";
+    case Code::bind_failed:
+      return "Error listening on socket";
+    case Code::unsupported:
+      return "Unix sockets are not supported on this platform";
+    default:
+      return "Unreachable";
+    }
+  }
+
+  void print() const {
+    std::println(stderr, "Error: {}: {}", err_str(), path);
+  }
+};
+
+struct ServerOptions {
+  size_t num_threads = 0;       // workers, 0 uses every hardware thread
+  std::optional<uint64_t> seed; // jobs without --seed draw streams of this, unset seeds once from std::random_device
+  bool optimize = false;        // runs the peephole pass on every program compiled
+};
+
+// reads jobs from stdin and answers on stdout until end of input or quit
+void serve_stdio(const ServerOptions& opts);
+
+// listens on a unix socket at path, every connection a client of its own, until one
+// of them sends quit. a file already at path is replaced
+std::expected<void, ServerError> serve_socket(const std::string& path, const ServerOptions& opts);
@@ -1,6 +1,159 @@
+#pragma once
+
+#include "amplitudes.h"
+#include "results.h"
+#include "rng.h"
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
 // all stabilizer circuits from the normalizer of the qubit Pauli group/Clifford group can be perfectly simulated in polynomial time.
 // Clifford group can be generated with CNOT, Hadamard, and phase gates - stabilizer circuits can be constructed using only these gates.
-// in our sim, we check if a circuit is clifford circuit - if it is, simulation is polynomial time. we will get to how to simulate other gates later.
+// in our sim, we check if a circuit is clifford circuit - if it is, simulation is polynomial time. other gates are handled by StabilizerSum below.
 
 // a stabilizer is a subgroup Gx of G consisting of all g in G s.t. g(x) = x -- Gx is the stabilizer of x
-// furthermore, a stabilizer of a subset fixes the subset
\ No newline at end of file
+// furthermore, a stabilizer of a subset fixes the subset.
+
+// clifford+t simulation as a weighted sum of stabilizer states that all share one frame:
+//   psi = sum over y of a_y D^y |phi>
+// |phi> is the state of a stabilizer tableau, D_j its destabilizers and D^y the product
+// of the D_j picked by the bits of y. the D^y |phi> are an orthonormal basis, so terms
+// never overlap and a norm is a sum over the a_y.
+//
+// a clifford gate conjugates the tableau and leaves every a_y alone, O(n) whatever the
+// number of terms. any other gate is written as a sum of paulis, and a pauli sends each
+// basis state D^y |phi> to one other with a phase, so a gate of m paulis at most
+// multiplies the terms by m: a t gate at most doubles them, and terms it maps onto one
+// another merge. the term count grows with the non-clifford gates, not with the qubits.
+//
+// measuring Z_q reads its eigenvalue off every term if Z_q is in the stabilizer group up
+// to sign. otherwise the frame first moves to one where it is, which maps each term to
+// two, and the collapse keeps one of them.
+//
+// a tableau only fixes |phi> up to a global phase, so the amplitude of |phi> at one basis
+// state is carried along with it. printed amplitudes then match QuantumState. that needs
+// an elimination over the tableau for h and sx, so it's only kept up to PHASE_MAX_QUBITS,
+// past which there are too many amplitudes to print anyway
+struct StabilizerSum {
+  static constexpr size_t PARALLEL_MIN_TERMS = 1 << 12; // fewer terms are updated on one thread
+  static constexpr size_t PHASE_MAX_QUBITS = 64;
+  static constexpr size_t PRINT_MAX_AMPS = 1 << 20;        // listed sparsely, sorted
+  static constexpr size_t PRINT_DENSE_MAX_QUBITS = 26;     // past PRINT_MAX_AMPS, summed into 2^n amplitudes
+
+  // coef times a pauli on up to three qubits, bit k of x and z for qubits[k]. x and z
+  // both set is Y
+  struct PauliTerm {
+    Complex coef;
+    std::array<uint32_t, 3> qubits = { 0, 0, 0 };
+    uint8_t num_qubits = 1;
+    uint8_t x = 0;
+    uint8_t z = 0;
+  };
+
+  size_t n;
+  size_t words;      // 64 bit words per row of the tableau and per term
+  Rng rng;
+  size_t num_threads = 0; // 0 uses every hardware thread
+
+  // 2n rows of x and z bits, destabilizers in [0, n) and stabilizers in [n, 2n),
+  // each a hermitian pauli with sign (-1)^signs[row]. row r starts at word r * words
+  std::vector<uint64_t> xs, zs;
+  std::vector<uint8_t> signs;
+
+  // term t is keys[t * words, (t + 1) * words) with amplitude amps[t]
+  std::vector<uint64_t> keys;
+  std::vector<Complex> amps;
+
+  // <ref|phi> = ref_amp, kept while n <= PHASE_MAX_QUBITS
+  uint64_t ref = 0;
+  Complex ref_amp = 1.0;
+
+  // |0...0>: one term over the frame of Z stabilizers and X destabilizers
+  StabilizerSum(size_t num_qubits, Rng r);
+
+  size_t num_terms() const { return amps.size(); }
+
+  // stabilizer gates
+  void apply_hadamard(size_t qubit);
+  void apply_s(size_t qubit);
+  void apply_cnot(size_t cntrl, size_t qubit);
+  void apply_cz(size_t qubit1, size_t qubit2);
+  void apply_cy(size_t cntrl, size_t qubit);
+  void apply_swap(size_t qubit1, size_t qubit2);
+
+  // any single qubit unitary. cliffords go to the tableau, anything else is a pauli sum
+  void apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11);
+
+  // 2x2 unitary on qubit where cntrl is |1>. cx, cy and cz go to the tableau
+  void apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11);
+
+  // multiplies the amplitudes where both qubits are |1> by phase, cz and cp
+  void apply_controlled_phase(size_t qubit1, size_t qubit2, Complex phase);
+
+  void apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit);
+  void apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2);
+
+  // sum over terms of coef times pauli. the result should be unitary, nothing renormalizes it
+  void apply_pauli_sum(std::span<const PauliTerm> terms);
+
+  // measures a single qubit and collapses the state, drawing from rng as QuantumState::measure does
+  size_t measure(size_t qubit);
+
+  // measures a single qubit and flips it back to |0> if it was found in |1>
+  void reset(size_t qubit);
+
+  // prints the nonzero amplitudes like QuantumState::print_state, or with top only the
+  // top largest. a summary instead if the global phase wasn't kept, or there are more
+  // than PRINT_MAX_AMPS over more than PRINT_DENSE_MAX_QUBITS
+  void write_state(OutputBuffer& out, size_t top = 0) const;
+  void print_state(size_t top = 0) const {
+    OutputBuffer out;
+    write_state(out, top);
+  }
+
+  // u is a clifford up to a global phase: it maps X and Z to paulis under conjugation
+  static bool is_clifford_1q(const std::array<Complex, 4>& u);
+
+  // paulis with a nonzero coefficient in u, what a non-clifford u multiplies the terms by at most
+  static size_t num_paulis(const std::array<Complex, 4>& u);
+
+private:
+  // a pauli i^phase * X^x Z^z over words words, used for products of rows
+  struct Pauli {
+    std::vector<uint64_t> x, z;
+    uint8_t phase = 0;
+  };
+  // p = lambda * D^a * S^b in the current frame, a and b over the qubits
+  struct Decomposition {
+    std::vector<uint64_t> a, b;
+    Complex lambda;
+  };
+
+  uint64_t* row_x(size_t r) { return xs.data() + r * words; }
+  uint64_t* row_z(size_t r) { return zs.data() + r * words; }
+  const uint64_t* row_x(size_t r) const { return xs.data() + r * words; }
+  const uint64_t* row_z(size_t r) const { return zs.data() + r * words; }
+
+  bool track_phase() const { return n <= PHASE_MAX_QUBITS; }
+
+  Pauli row(size_t r) const;
+  Pauli identity() const;
+  // p = p * row r
+  void mul_row(Pauli& p, size_t r) const;
+  // row h = row h * row i, which must commute
+  void rowsum(size_t h, size_t i);
+  Decomposition decompose(const Pauli& p) const;
+  // the stabilizer rows reduced on their x bits: the first rank of them have
+  // their lowest x bits at pivots[k], increasing, the rest are all z
+  std::vector<Pauli> x_echelon(std::vector<size_t>& pivots) const;
+  // <ref ^ (1 << qubit)|phi> / <ref|phi>
+  Complex ref_ratio(size_t qubit) const;
+
+  // conjugates the tableau by a single qubit clifford and updates ref with its matrix
+  void apply_clifford_1q(size_t qubit, const std::array<Complex, 4>& u);
+  // replaces the terms by the sum of the paulis in the frame, already decomposed
+  void apply_decomposed(std::span<const Decomposition> ds, std::span<const Complex> coefs);
+  // drops terms whose amplitude has cancelled
+  void prune();
+};
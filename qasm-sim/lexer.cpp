@@ -1,8 +1,20 @@
 #include "lexer.h"
-#include <cctype>
+#include "profiler.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
 #include <cstdint>
 #include <fstream>
+#include <optional>
 #include <print>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 struct KwEntry {
   std::string_view text;
@@ -27,9 +39,167 @@ static constexpr SymEntry sym_lut[] = {
 static constexpr size_t num_kw = std::size(kw_lut);
 static constexpr size_t num_sym = std::size(sym_lut);
 
+// bit k of kw_lens[c] is set if some keyword starts with c and has length k,
+// so most identifiers skip the keyword table entirely
+static constexpr std::array<uint32_t, 256> kw_lens = [] {
+  std::array<uint32_t, 256> t{};
+  for (const auto& kw : kw_lut)
+    t[static_cast<unsigned char>(kw.text[0])] |= 1u << kw.text.size();
+  return t;
+}();
+
+// sym_start[c] is the first entry of sym_lut starting with c (num_sym if none).
+// entries before it can't match, so lex_symbol starts its scan there
+static constexpr std::array<uint8_t, 256> sym_start = [] {
+  std::array<uint8_t, 256> t{};
+  t.fill(static_cast<uint8_t>(num_sym));
+  for (size_t i = num_sym; i-- > 0; )
+    t[sym_lut[i].sym[0]] = static_cast<uint8_t>(i);
+  return t;
+}();
+static_assert(num_sym < 256);
+
+// character classes, replacing the <cctype> calls (which are locale dependent and not inlined)
+enum : uint8_t {
+  CC_SPACE = 1,
+  CC_DIGIT = 2,
+  CC_HEX = 4,
+  CC_ALPHA = 8, // letters and '_', may start an identifier
+  CC_IDENT = 16 // letters, digits and '_'
+};
+
+static constexpr std::array<uint8_t, 256> char_class = [] {
+  std::array<uint8_t, 256> t{};
+  for (int c = 0; c < 256; c++) {
+    bool digit = '0' <= c && c <= '9';
+    bool alpha = ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+    if (c == ' ' || ('\t' <= c && c <= '\r'))
+      t[c] |= CC_SPACE;
+    if (digit)
+      t[c] |= CC_DIGIT;
+    if (digit || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F'))
+      t[c] |= CC_HEX;
+    if (alpha)
+      t[c] |= CC_ALPHA;
+    if (alpha || digit)
+      t[c] |= CC_IDENT;
+  }
+  return t;
+}();
+
+static inline bool is_class(unsigned char c, uint8_t cls) {
+  return (char_class[c] & cls) != 0;
+}
+
+// value of a hex digit, 0xFF for anything else
+static constexpr std::array<uint8_t, 256> digit_val = [] {
+  std::array<uint8_t, 256> t{};
+  t.fill(0xFF);
+  for (int c = '0'; c <= '9'; c++)
+    t[c] = static_cast<uint8_t>(c - '0');
+  for (int c = 'a'; c <= 'f'; c++) {
+    t[c] = static_cast<uint8_t>(c - 'a' + 10);
+    t[c - 'a' + 'A'] = static_cast<uint8_t>(c - 'a' + 10);
+  }
+  return t;
+}();
+
+// scans for the first byte matching a class, a vector of bytes at a time. every scan
+// stops at '\0', so with the padding after the text the loads never leave the buffer
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+using ByteVec = __m256i;
+static inline ByteVec load_bytes(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+static inline ByteVec splat(char c) { return _mm256_set1_epi8(c); }
+static inline ByteVec eq(ByteVec a, ByteVec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline ByteVec either(ByteVec a, ByteVec b) { return _mm256_or_si256(a, b); }
+static inline ByteVec sub(ByteVec a, ByteVec b) { return _mm256_sub_epi8(a, b); }
+static inline ByteVec min_u8(ByteVec a, ByteVec b) { return _mm256_min_epu8(a, b); }
+static inline uint32_t to_mask(ByteVec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+static constexpr size_t VEC_BYTES = 32;
+#else
+using ByteVec = __m128i;
+static inline ByteVec load_bytes(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+static inline ByteVec splat(char c) { return _mm_set1_epi8(c); }
+static inline ByteVec eq(ByteVec a, ByteVec b) { return _mm_cmpeq_epi8(a, b); }
+static inline ByteVec either(ByteVec a, ByteVec b) { return _mm_or_si128(a, b); }
+static inline ByteVec sub(ByteVec a, ByteVec b) { return _mm_sub_epi8(a, b); }
+static inline ByteVec min_u8(ByteVec a, ByteVec b) { return _mm_min_epu8(a, b); }
+static inline uint32_t to_mask(ByteVec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+static constexpr size_t VEC_BYTES = 16;
+#endif
+static constexpr uint32_t ALL_BYTES = static_cast<uint32_t>((1ULL << VEC_BYTES) - 1);
+
+// lo <= x <= lo + n, unsigned
+static inline ByteVec in_range(ByteVec x, char lo, char n) {
+  ByteVec t = sub(x, splat(lo));
+  return eq(min_u8(t, splat(n)), t);
+}
+
+// runs stop(bytes) over successive vectors until one has a bit set
+template <typename Stop>
+static inline const char* scan(const char* p, Stop stop) {
+  while (true) {
+    uint32_t m = stop(load_bytes(p));
+    if (m != 0)
+      return p + std::countr_zero(m);
+    p += VEC_BYTES;
+  }
+}
+
+static const char* find_either(const char* p, char a, char b) {
+  const ByteVec va = splat(a), vb = splat(b);
+  return scan(p, [&](ByteVec x) { return to_mask(either(eq(x, va), eq(x, vb))); });
+}
+
+static const char* find_any(const char* p, char a, char b, char c, char d) {
+  const ByteVec va = splat(a), vb = splat(b), vc = splat(c), vd = splat(d);
+  return scan(p, [&](ByteVec x) { return to_mask(either(either(eq(x, va), eq(x, vb)), either(eq(x, vc), eq(x, vd)))); });
+}
+
+static const char* skip_space(const char* p) {
+  return scan(p, [](ByteVec x) { return ~to_mask(either(eq(x, splat(' ')), in_range(x, '\t', '\r' - '\t'))) & ALL_BYTES; });
+}
+
+static const char* skip_ident(const char* p) {
+  return scan(p, [](ByteVec x) {
+    // setting bit 5 folds upper case onto lower case without letting anything else into a-z
+    ByteVec lower = either(x, splat(0x20));
+    ByteVec ident = either(either(in_range(lower, 'a', 'z' - 'a'), in_range(x, '0', 9)), eq(x, splat('_')));
+    return ~to_mask(ident) & ALL_BYTES;
+  });
+}
+#else
+static const char* find_either(const char* p, char a, char b) {
+  while (*p != a && *p != b)
+    ++p;
+  return p;
+}
+
+static const char* find_any(const char* p, char a, char b, char c, char d) {
+  while (*p != a && *p != b && *p != c && *p != d)
+    ++p;
+  return p;
+}
+
+static const char* skip_space(const char* p) {
+  while (is_class(*p, CC_SPACE))
+    ++p;
+  return p;
+}
+
+static const char* skip_ident(const char* p) {
+  while (is_class(*p, CC_IDENT))
+    ++p;
+  return p;
+}
+#endif
 
-Lexer::Lexer() {}
-Lexer::Lexer(const std::string &str) : file_contents(str) {}
+
+Lexer::Lexer() : file_contents(PAD, '\0') {}
+Lexer::Lexer(const std::string &str) : file_contents(str), len(str.size()) {
+  file_contents.append(PAD, '\0');
+}
 
 std::expected<Lexer, IoError> Lexer::from_file(const std::string &path) {
   Lexer lex;
@@ -43,12 +213,13 @@ std::expected<Lexer, IoError> Lexer::from_file(const std::string &path) {
   if (end < 0)
     return std::unexpected(IoError{IoError::Code::tell_failed, path});
 
-  lex.file_contents.resize(static_cast<size_t>(end));
+  lex.len = static_cast<size_t>(end);
+  lex.file_contents.assign(lex.len + PAD, '\0');
 
   file.seekg(0, std::ios::beg);
-  if (!lex.file_contents.empty() &&
+  if (lex.len != 0 &&
       !file.read(lex.file_contents.data(),
-                 static_cast<std::streamsize>(lex.file_contents.size())))
+                 static_cast<std::streamsize>(lex.len)))
     return std::unexpected(IoError{IoError::Code::read_failed, path});
 
   return lex;
@@ -71,8 +242,8 @@ std::expected<bool, LexError> Lexer::skip_ws_and_comments() {
     if (c == '\0') return false;
 
     // skip whitespace
-    if (std::isspace(c)) {
-      ++pos;
+    if (is_class(c, CC_SPACE)) {
+      pos = skip_space(file_contents.data() + pos) - file_contents.data();
       continue;
     }
 
@@ -82,12 +253,7 @@ std::expected<bool, LexError> Lexer::skip_ws_and_comments() {
 
       // line comment, skip to end of line
       if (c2 == '/') {
-        pos += 2;
-        while (true) {
-          unsigned char d = peek();
-          if (d == '\0' || d == '\n') break;
-	  ++pos;
-        }
+        pos = find_either(file_contents.data() + pos + 2, '\n', '\0') - file_contents.data();
         continue;
       }
 
@@ -95,11 +261,11 @@ std::expected<bool, LexError> Lexer::skip_ws_and_comments() {
       if (c2 == '*') {
         pos += 2;
         while (true) {
-          unsigned char d = peek();
-          if (d == '\0') {
+          pos = find_either(file_contents.data() + pos, '*', '\0') - file_contents.data();
+          if (peek() == '\0') {
 	    return std::unexpected(get_err(start, LexError::Code::unterminated_block_comment));
           }
-          if (d == '*' && peek(1) == '/') {
+          if (peek(1) == '/') {
             pos += 2;
             break;
           }
@@ -116,8 +282,7 @@ std::expected<bool, LexError> Lexer::skip_ws_and_comments() {
 
 
 unsigned char Lexer::peek(size_t lookahead) const {
-  size_t i = pos + lookahead;
-  return (i < file_contents.size()) ? file_contents[i] : '\0';
+  return file_contents[pos + lookahead];
 }
 
 unsigned char Lexer::peek_back(size_t lookback) const {
@@ -147,8 +312,8 @@ static inline bool is_valid_digit(num_lex_mode base, uint8_t ch) {
   switch (base) {
   case mode_float:
   case mode_exp:
-  case mode_dec: return std::isdigit(ch);
-  case mode_hex: return std::isxdigit(ch);
+  case mode_dec: return is_class(ch, CC_DIGIT);
+  case mode_hex: return is_class(ch, CC_HEX);
   case mode_oct: return ('0' <= ch && ch <= '7');
   case mode_bin: return (ch == '0' || ch == '1');
   }
@@ -178,31 +343,71 @@ static inline num_lex_mode detect_prefix(unsigned char c0, unsigned char c1) {
   return mode_dec;
 }
 
+// fills in tok's value from the literal text in [start, end), false if it doesn't fit
+static bool lit_value(const char* text, size_t start, size_t end, num_lex_mode mode, bool has_sep, Token& tok) {
+  if (mode == mode_float || mode == mode_exp) {
+    std::string_view s(text + start, end - start);
+    std::string digits;
+    if (has_sep) {
+      digits.reserve(s.size());
+      for (char c : s) {
+        if (c != '_')
+          digits.push_back(c);
+      }
+      s = digits;
+    }
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), tok.float_val);
+    return ec == std::errc() && ptr == s.data() + s.size();
+  }
+
+  static constexpr unsigned shift[] = { 0, 4, 3, 1 }; // bits per digit by mode, 0 for decimal
+  if (mode != mode_dec)
+    start += 2; // prefix
+  uint64_t v = 0;
+  for (size_t i = start; i < end; i++) {
+    uint8_t d = digit_val[static_cast<unsigned char>(text[i])];
+    if (d == 0xFF)
+      continue; // separator
+    if (mode == mode_dec) {
+      if (v > (UINT64_MAX - d) / 10)
+        return false;
+      v = v * 10 + d;
+    }
+    else {
+      if ((v >> (64 - shift[mode])) != 0)
+        return false;
+      v = (v << shift[mode]) | d;
+    }
+  }
+  tok.int_val = v;
+  return true;
+}
+
 std::expected<bool, LexError> Lexer::lex_version_id() {
   if (!skip_ws()) {
     return false;
   }
   size_t start = pos;
-  if (!std::isdigit(peek())) {
+  if (!is_class(peek(), CC_DIGIT)) {
     return std::unexpected(get_err(start, LexError::Code::bad_version_id));
   }
     
   do {
     ++pos;
-  } while (std::isdigit(peek()));
+  } while (is_class(peek(), CC_DIGIT));
     
   if (peek() == '.') {
     ++pos;
-    if (!std::isdigit(peek())) {
+    if (!is_class(peek(), CC_DIGIT)) {
       return std::unexpected(get_err(start, LexError::Code::bad_version_id));
     }
     
     do {
       ++pos;
-    } while (std::isdigit(peek()));
+    } while (is_class(peek(), CC_DIGIT));
   }
 
-  toks.push_back({TokenKind::VERSION_ID, {start, pos - start}});
+  toks.push_back({TokenKind::VERSION_ID, {start, pos - start}, {}});
   mode_stack.pop_back();
   return (peek() != '\0');
 }
@@ -232,22 +437,16 @@ std::expected<bool, LexError> Lexer::lex_arbitrary_str() {
     if (n == quotetype)
       break;
   }
-  toks.push_back({TokenKind::STR_LIT, {start, pos - start}});
+  toks.push_back({TokenKind::STR_LIT, {start, pos - start}, {}});
   mode_stack.pop_back();
   return (peek() != '\0');
 }
 
 std::expected<bool, LexError> Lexer::lex_kw(size_t start) {
-  ++pos;
-  while (true) {
-    unsigned char d = peek();
-    if (!std::isalnum(d) && d != '_')
-      break;
-    ++pos;
-  }
+  pos = skip_ident(file_contents.data() + start + 1) - file_contents.data();
   size_t tok_len = pos - start;
   std::string_view word(file_contents.data() + start, tok_len);
-  Token tok = {TokenKind::IDENT, {start, tok_len}};
+  Token tok = {TokenKind::IDENT, {start, tok_len}, {}};
 
   // check if we found a bool lit
   if (word == "true" || word == "false") {
@@ -257,7 +456,8 @@ std::expected<bool, LexError> Lexer::lex_kw(size_t start) {
   }
 
   // look up the extracted word: if it's in the table, it's a keyword, otherwise it's an identifier
-  for (size_t i = 0; i < num_kw; i++) {
+  const bool maybe_kw = tok_len < 32 && ((kw_lens[static_cast<unsigned char>(word[0])] >> tok_len) & 1);
+  for (size_t i = 0; maybe_kw && i < num_kw; i++) {
     if (word == kw_lut[i].text) {
       tok.kind = kw_lut[i].kind; // keyword found
       break;
@@ -265,6 +465,9 @@ std::expected<bool, LexError> Lexer::lex_kw(size_t start) {
   }
     
   switch (tok.kind) {
+  case TokenKind::IDENT:
+    tok.name_id = names.get_id(word);
+    break;
   case TokenKind::OPENQASM:
     mode_stack.push_back(LexMode::VERSION_ID);
     break;
@@ -291,11 +494,12 @@ std::expected<bool, LexError> Lexer::lex_num_lit(size_t start, unsigned char c)
 
   // leading '.' without digit after should be a dot token
   if (mode == mode_float && !is_valid_digit(mode, peek(1))) {
-    Token tok = {TokenKind::DOT, {start, 1}};
+    Token tok = {TokenKind::DOT, {start, 1}, {}};
     toks.push_back(tok);
     return (peek() != '\0');
   }
 
+  bool has_sep = false;
   ++pos;
   if (mode != mode_dec) {
     ++pos;
@@ -326,6 +530,7 @@ std::expected<bool, LexError> Lexer::lex_num_lit(size_t start, unsigned char c)
       if (!is_valid_digit(mode, peek(1))) {
 	return std::unexpected(get_err(start, LexError::Code::bad_literal));
       }
+      has_sep = true;
       pos += 2;
       continue;
     }
@@ -354,6 +559,9 @@ std::expected<bool, LexError> Lexer::lex_num_lit(size_t start, unsigned char c)
   }
 
   TokenKind tok_kind = mode_tbl[mode];
+  Token tok = {tok_kind, {start, 0}, {}};
+  if (!lit_value(file_contents.data(), start, pos, mode, has_sep, tok))
+    return std::unexpected(get_err(start, LexError::Code::bad_literal));
 
   if (mode == mode_dec || mode == mode_float || mode == mode_exp) {
     // probe for next non-ws character without advancing the pos
@@ -387,8 +595,13 @@ std::expected<bool, LexError> Lexer::lex_num_lit(size_t start, unsigned char c)
       tok_kind = (mode == mode_dec) ? TokenKind::IMAG_LIT_DEC : TokenKind::IMAG_LIT_FLOAT;
     }
   }
-    
-  toks.push_back({tok_kind, {start, pos-start}});
+
+  // a duration keeps its number as a float whatever it was written as
+  if (tok_kind == TokenKind::TIME_LIT && mode == mode_dec)
+    tok.float_val = static_cast<double>(tok.int_val);
+  tok.kind = tok_kind;
+  tok.span.len = pos - start;
+  toks.push_back(tok);
   return (peek() != '\0');
 }
 
@@ -401,7 +614,7 @@ std::expected<bool, LexError> Lexer::lex_symbol(size_t start, unsigned char c) {
 
   // symbol table is sorted by length descending:
   // maximally correct symbol will always be emitted
-  for (size_t i = 0; i < num_sym; i++) {
+  for (size_t i = sym_start[c]; i < num_sym; i++) {
     auto& e = sym_lut[i];
     if (c == e.sym[0]) { // first char match
       if (e.sym[1] != '\0') { // is multi-char symbol
@@ -456,11 +669,11 @@ std::expected<bool, LexError> Lexer::next_tok() {
 
   // first check for keywords/idents/bool literals
   // the spec allows for unicode but i am not opening that can of worms just yet
-  if (std::isalpha(c) || c == '_') {
+  if (is_class(c, CC_ALPHA)) {
     return lex_kw(start);
   }
   
-  if (std::isdigit(c) || c == '.') {
+  if (is_class(c, CC_DIGIT) || c == '.') {
     return lex_num_lit(start, c);
   }
 
@@ -482,13 +695,149 @@ std::expected<bool, LexError> Lexer::next_tok() {
         break;
     }
     ++pos; // consume closing quote
-    toks.push_back({TokenKind::BITSTR_LIT, start, pos - start});
+    toks.push_back({TokenKind::BITSTR_LIT, {start, pos - start}, {}});
     return (peek() != '\0');
   }
 
   return lex_symbol(start, c);
 }
 
+std::expected<void, LexError> Lexer::lex_all(size_t num_threads) {
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  const size_t num_chunks = std::min(num_threads, (len - pos) / PARALLEL_MIN_CHUNK);
+  if (pos == 0 && toks.empty() && num_chunks > 1) {
+    auto bounds = chunk_bounds(num_chunks);
+    if (bounds.size() > 2)
+      return lex_chunks(bounds);
+  }
+
+  PROFILE_SCOPE("lex", PROFILE_NO_QUBIT, len - pos);
+  // gate lists run one token per 1.5-4 bytes. growing the vector from empty costs
+  // more than the lexing itself on large inputs, and pages reserved past the last
+  // token are never touched
+  toks.reserve(toks.size() + (len - pos) / 2);
+  while (true) {
+    auto ok = next_tok();
+    if (!ok)
+      return std::unexpected(ok.error());
+    else if (!ok.value())
+      return {};
+  }
+}
+
+std::vector<size_t> Lexer::chunk_bounds(size_t num_chunks) const {
+  const char* s = file_contents.data();
+  std::vector<size_t> bounds = {0};
+  size_t i = 0;
+  for (size_t c = 1; c < num_chunks; c++) {
+    const size_t target = len * c / num_chunks;
+    bool found = false;
+    while (!found && s[i] != '\0') {
+      // comments and strings are the only places a ';' doesn't end a statement.
+      // short of the target only they matter, so jump between them
+      if (i < target) {
+        i = find_any(s + i, '/', '"', '\'', '\0') - s;
+        if (s[i] == '\0')
+          break;
+      }
+      const char ch = s[i];
+      if (ch == '/' && s[i + 1] == '/') {
+        i = find_either(s + i + 2, '\n', '\0') - s;
+      }
+      else if (ch == '/' && s[i + 1] == '*') {
+        i += 2;
+        while (true) {
+          i = find_either(s + i, '*', '\0') - s;
+          if (s[i] == '\0' || s[i + 1] == '/')
+            break;
+          ++i;
+        }
+        if (s[i] != '\0')
+          i += 2;
+      }
+      else if (ch == '"' || ch == '\'') {
+        // strings end at their quote or, unterminated, at the end of the line
+        ++i;
+        while (s[i] != ch && s[i] != '\n' && s[i] != '\0')
+          ++i;
+        if (s[i] == ch)
+          ++i;
+      }
+      else {
+        found = (ch == ';' && i >= target);
+        ++i;
+      }
+    }
+    if (!found || i >= len)
+      break;
+    bounds.push_back(i);
+  }
+  bounds.push_back(len);
+  return bounds;
+}
+
+// lexes each chunk into its own lexer on its own thread, then concatenates the tokens,
+// shifting spans to file offsets and mapping each chunk's name ids into this lexer's table
+std::expected<void, LexError> Lexer::lex_chunks(const std::vector<size_t>& bounds) {
+  PROFILE_SCOPE("lex", PROFILE_NO_QUBIT, len);
+  const size_t num_chunks = bounds.size() - 1;
+  std::vector<Lexer> parts(num_chunks);
+  std::vector<std::optional<LexError>> errs(num_chunks);
+
+  auto run = [&](auto fn) {
+    std::vector<std::thread> threads;
+    for (size_t c = 1; c < num_chunks; c++)
+      threads.emplace_back(fn, c);
+    fn(0);
+    for (auto& th : threads)
+      th.join();
+  };
+
+  run([&](size_t c) {
+    parts[c] = Lexer(file_contents.substr(bounds[c], bounds[c + 1] - bounds[c]));
+    if (auto ok = parts[c].lex_all(); !ok)
+      errs[c] = ok.error();
+  });
+
+  for (size_t c = 0; c < num_chunks; c++) {
+    if (errs[c]) {
+      // report the earliest error, with its span in file offsets
+      LexError err = *errs[c];
+      err.span.pos += bounds[c];
+      err.contents = str_from_span(err.span);
+      pos = err.span.pos + err.span.len;
+      return std::unexpected(err);
+    }
+  }
+
+  // names are merged in chunk order so ids come out as a single pass would number them
+  std::vector<std::vector<NameId>> remap(num_chunks);
+  std::vector<size_t> first_tok(num_chunks + 1, 0);
+  for (size_t c = 0; c < num_chunks; c++) {
+    const char* base = parts[c].file_contents.data();
+    for (auto name : parts[c].names.id_to_text) {
+      std::string_view text(file_contents.data() + bounds[c] + (name.data() - base), name.size());
+      remap[c].push_back(names.get_id(text));
+    }
+    first_tok[c + 1] = first_tok[c] + parts[c].toks.size();
+  }
+
+  toks.resize(first_tok[num_chunks]);
+  run([&](size_t c) {
+    Token* out = toks.data() + first_tok[c];
+    for (Token tok : parts[c].toks) {
+      tok.span.pos += bounds[c];
+      if (tok.kind == TokenKind::IDENT)
+        tok.name_id = remap[c][tok.name_id];
+      *out++ = tok;
+    }
+    parts[c] = Lexer();
+  });
+
+  pos = len;
+  return {};
+}
 
 std::string_view Lexer::str_from_span(Span span) {
   return std::string_view(file_contents.data() + span.pos, span.len);
@@ -0,0 +1,88 @@
+#include "mapped_file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::create(const std::string& path, size_t len) {
+  size = len;
+#ifdef _WIN32
+  file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(len >> 32), static_cast<DWORD>(len), nullptr);
+  if (!mapping)
+    return false;
+  data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, len));
+  return data != nullptr;
+#else
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(len)) != 0)
+    return false;
+  void* p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  data = static_cast<char*>(p);
+  return true;
+#endif
+}
+
+bool MappedFile::open_read(const std::string& path) {
+#ifdef _WIN32
+  file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER len;
+  if (!GetFileSizeEx(file, &len))
+    return false;
+  size = static_cast<size_t>(len.QuadPart);
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping)
+    return false;
+  data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  return data != nullptr;
+#else
+  fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) != 0)
+    return false;
+  size = static_cast<size_t>(st.st_size);
+  void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  data = static_cast<char*>(p);
+  ::madvise(p, size, MADV_SEQUENTIAL);
+  return true;
+#endif
+}
+
+bool MappedFile::sync() {
+#ifdef _WIN32
+  return FlushViewOfFile(data, 0) && FlushFileBuffers(file);
+#else
+  return ::msync(data, size, MS_SYNC) == 0;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+  mapping = nullptr;
+  file = INVALID_HANDLE_VALUE;
+#else
+  if (data)
+    ::munmap(data, size);
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+#endif
+  data = nullptr;
+}
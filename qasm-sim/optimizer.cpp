@@ -0,0 +1,453 @@
+#include "optimizer.h"
+#include "profiler.h"
+#include <cmath>
+#include <numbers>
+
+static constexpr double EPS = 1e-12;
+static constexpr uint32_t NO_OP = UINT32_MAX;
+
+// the basis an op is diagonal in on one of its qubits
+enum class Axis : uint8_t { NONE, X, Y, Z };
+
+// axis of op on its k-th qubit. controls are always Z
+static Axis axis(const Op& op, size_t k) {
+  if (op.cond != NO_COND)
+    return Axis::NONE;
+  switch (op.kind) {
+  case OpKind::ID:
+  case OpKind::Z:
+  case OpKind::S:
+  case OpKind::SDG:
+  case OpKind::T:
+  case OpKind::TDG:
+  case OpKind::RZ:
+  case OpKind::P:
+  case OpKind::CZ:
+  case OpKind::CP:
+  case OpKind::CRZ:
+    return Axis::Z;
+  case OpKind::X:
+  case OpKind::SX:
+  case OpKind::RX:
+    return Axis::X;
+  case OpKind::Y:
+  case OpKind::RY:
+    return Axis::Y;
+  case OpKind::CX:
+  case OpKind::CRX:
+    return k == 0 ? Axis::Z : Axis::X;
+  case OpKind::CY:
+  case OpKind::CRY:
+    return k == 0 ? Axis::Z : Axis::Y;
+  case OpKind::CCX:
+    return k < 2 ? Axis::Z : Axis::X;
+  case OpKind::CH:
+  case OpKind::CU:
+  case OpKind::CSWAP:
+    return k == 0 ? Axis::Z : Axis::NONE;
+  default:
+    return Axis::NONE;
+  }
+}
+
+// both ops are diagonal in one shared basis on every qubit they share
+static bool commutes(const Op& a, const Op& b) {
+  for (size_t i = 0; i < a.num_qubits(); i++) {
+    for (size_t j = 0; j < b.num_qubits(); j++) {
+      if (a.qubit(i) != b.qubit(j))
+        continue;
+      Axis x = axis(a, i);
+      if (x == Axis::NONE || x != axis(b, j))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool is_self_inverse(OpKind k) {
+  switch (k) {
+  case OpKind::H:
+  case OpKind::X:
+  case OpKind::Y:
+  case OpKind::CX:
+  case OpKind::CY:
+  case OpKind::CZ:
+  case OpKind::CH:
+  case OpKind::SWAP:
+  case OpKind::CCX:
+  case OpKind::CSWAP:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// rotations that merge by adding angles. the fixed phase gates join p,
+// rz stays apart from it since the two differ by a global phase
+enum class Rotation : uint8_t { NONE, PHASE, RX, RY, RZ, CP, CRX, CRY, CRZ };
+
+static Rotation rotation(OpKind k) {
+  switch (k) {
+  case OpKind::Z:
+  case OpKind::S:
+  case OpKind::SDG:
+  case OpKind::T:
+  case OpKind::TDG:
+  case OpKind::P:
+    return Rotation::PHASE;
+  case OpKind::RX: return Rotation::RX;
+  case OpKind::RY: return Rotation::RY;
+  case OpKind::RZ: return Rotation::RZ;
+  case OpKind::CP: return Rotation::CP;
+  case OpKind::CRX: return Rotation::CRX;
+  case OpKind::CRY: return Rotation::CRY;
+  case OpKind::CRZ: return Rotation::CRZ;
+  default: return Rotation::NONE;
+  }
+}
+
+// angle at which the rotation comes back to the identity, global phase included
+static double period(Rotation r) {
+  return (r == Rotation::PHASE || r == Rotation::CP) ? 2 * std::numbers::pi : 4 * std::numbers::pi;
+}
+
+// a and b act on the same qubits in the same roles
+static bool same_operands(const Op& a, const Op& b) {
+  auto& p = a.qubits;
+  auto& q = b.qubits;
+  if (a.count != b.count)
+    return false;
+  if (a.count > 1)
+    return p[0] == q[0];
+  switch (a.kind) {
+  case OpKind::CZ:
+  case OpKind::CP:
+  case OpKind::SWAP:
+    return (p[0] == q[0] && p[1] == q[1]) || (p[0] == q[1] && p[1] == q[0]);
+  case OpKind::CCX:
+    return p[2] == q[2] && ((p[0] == q[0] && p[1] == q[1]) || (p[0] == q[1] && p[1] == q[0]));
+  case OpKind::CSWAP:
+    return p[0] == q[0] && ((p[1] == q[1] && p[2] == q[2]) || (p[1] == q[2] && p[2] == q[1]));
+  default:
+    for (size_t i = 0; i < a.num_qubits(); i++) {
+      if (p[i] != q[i])
+        return false;
+    }
+    return true;
+  }
+}
+
+// largest number of values eval holds at once for code
+static size_t stack_depth(const std::vector<ParamInstr>& code) {
+  size_t top = 0, depth = 0;
+  for (const auto& in : code) {
+    using enum ParamInstr::Code;
+    switch (in.code) {
+    case CONST:
+    case INPUT:
+      depth = std::max(depth, ++top);
+      break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case POW:
+      --top;
+      break;
+    default:
+      break;
+    }
+  }
+  return depth;
+}
+
+struct Optimizer {
+  // ops looked through on each qubit when searching for a partner
+  static constexpr size_t WINDOW = 32;
+
+  Circuit& circ;
+  std::vector<Op> out;
+  std::vector<uint8_t> dead;
+  std::vector<std::vector<uint32_t>> on_qubit; // indices into out touching each qubit, in order
+  OptStats stats;
+
+  Optimizer(Circuit& c) : circ(c), on_qubit(c.num_qubits) {}
+
+  ParamExpr angle(const Op& op) const {
+    using std::numbers::pi;
+    auto fixed = [](double v) { return ParamExpr{{{ParamInstr::Code::CONST, 0, v}}}; };
+    switch (op.kind) {
+    case OpKind::Z: return fixed(pi);
+    case OpKind::S: return fixed(pi / 2);
+    case OpKind::SDG: return fixed(-pi / 2);
+    case OpKind::T: return fixed(pi / 4);
+    case OpKind::TDG: return fixed(-pi / 4);
+    default: return circ.params[op.params[0]];
+    }
+  }
+
+  bool is_identity(const Op& op) const {
+    if (op.kind == OpKind::ID)
+      return true;
+    Rotation r = rotation(op.kind);
+    if (r == Rotation::NONE)
+      return false;
+    auto e = angle(op);
+    if (!e.is_const())
+      return false;
+    double a = std::fmod(std::fabs(e.code[0].val), period(r));
+    return a < EPS || period(r) - a < EPS;
+  }
+
+  // names a constant phase by its fixed gate where there is one
+  static OpKind phase_kind(double a) {
+    using std::numbers::pi;
+    a = std::fmod(a, 2 * pi);
+    if (a < 0)
+      a += 2 * pi;
+    auto near = [&](double v) { return std::fabs(a - v) < EPS; };
+    if (near(pi)) return OpKind::Z;
+    if (near(pi / 2)) return OpKind::S;
+    if (near(3 * pi / 2)) return OpKind::SDG;
+    if (near(pi / 4)) return OpKind::T;
+    if (near(7 * pi / 4)) return OpKind::TDG;
+    return OpKind::P;
+  }
+
+  // folds op's angle into the earlier rotation at c. false if the sum
+  // would be too deep for eval
+  bool merge(uint32_t c, const Op& op) {
+    ParamExpr a = angle(out[c]), b = angle(op);
+    ParamExpr sum;
+    if (a.is_const() && b.is_const()) {
+      sum.code = {{ParamInstr::Code::CONST, 0, a.code[0].val + b.code[0].val}};
+    }
+    else {
+      sum.code = std::move(a.code);
+      sum.code.insert(sum.code.end(), b.code.begin(), b.code.end());
+      sum.code.push_back({ParamInstr::Code::ADD});
+      if (stack_depth(sum.code) > ParamExpr::MAX_DEPTH)
+        return false;
+    }
+
+    Op& m = out[c];
+    if (rotation(m.kind) == Rotation::PHASE)
+      m.kind = sum.is_const() ? phase_kind(sum.code[0].val) : OpKind::P;
+    // ParamIds can be shared by the ops of a broadcast, so the sum gets its own
+    circ.params.push_back(std::move(sum));
+    m.params[0] = static_cast<ParamId>(circ.params.size() - 1);
+    return true;
+  }
+
+  // every live op after c on op's qubits commutes with op
+  bool clear_after(uint32_t c, const Op& op) const {
+    for (size_t i = 0; i < op.num_qubits(); i++) {
+      const auto& ops = on_qubit[op.qubit(i)];
+      size_t seen = 0;
+      for (size_t k = ops.size(); k-- > 0 && ops[k] > c;) {
+        if (++seen > WINDOW)
+          return false;
+        if (!dead[ops[k]] && !commutes(out[ops[k]], op))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // the earlier op op can combine with, or NO_OP. only ops on op's first qubit
+  // are candidates since a partner has to act on all of them
+  uint32_t partner(const Op& op) const {
+    const auto& ops = on_qubit[op.qubits[0]];
+    size_t seen = 0;
+    for (size_t k = ops.size(); k-- > 0 && seen++ < WINDOW;) {
+      uint32_t c = ops[k];
+      if (dead[c])
+        continue;
+      const Op& prev = out[c];
+      bool same_kind = is_self_inverse(op.kind) ? prev.kind == op.kind
+                                                : rotation(op.kind) != Rotation::NONE && rotation(prev.kind) == rotation(op.kind);
+      if (same_kind && prev.cond == NO_COND && same_operands(prev, op))
+        return clear_after(c, op) ? c : NO_OP;
+      if (!commutes(prev, op))
+        return NO_OP;
+    }
+    return NO_OP;
+  }
+
+  void kill(uint32_t c) {
+    dead[c] = 1;
+    // keeps the per-qubit lists short when gates cancel back to back
+    for (size_t i = 0; i < out[c].num_qubits(); i++) {
+      auto& ops = on_qubit[out[c].qubit(i)];
+      while (!ops.empty() && dead[ops.back()])
+        ops.pop_back();
+    }
+  }
+
+  void push(const Op& op) {
+    for (size_t i = 0; i < op.num_qubits(); i++)
+      on_qubit[op.qubit(i)].push_back(static_cast<uint32_t>(out.size()));
+    out.push_back(op);
+    dead.push_back(0);
+  }
+
+  void add(const Op& op) {
+    if (op.cond != NO_COND || op.kind >= OpKind::MEASURE) {
+      push(op);
+      return;
+    }
+    if (is_identity(op)) {
+      stats.dropped++;
+      return;
+    }
+
+    uint32_t c = partner(op);
+    if (c == NO_OP) {
+      push(op);
+      return;
+    }
+    if (is_self_inverse(op.kind)) {
+      kill(c);
+      stats.cancelled += 2;
+      return;
+    }
+    if (!merge(c, op)) {
+      push(op);
+      return;
+    }
+    stats.merged++;
+    if (is_identity(out[c])) {
+      kill(c);
+      stats.dropped++;
+    }
+  }
+};
+
+// the textbook qft on a_0 .. a_{n-1}: for each j, h a_j and then cp(pi / 2^(k - j)) a_k, a_j
+// for each k > j, in any order. the inverse is the same read backwards with the angles
+// negated. a_0 is the most significant bit, and only registers with a_j = a_0 + j or
+// a_0 - j are matched since those fit in an Op
+struct QftMatcher {
+  const Circuit& circ;
+  std::span<const Op> ops;
+  size_t start;
+  int dir;     // +1 reads forward from start, -1 backwards
+  double sign; // of the cp angles
+
+  const Op* at(size_t k) const {
+    if (dir < 0 ? k > start : start + k >= ops.size())
+      return nullptr;
+    const Op& op = ops[dir < 0 ? start - k : start + k];
+    return op.cond == NO_COND && op.count == 1 ? &op : nullptr;
+  }
+
+  // d if op is cp(sign pi / 2^d) between q and another qubit, else 0
+  size_t cp_distance(const Op* op, uint32_t q, uint32_t& other) const {
+    if (!op || op->kind != OpKind::CP || (op->qubits[0] != q && op->qubits[1] != q))
+      return 0;
+    const auto& e = circ.params[op->params[0]];
+    if (!e.is_const() || sign * e.code[0].val <= 0)
+      return 0;
+    double d = std::round(std::log2(std::numbers::pi / (sign * e.code[0].val)));
+    if (d < 1 || d > 62 || std::fabs(sign * e.code[0].val - std::ldexp(std::numbers::pi, -static_cast<int>(d))) > EPS)
+      return 0;
+    other = op->qubits[0] == q ? op->qubits[1] : op->qubits[0];
+    return static_cast<size_t>(d);
+  }
+
+  // the number of ops in the transform at start, 0 if there isn't one, and the op
+  // replacing them in t
+  size_t match(Op& t) const {
+    const Op* h = at(0);
+    if (!h || h->kind != OpKind::H)
+      return 0;
+    const int64_t a0 = h->qubits[0];
+
+    // the first qubit's phases give n and which way the register runs
+    size_t k = 1;
+    int64_t step = 0;
+    uint32_t other;
+    while (size_t d = cp_distance(at(k), static_cast<uint32_t>(a0), other)) {
+      int64_t s = (static_cast<int64_t>(other) - a0) / static_cast<int64_t>(d);
+      if ((s != 1 && s != -1) || other != a0 + s * static_cast<int64_t>(d) || (step != 0 && s != step))
+        break;
+      step = s;
+      k++;
+    }
+    const size_t n = k;
+    if (n < 2 || n > UINT16_MAX)
+      return 0;
+
+    std::vector<uint8_t> seen(n);
+    auto phases_of = [&](size_t j, size_t first) {
+      std::fill(seen.begin(), seen.end(), 0);
+      const uint32_t q = static_cast<uint32_t>(a0 + step * static_cast<int64_t>(j));
+      for (size_t c = 0; c < n - 1 - j; c++) {
+        size_t d = cp_distance(at(first + c), q, other);
+        if (d == 0 || j + d >= n || seen[d] || other != a0 + step * static_cast<int64_t>(j + d))
+          return false;
+        seen[d] = 1;
+      }
+      return true;
+    };
+    if (!phases_of(0, 1))
+      return 0;
+    for (size_t j = 1; j < n; j++) {
+      h = at(k);
+      if (!h || h->kind != OpKind::H || h->qubits[0] != a0 + step * static_cast<int64_t>(j) || !phases_of(j, k + 1))
+        return 0;
+      k += n - j;
+    }
+
+    t = Op{sign > 0 ? OpKind::QFT : OpKind::IQFT};
+    t.count = static_cast<uint16_t>(n);
+    t.qubits[0] = static_cast<uint32_t>(step > 0 ? a0 : a0 - static_cast<int64_t>(n - 1));
+    t.qubits[1] = step < 0;
+    return k;
+  }
+};
+
+// replaces every qft and iqft pattern in circ by a single op, returning how many
+static size_t fuse_transforms(Circuit& circ) {
+  std::vector<Op> out;
+  out.reserve(circ.ops.size());
+  size_t found = 0;
+  Op t;
+  for (size_t i = 0; i < circ.ops.size();) {
+    if (size_t len = QftMatcher{circ, circ.ops, i, 1, 1.0}.match(t)) {
+      out.push_back(t);
+      i += len;
+      found++;
+      continue;
+    }
+    out.push_back(circ.ops[i++]);
+    // an inverse ends on a hadamard, with the rest of it already in out
+    if (out.back().kind != OpKind::H)
+      continue;
+    if (size_t len = QftMatcher{circ, out, out.size() - 1, -1, -1.0}.match(t)) {
+      out.resize(out.size() - len);
+      out.push_back(t);
+      found++;
+    }
+  }
+  circ.ops = std::move(out);
+  return found;
+}
+
+OptStats optimize(Circuit& circ) {
+  PROFILE_SCOPE("optimize", PROFILE_NO_QUBIT, circ.ops.size() * sizeof(Op));
+  Optimizer opt(circ);
+  opt.stats.ops_before = circ.ops.size();
+  opt.stats.transforms = fuse_transforms(circ);
+  opt.out.reserve(circ.ops.size());
+  for (const auto& op : circ.ops)
+    opt.add(op);
+
+  circ.ops.clear();
+  for (size_t i = 0; i < opt.out.size(); i++) {
+    if (!opt.dead[i])
+      circ.ops.push_back(opt.out[i]);
+  }
+  opt.stats.ops_after = circ.ops.size();
+  return opt.stats;
+}
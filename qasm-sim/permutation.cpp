@@ -0,0 +1,66 @@
+#include "permutation.h"
+#include <bit>
+#include <utility>
+
+// the inverse of a stage's gates g1..gk is g1(g2(...gk(idx))) since each gate is
+// its own inverse, so appending a gate g turns the stage map M into M(g(idx)).
+// with M(idx) = A idx ^ mask:
+//   x(t):      M(idx ^ e_t)          -> mask ^= A e_t
+//   cnot(c,t): M(idx ^ idx_c * e_t)  -> column c of A ^= column t
+//   swap(a,b): M(idx with a, b swapped) -> columns a and b of A swap
+static void finish_affine(std::vector<IndexMap::Stage>& stages, const std::vector<uint64_t>& cols, uint64_t mask) {
+  bool linear_identity = true;
+  for (size_t c = 0; c < cols.size() && linear_identity; c++)
+    linear_identity = (cols[c] == (1ULL << c));
+  if (linear_identity && mask == 0)
+    return;
+
+  IndexMap::Stage st{false, linear_identity, mask, 0, {}};
+  size_t num_bytes = (cols.size() + 7) / 8;
+  st.tables.assign(num_bytes * 256, 0);
+  for (size_t b = 0; b < num_bytes; b++) {
+    uint64_t* table = st.tables.data() + b * 256;
+    for (size_t v = 1; v < 256; v++) {
+      // extend from the entry without the lowest set bit
+      size_t low = static_cast<size_t>(std::countr_zero(v));
+      size_t c = 8 * b + low;
+      table[v] = table[v & (v - 1)] ^ (c < cols.size() ? cols[c] : 0);
+    }
+  }
+  stages.push_back(std::move(st));
+}
+
+IndexMap::IndexMap(size_t n, std::span<const PermGate> gates) {
+  std::vector<uint64_t> cols(n);
+  auto reset_cols = [&] {
+    for (size_t c = 0; c < n; c++)
+      cols[c] = 1ULL << c;
+  };
+  reset_cols();
+  uint64_t mask = 0;
+
+  for (const auto& g : gates) {
+    switch (g.kind) {
+    case PermGate::Kind::X:
+      mask ^= cols[g.qubit];
+      break;
+    case PermGate::Kind::CNOT:
+      cols[g.cntrl1] ^= cols[g.qubit];
+      break;
+    case PermGate::Kind::SWAP:
+      std::swap(cols[g.qubit], cols[g.cntrl1]);
+      break;
+    case PermGate::Kind::TOFFOLI:
+      finish_affine(stages, cols, mask);
+      reset_cols();
+      mask = 0;
+      stages.push_back({true, false, 1ULL << g.qubit, (1ULL << g.cntrl1) | (1ULL << g.cntrl2), {}});
+      break;
+    }
+  }
+  finish_affine(stages, cols, mask);
+}
+
+bool IndexMap::is_xor() const {
+  return stages.size() == 1 && stages[0].is_xor;
+}
@@ -0,0 +1,250 @@
+#include "profiler.h"
+
+#ifdef QASM_SIM_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t MAX_TRACE_EVENTS = 1 << 20; // per thread
+static constexpr size_t NUM_COUNTERS = 3;
+
+struct StatKey {
+  const char* name;
+  uint32_t qubit;
+
+  bool operator==(const StatKey&) const = default;
+};
+
+struct StatKeyHash {
+  size_t operator()(const StatKey& k) const {
+    return std::hash<const void*>()(k.name) ^ (static_cast<size_t>(k.qubit) * 0x9E3779B97F4A7C15ULL);
+  }
+};
+
+struct ProfileStat {
+  uint64_t calls = 0;
+  uint64_t ns = 0;
+  uint64_t bytes = 0;
+  uint64_t counters[NUM_COUNTERS] = {};
+};
+
+struct TraceEvent {
+  const char* name;
+  uint32_t qubit;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+};
+
+struct ThreadProfile {
+  uint32_t tid;
+  std::unordered_map<StatKey, ProfileStat, StatKeyHash> stats;
+  std::vector<TraceEvent> trace;
+  int perf_fds[NUM_COUNTERS] = { -1, -1, -1 }; // [0] leads the group, -1 when counters are off
+
+  ~ThreadProfile() {
+#ifdef __linux__
+    for (int fd : perf_fds) {
+      if (fd >= 0)
+        ::close(fd);
+    }
+#endif
+  }
+
+  bool read_counters(uint64_t out[NUM_COUNTERS]) {
+#ifdef __linux__
+    if (perf_fds[0] < 0)
+      return false;
+    uint64_t buf[1 + NUM_COUNTERS];
+    if (::read(perf_fds[0], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf)))
+      return false;
+    std::copy_n(buf + 1, NUM_COUNTERS, out);
+    return true;
+#else
+    (void)out;
+    return false;
+#endif
+  }
+};
+
+// thread tables stay alive in the registry after their thread exits so they can still be reported
+static std::mutex registry_mtx;
+static std::vector<std::unique_ptr<ThreadProfile>> registry;
+static Clock::time_point epoch;
+static bool use_counters = false;
+static std::atomic<bool> counters_opened = false; // by at least one thread
+
+#ifdef __linux__
+static int open_counter(uint64_t config, int group_fd) {
+  perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = (group_fd < 0);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+// cycles, instructions, cache misses as one group so they can be read together
+static void open_counters(int fds[NUM_COUNTERS]) {
+  static constexpr uint64_t configs[NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+  };
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    fds[i] = open_counter(configs[i], i == 0 ? -1 : fds[0]);
+    if (fds[i] < 0) {
+      for (size_t j = 0; j < i; j++) {
+        ::close(fds[j]);
+        fds[j] = -1;
+      }
+      return;
+    }
+  }
+  ::ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+#endif
+
+static ThreadProfile* this_thread_profile() {
+  thread_local ThreadProfile* prof = nullptr;
+  if (prof)
+    return prof;
+
+  auto p = std::make_unique<ThreadProfile>();
+#ifdef __linux__
+  if (use_counters)
+    open_counters(p->perf_fds);
+  if (p->perf_fds[0] >= 0)
+    counters_opened = true;
+#endif
+  std::lock_guard lock(registry_mtx);
+  p->tid = static_cast<uint32_t>(registry.size());
+  prof = p.get();
+  registry.push_back(std::move(p));
+  return prof;
+}
+
+void Profiler::enable(bool hw_counters) {
+  epoch = Clock::now();
+  use_counters = hw_counters;
+  active = true;
+}
+
+ProfileScope::ProfileScope(const char* n, uint32_t q, uint64_t b) : name(nullptr), qubit(q), bytes(b), prof(nullptr) {
+  if (!Profiler::active)
+    return;
+  name = n;
+  prof = this_thread_profile();
+  if (!prof->read_counters(counters))
+    std::fill_n(counters, NUM_COUNTERS, 0);
+  start = Clock::now();
+}
+
+ProfileScope::~ProfileScope() {
+  if (!name)
+    return;
+  auto end = Clock::now();
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+  auto& s = prof->stats[{name, qubit}];
+  s.calls++;
+  s.ns += ns;
+  s.bytes += bytes;
+
+  uint64_t now[NUM_COUNTERS];
+  if (prof->read_counters(now)) {
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+      s.counters[i] += now[i] - counters[i];
+  }
+
+  if (prof->trace.size() < MAX_TRACE_EVENTS) {
+    uint64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count();
+    prof->trace.push_back({name, qubit, start_ns, ns});
+  }
+}
+
+void Profiler::print_summary() {
+  std::unordered_map<StatKey, ProfileStat, StatKeyHash> merged;
+  {
+    std::lock_guard lock(registry_mtx);
+    for (const auto& p : registry) {
+      for (const auto& [k, s] : p->stats) {
+        auto& m = merged[k];
+        m.calls += s.calls;
+        m.ns += s.ns;
+        m.bytes += s.bytes;
+        for (size_t i = 0; i < NUM_COUNTERS; i++)
+          m.counters[i] += s.counters[i];
+      }
+    }
+  }
+
+  std::vector<std::pair<StatKey, ProfileStat>> rows(merged.begin(), merged.end());
+  std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.ns > b.second.ns; });
+
+  const bool show_hw = counters_opened;
+  if (use_counters && !show_hw)
+    std::println(stderr, "hardware counters unavailable (perf_event_open failed)");
+
+  std::println(stderr, "{:<20} {:>6} {:>10} {:>12} {:>12} {:>10}{}", "op", "qubit", "calls", "total ms", "avg us", "GB/s",
+               show_hw ? "       cycles    IPC   cache miss" : "");
+  for (const auto& [k, s] : rows) {
+    std::string qubit = (k.qubit == PROFILE_NO_QUBIT) ? "-" : std::to_string(k.qubit);
+    double gbps = s.ns ? static_cast<double>(s.bytes) / s.ns : 0.0;
+    std::string hw;
+    if (show_hw) {
+      double ipc = s.counters[0] ? static_cast<double>(s.counters[1]) / s.counters[0] : 0.0;
+      hw = std::format(" {:>12} {:>6.2f} {:>12}", s.counters[0], ipc, s.counters[2]);
+    }
+    std::println(stderr, "{:<20} {:>6} {:>10} {:>12.3f} {:>12.3f} {:>10.3f}{}", k.name, qubit, s.calls,
+                 s.ns / 1e6, s.ns / 1e3 / s.calls, gbps, hw);
+  }
+}
+
+bool Profiler::write_trace(const std::string& path) {
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+    return false;
+
+  // chrome://tracing / perfetto "complete" events, timestamps in microseconds
+  std::string buf = "{\"traceEvents\":[\n";
+  bool first = true;
+  std::lock_guard lock(registry_mtx);
+  for (const auto& p : registry) {
+    for (const auto& e : p->trace) {
+      if (!first)
+        buf += ",\n";
+      first = false;
+      buf += std::format("{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}", e.name, p->tid,
+                         e.start_ns / 1e3, e.dur_ns / 1e3);
+      if (e.qubit != PROFILE_NO_QUBIT)
+        buf += std::format(",\"args\":{{\"qubit\":{}}}", e.qubit);
+      buf += "}";
+      if (buf.size() > (1 << 20)) {
+        out << buf;
+        buf.clear();
+      }
+    }
+  }
+  buf += "\n]}\n";
+  out << buf;
+  return static_cast<bool>(out);
+}
+
+#endif
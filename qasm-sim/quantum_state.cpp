@@ -1,228 +1,1377 @@
 #include "quantum_state.h"
+#include "profiler.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <limits>
+#include <numbers>
 #include <print>
-#include <bitset>
+#include <thread>
+#include <utility>
 
 static constexpr double EPS = 1e-12;
 
+// bytes moved by one read + write pass over the state, for the profiler
+template <AmpLayout L>
+static inline uint64_t sweep_bytes(const AmpVector<L>& psi) {
+  return 2 * psi.size() * sizeof(Complex);
+}
+
+using BitLut = std::vector<std::array<size_t, 256>>;
+
+// entry for every byte of a width bit index: bit to is set where the byte holds bit
+// from of the index, for each (from, to) in moves
+static BitLut bit_lut(std::span<const std::pair<size_t, size_t>> moves, size_t width) {
+  BitLut lut(std::max<size_t>((width + 7) / 8, 1));
+  for (auto& t : lut)
+    t.fill(0);
+  for (auto [from, to] : moves) {
+    for (size_t v = 0; v < 256; v++)
+      lut[from / 8][v] |= ((v >> (from % 8)) & 1) << to;
+  }
+  return lut;
+}
+
+// the index with its bits moved as the table says
+static size_t move_bits(const BitLut& lut, size_t i) {
+  size_t res = 0;
+  for (size_t b = 0; b < lut.size(); b++)
+    res |= lut[b][(i >> (8 * b)) & 255];
+  return res;
+}
+
+// entry of a joint probability table for every byte of a psi index: bit j is set
+// where the byte holds bit pos[j] of the index
+static BitLut joint_lut(std::span<const size_t> pos, size_t width) {
+  std::vector<std::pair<size_t, size_t>> moves;
+  for (size_t j = 0; j < pos.size(); j++)
+    moves.push_back({ pos[j], j });
+  return bit_lut(moves, width);
+}
+
+// adds the probabilities of psi indices [first, last) into joint, first a multiple of 256
+template <AmpLayout L>
+static void sum_joint(const AmpVector<L>& psi, const BitLut& lut, std::span<double> joint,
+                      size_t first, size_t last) {
+  const size_t low = std::min<size_t>(last - first, 256);
+  for (size_t i0 = first; i0 < last; i0 += 256) {
+    size_t hi = 0;
+    for (size_t b = 1; b < lut.size(); b++)
+      hi |= lut[b][(i0 >> (8 * b)) & 255];
+    for (size_t i = 0; i < low; i++)
+      joint[hi | lut[0][i]] += psi.norm(i0 + i);
+  }
+}
+
+// runs fn(part) for every part in [0, num_parts), spread over num_threads threads
+template <class Fn>
+static void parallel_parts(size_t num_parts, size_t num_threads, Fn fn) {
+  if (num_threads == 0)
+    num_threads = std::thread::hardware_concurrency();
+  num_threads = std::clamp<size_t>(num_threads, 1, num_parts);
+  auto work = [&](size_t t) {
+    for (size_t p = t; p < num_parts; p += num_threads)
+      fn(p);
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; t++)
+    threads.emplace_back(work, t);
+  work(0);
+  for (auto& th : threads)
+    th.join();
+}
+
+// eager kernels for the permutation gates, used when they aren't worth queueing
+template <AmpLayout L>
+static void cnot_kernel(AmpVector<L>& psi, size_t cntrl, size_t qubit) {
+  PROFILE_SCOPE("apply_cnot", qubit, sweep_bytes(psi) / 2);
+  size_t bit = 1ULL << qubit;
+  size_t control_bit = 1ULL << cntrl;
+
+  for (size_t i = 0; i < psi.size(); i++) {
+    if ((i & control_bit) != 0 && (i & bit) == 0) {
+      psi.swap_amps(i, i | bit);
+    }
+  }
+}
+
+template <AmpLayout L>
+static void x_kernel(AmpVector<L>& psi, size_t qubit) {
+  PROFILE_SCOPE("apply_x", qubit, sweep_bytes(psi));
+  size_t bit = 1ULL << qubit;
+
+  for (size_t i = 0; i < psi.size(); i++) {
+    if ((i & bit) == 0) {
+      psi.swap_amps(i, i | bit);
+    }
+  }
+}
+
+template <AmpLayout L>
+static void swap_kernel(AmpVector<L>& psi, size_t qubit1, size_t qubit2) {
+  PROFILE_SCOPE("swap", qubit1, sweep_bytes(psi) / 2);
+  size_t bit1 = 1ULL << qubit1;
+  size_t bit2 = 1ULL << qubit2;
+
+  for (size_t i = 0; i < psi.size(); i++) {
+    if ((i & bit1) != 0 && (i & bit2) == 0) {
+      psi.swap_amps(i, i ^ bit1 ^ bit2);
+    }
+  }
+}
+
+template <AmpLayout L>
+static void toffoli_kernel(AmpVector<L>& psi, size_t cntrl1, size_t cntrl2, size_t qubit) {
+  PROFILE_SCOPE("apply_toffoli", qubit, sweep_bytes(psi) / 4);
+  size_t bit = 1ULL << qubit;
+  size_t control_bit1 = 1ULL << cntrl1;
+  size_t control_bit2 = 1ULL << cntrl2;
+
+  for (size_t i = 0; i < psi.size(); i++) {
+    if ((i & control_bit1) != 0 && (i & control_bit2) != 0 && (i & bit) == 0) {
+      psi.swap_amps(i, i | bit);
+    }
+  }
+}
+
+template <AmpLayout L>
+static void apply_perm_gate(AmpVector<L>& psi, const PermGate& g) {
+  switch (g.kind) {
+  case PermGate::Kind::X:
+    x_kernel(psi, g.qubit);
+    break;
+  case PermGate::Kind::CNOT:
+    cnot_kernel(psi, g.cntrl1, g.qubit);
+    break;
+  case PermGate::Kind::SWAP:
+    swap_kernel(psi, g.qubit, g.cntrl1);
+    break;
+  case PermGate::Kind::TOFFOLI:
+    toffoli_kernel(psi, g.cntrl1, g.cntrl2, g.qubit);
+    break;
+  }
+}
+
+// kernels for 1-qubit gates, controlled or not, generated per gate class and per target
+// below KERNEL_LOW_QUBITS. with the stride a constant the pair loop unrolls into straight
+// line code the compiler vectorizes with shuffles, where a runtime stride of 1 or 2 leaves
+// it a loop of a couple of iterations per block. higher targets share one generic kernel
+static constexpr size_t KERNEL_LOW_QUBITS = 4;
+
+// what a kernel can leave out of the 2x2 product: a diagonal gate never mixes a pair,
+// a phase gate leaves |0> alone too, so high targets only read the |1> half, and an
+// anti-diagonal one, x or y up to phases, only swaps it
+enum class GateClass { dense, diagonal, phase, pauli };
+
+static GateClass classify(Complex u00, Complex u01, Complex u10, Complex u11) {
+  if (u01 == Complex(0.0, 0.0) && u10 == Complex(0.0, 0.0))
+    return u00 == Complex(1.0, 0.0) ? GateClass::phase : GateClass::diagonal;
+  if (u00 == Complex(0.0, 0.0) && u11 == Complex(0.0, 0.0))
+    return GateClass::pauli;
+  return GateClass::dense;
+}
+
+struct GateMat {
+  double a_r, a_i, b_r, b_i, c_r, c_i, d_r, d_i;
+};
+
+template <GateClass G>
+static inline void mix_pair(double& pr, double& pi, double& qr, double& qi, const GateMat& m) {
+  double xr, xi, yr, yi;
+  if constexpr (G == GateClass::phase) {
+    yr = m.d_r * qr - m.d_i * qi;
+    yi = m.d_r * qi + m.d_i * qr;
+    qr = yr;
+    qi = yi;
+    return;
+  }
+  else if constexpr (G == GateClass::dense) {
+    xr = (m.a_r * pr - m.a_i * pi) + (m.b_r * qr - m.b_i * qi);
+    xi = (m.a_r * pi + m.a_i * pr) + (m.b_r * qi + m.b_i * qr);
+    yr = (m.c_r * pr - m.c_i * pi) + (m.d_r * qr - m.d_i * qi);
+    yi = (m.c_r * pi + m.c_i * pr) + (m.d_r * qi + m.d_i * qr);
+  }
+  else if constexpr (G == GateClass::diagonal) {
+    xr = m.a_r * pr - m.a_i * pi;
+    xi = m.a_r * pi + m.a_i * pr;
+    yr = m.d_r * qr - m.d_i * qi;
+    yi = m.d_r * qi + m.d_i * qr;
+  }
+  else {
+    xr = m.b_r * qr - m.b_i * qi;
+    xi = m.b_r * qi + m.b_i * qr;
+    yr = m.c_r * pr - m.c_i * pi;
+    yi = m.c_r * pi + m.c_i * pr;
+  }
+  pr = xr;
+  pi = xi;
+  qr = yr;
+  qi = yi;
+}
+
+template <size_t Q>
+static constexpr size_t pair_bit(size_t qubit) {
+  if constexpr (Q < KERNEL_LOW_QUBITS)
+    return size_t(1) << Q;
+  else
+    return size_t(1) << qubit;
+}
+
+// the pairs (i, i + bit) for i in runs [r, r + len) with r stepping by 2 * len from
+// first to last. len is bit itself unless a control below the target splits the runs
+template <AmpLayout L, GateClass G, size_t Q>
+static void sweep_pairs(AmpVector<L>& psi, size_t qubit, const GateMat& m, size_t first, size_t last, size_t len) {
+  const size_t bit = pair_bit<Q>(qubit);
+  if constexpr (L == AmpLayout::split) {
+    double* __restrict re = psi.re.data();
+    double* __restrict im = psi.im.data();
+    if (len == bit) {
+      for (size_t i0 = first; i0 < last; i0 += 2 * bit) {
+        for (size_t k = 0; k < bit; k++)
+          mix_pair<G>(re[i0 + k], im[i0 + k], re[i0 + k + bit], im[i0 + k + bit], m);
+      }
+      return;
+    }
+    for (size_t r = first; r < last; r += 2 * len) {
+      for (size_t i = r; i < r + len; i++)
+        mix_pair<G>(re[i], im[i], re[i + bit], im[i + bit], m);
+    }
+  }
+  else {
+    // parts of amplitude i at a[2 * i] and a[2 * i + 1], as std::complex guarantees
+    double* a = reinterpret_cast<double*>(psi.amps.data());
+    if (len == bit) {
+      for (size_t i0 = first; i0 < last; i0 += 2 * bit) {
+        for (size_t k = 0; k < bit; k++) {
+          const size_t i = 2 * (i0 + k), j = 2 * (i0 + k + bit);
+          mix_pair<G>(a[i], a[i + 1], a[j], a[j + 1], m);
+        }
+      }
+      return;
+    }
+    for (size_t r = first; r < last; r += 2 * len) {
+      for (size_t i = 2 * r; i < 2 * (r + len); i += 2)
+        mix_pair<G>(a[i], a[i + 1], a[i + 2 * bit], a[i + 2 * bit + 1], m);
+    }
+  }
+}
+
+// cntrl is a psi position, or UNCONTROLLED
+static constexpr size_t UNCONTROLLED = std::numeric_limits<size_t>::max();
+
+template <AmpLayout L, GateClass G, size_t Q>
+static void unitary_kernel(AmpVector<L>& psi, size_t qubit, size_t cntrl, const GateMat& m) {
+  const size_t n = psi.size(), bit = pair_bit<Q>(qubit);
+  if (cntrl == UNCONTROLLED) {
+    sweep_pairs<L, G, Q>(psi, qubit, m, 0, n, bit);
+    return;
+  }
+  const size_t control_bit = size_t(1) << cntrl;
+  if (control_bit > bit) {
+    // the upper half of every control block, itself whole pair blocks
+    for (size_t c0 = control_bit; c0 < n; c0 += 2 * control_bit)
+      sweep_pairs<L, G, Q>(psi, qubit, m, c0, c0 + control_bit, bit);
+    return;
+  }
+  for (size_t i0 = 0; i0 < n; i0 += 2 * bit)
+    sweep_pairs<L, G, Q>(psi, qubit, m, i0 + control_bit, i0 + bit, control_bit);
+}
+
+template <AmpLayout L>
+using UnitaryKernel = void (*)(AmpVector<L>&, size_t, size_t, const GateMat&);
+
+template <AmpLayout L, GateClass G, size_t... Q>
+static constexpr std::array<UnitaryKernel<L>, sizeof...(Q)> kernel_row(std::index_sequence<Q...>) {
+  return { &unitary_kernel<L, G, Q>... };
+}
+
+// indexed by GateClass, then by target with every target from KERNEL_LOW_QUBITS up in the last column
+template <AmpLayout L>
+static constexpr std::array<std::array<UnitaryKernel<L>, KERNEL_LOW_QUBITS + 1>, 4> unitary_kernels = {
+  kernel_row<L, GateClass::dense>(std::make_index_sequence<KERNEL_LOW_QUBITS + 1>()),
+  kernel_row<L, GateClass::diagonal>(std::make_index_sequence<KERNEL_LOW_QUBITS + 1>()),
+  kernel_row<L, GateClass::phase>(std::make_index_sequence<KERNEL_LOW_QUBITS + 1>()),
+  kernel_row<L, GateClass::pauli>(std::make_index_sequence<KERNEL_LOW_QUBITS + 1>()),
+};
+
+// u on psi position qubit, on the half where psi position cntrl is set unless UNCONTROLLED
+template <AmpLayout L>
+static void run_unitary(AmpVector<L>& psi, size_t qubit, size_t cntrl, Complex u00, Complex u01, Complex u10, Complex u11) {
+  const GateMat m{ u00.real(), u00.imag(), u01.real(), u01.imag(), u10.real(), u10.imag(), u11.real(), u11.imag() };
+  const GateClass g = classify(u00, u01, u10, u11);
+  unitary_kernels<L>[static_cast<size_t>(g)][std::min(qubit, KERNEL_LOW_QUBITS)](psi, qubit, cntrl, m);
+}
+
 void SampleResult::log_results() {
   std::println("0 measured {} times\n1 measured {} times", results[0], results[1]);
 }
 
-QuantumState::QuantumState(size_t num_qubits, size_t init_state) {
-  std::random_device rd;
-  rng = std::mt19937(rd());
-  uni = std::uniform_real_distribution(0.0, 1.0);
+template <AmpLayout L>
+BasicQuantumState<L>::BasicQuantumState(size_t num_qubits, size_t init_state)
+  : BasicQuantumState(num_qubits, init_state, Rng::from_entropy()) {}
+
+template <AmpLayout L>
+BasicQuantumState<L>::BasicQuantumState(size_t num_qubits, size_t init_state, Rng r) : rng(r) {
   init(num_qubits, init_state);
 }
 
-// sets state to |00...0>
-void QuantumState::init(size_t num_qubits, size_t init_state) {
+// sets state to |init_state>, no qubit is in psi yet
+template <AmpLayout L>
+void BasicQuantumState<L>::init(size_t num_qubits, size_t init_state) {
   n = num_qubits;
-  psi.assign(1ULL << n, Complex(0.0, 0.0));
-  psi[init_state] = Complex(1.0, 0.0);
+  width = 0;
+  psi.assign(1, Complex(1.0, 0.0));
+  pending_perm.clear();
+  marg.clear();
+  marg_hint = UNALLOCATED;
+  qubit_map.assign(n, UNALLOCATED);
+  basis_vals.resize(n);
+  for (size_t q = 0; q < n; q++)
+    basis_vals[q] = static_cast<uint8_t>((init_state >> q) & 1);
 }
 
-std::array<double, 2> QuantumState::measurement_probs(size_t qubit) const {
-  size_t bit = 1ULL << qubit;
-  std::array<double, 2> prob = { 0.0, 0.0 };
+template <AmpLayout L>
+void BasicQuantumState<L>::init_dense(size_t num_qubits) {
+  n = num_qubits;
+  width = n;
+  psi.resize(1ULL << n);
+  pending_perm.clear();
+  marg.clear();
+  marg_hint = UNALLOCATED;
+  qubit_map.resize(n);
+  for (size_t q = 0; q < n; q++)
+    qubit_map[q] = q;
+  basis_vals.assign(n, 0);
+}
 
+template <AmpLayout L>
+void BasicQuantumState<L>::init_layout(std::span<const size_t> map, std::span<const uint8_t> vals, size_t psi_width) {
+  n = map.size();
+  width = psi_width;
+  psi.resize(1ULL << width);
+  pending_perm.clear();
+  marg.clear();
+  marg_hint = UNALLOCATED;
+  qubit_map.assign(map.begin(), map.end());
+  basis_vals.assign(vals.begin(), vals.end());
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::reserve(size_t num_qubits) {
+  keep_capacity = true;
+  const size_t full = size_t(1) << num_qubits;
+  if (psi.capacity() >= full)
+    return;
+  // growing writes zeros over the new amplitudes, shrinking back keeps the buffer
+  const size_t size = psi.size();
+  psi.resize(full);
+  psi.resize(size);
+}
+
+// the new qubit becomes the top bit, so queued permutations of the lower bits still apply
+template <AmpLayout L>
+size_t BasicQuantumState<L>::alloc(size_t qubit) const {
+  if (qubit_map[qubit] != UNALLOCATED)
+    return qubit_map[qubit];
+
+  PROFILE_SCOPE("alloc", qubit, sweep_bytes(psi));
+  const size_t half = psi.size();
+  psi.resize(2 * half);
+  if (basis_vals[qubit]) {
+    for (size_t i = 0; i < half; i++)
+      psi.set(half + i, psi.get(i));
+    psi.fill(0, half, Complex(0.0, 0.0));
+  }
+  qubit_map[qubit] = width++;
+  return qubit_map[qubit];
+}
+
+// compacts the half of psi where the qubit's bit equals val into the front,
+// reading ahead of where it writes so it can run in place. the probabilities of
+// the bits left are summed per byte of the index as the amplitudes go by
+template <AmpLayout L>
+void BasicQuantumState<L>::project_out(size_t qubit, size_t val, double scl) {
+  const size_t pos = qubit_map[qubit];
+  const size_t low = (1ULL << pos) - 1;
+  const size_t half = psi.size() / 2;
+
+  // hist[b][v], the probability of byte b of the index being v. a chunk shares
+  // every byte but the lowest, so only that one is added per amplitude
+  std::vector<std::array<double, 256>> hist(std::max<size_t>(1, (width + 6) / 8));
+  for (auto& h : hist)
+    h.fill(0.0);
+  const size_t chunk = std::min<size_t>(half, 256);
+  for (size_t i0 = 0; i0 < half; i0 += chunk) {
+    double sum = 0.0;
+    for (size_t i = i0; i < i0 + chunk; i++) {
+      size_t src = ((i & ~low) << 1) | (val << pos) | (i & low);
+      Complex c = psi.get(src) * scl;
+      psi.set(i, c);
+      double p = std::norm(c);
+      hist[0][i & 255] += p;
+      sum += p;
+    }
+    for (size_t b = 1; b < hist.size(); b++)
+      hist[b][(i0 >> (8 * b)) & 255] += sum;
+  }
+  psi.resize(half);
+  trim();
+
+  for (auto& m : qubit_map) {
+    if (m != UNALLOCATED && m > pos)
+      m--;
+  }
+  qubit_map[qubit] = UNALLOCATED;
+  basis_vals[qubit] = static_cast<uint8_t>(val);
+  width--;
+
+  marg.assign(width, 0.0);
+  marg_total = 0.0;
+  for (size_t v = 0; v < 256; v++)
+    marg_total += hist[0][v];
+  for (size_t p = 0; p < width; p++) {
+    for (size_t v = 0; v < 256; v++) {
+      if ((v >> (p % 8)) & 1)
+        marg[p] += hist[p / 8][v];
+    }
+  }
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::trim() const {
+  if (keep_capacity)
+    return;
+  if (psi.capacity() >= 4 * psi.size()) {
+    PROFILE_SCOPE("trim", PROFILE_NO_QUBIT, sweep_bytes(psi));
+    psi.shrink_to_fit();
+  }
+  if (scratch.capacity() >= 4 * psi.size()) {
+    scratch.resize(0);
+    scratch.shrink_to_fit();
+  }
+}
+
+template <AmpLayout L>
+bool BasicQuantumState<L>::apply_diagonal_outside(size_t qubit, Complex d0, Complex d1) {
+  if (qubit_map[qubit] != UNALLOCATED)
+    return false;
+  Complex d = basis_vals[qubit] ? d1 : d0;
+  if (d != Complex(1.0, 0.0))
+    scale_all(d);
+  return true;
+}
+
+// a global factor, so it commutes with queued permutations and leaves marg as it is
+template <AmpLayout L>
+void BasicQuantumState<L>::scale_all(Complex c) {
+  PROFILE_SCOPE("scale_all", PROFILE_NO_QUBIT, sweep_bytes(psi));
+  const double cr = c.real(), ci = c.imag();
   for (size_t i = 0; i < psi.size(); i++) {
-    prob[((i & bit) != 0)] += std::norm(psi[i]);
+    Complex a = psi.get(i);
+    psi.set(i, Complex(a.real() * cr - a.imag() * ci, a.real() * ci + a.imag() * cr));
   }
+}
 
-  if (prob[0] < EPS && prob[1] < EPS) {
-    throw std::runtime_error("At least one probability must be non-zero");
+template <AmpLayout L>
+void BasicQuantumState<L>::set_marg(size_t pos, double p0, double p1) const {
+  marg.assign(width, std::numeric_limits<double>::quiet_NaN());
+  marg[pos] = p1;
+  marg_total = p0 + p1;
+}
+
+template <AmpLayout L>
+size_t BasicQuantumState<L>::to_logical(size_t idx) const {
+  size_t res = 0;
+  for (size_t q = 0; q < n; q++) {
+    size_t bit = (qubit_map[q] == UNALLOCATED) ? basis_vals[q] : ((idx >> qubit_map[q]) & 1);
+    res |= bit << q;
+  }
+  return res;
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::normalize() const {
+  for (size_t q = 0; q < n; q++)
+    alloc(q);
+  for (size_t q = 0; q < n; q++) {
+    size_t pos = qubit_map[q];
+    if (pos == q)
+      continue;
+    // move q home, whichever qubit currently sits there takes its old bit
+    size_t other = std::find(qubit_map.begin(), qubit_map.end(), q) - qubit_map.begin();
+    queue_perm({PermGate::Kind::SWAP, static_cast<uint32_t>(pos), static_cast<uint32_t>(q)});
+    qubit_map[other] = pos;
+    qubit_map[q] = q;
+  }
+  flush();
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::queue_perm(PermGate g) const {
+  marg.clear();
+  if (width > PERM_MAX_LAZY_QUBITS) {
+    apply_perm_gate(psi, g);
+    return;
+  }
+  pending_perm.push_back(g);
+  if (pending_perm.size() >= PERM_MAX_PENDING)
+    apply_pending_perm();
+}
+
+// one gather pass through the scratch buffer, or swaps in place when the gates
+// only add up to flipping a fixed set of bits
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_pending_perm() const {
+  if (pending_perm.size() < PERM_MIN_GATHER) {
+    for (const auto& g : pending_perm)
+      apply_perm_gate(psi, g);
+    pending_perm.clear();
+    return;
   }
-  else if (prob[0] < EPS) {
-    prob[0] = 0.0;
-    prob[1] = 1.0;
+
+  PROFILE_SCOPE("permute", PROFILE_NO_QUBIT, sweep_bytes(psi));
+  IndexMap map(width, pending_perm);
+  pending_perm.clear();
+  if (map.stages.empty())
+    return;
+
+  if (map.is_xor()) {
+    const uint64_t mask = map.stages[0].mask;
+    for (size_t i = 0; i < psi.size(); i++) {
+      size_t j = i ^ mask;
+      if (i < j)
+        psi.swap_amps(i, j);
+    }
+    return;
   }
-  else if (prob[1] < EPS) {
-    prob[0] = 1.0;
-    prob[1] = 0.0;
+
+  scratch.resize(psi.size());
+  for (size_t i = 0; i < psi.size(); i++)
+    scratch.set(i, psi.get(map.source(i)));
+  psi.swap(scratch);
+}
+
+// normalized probabilities of |0> and |1> from their weights. one below EPS is
+// taken as exactly 0, so rounding never picks an outcome that isn't there
+static std::array<double, 2> clamp_probs(double p0, double p1) {
+  if (p0 < EPS && p1 < EPS)
+    throw std::runtime_error("At least one probability must be non-zero");
+  if (p0 < EPS)
+    return { 0.0, 1.0 };
+  if (p1 < EPS)
+    return { 1.0, 0.0 };
+  const double norm = 1 / (p0 + p1);
+  return { p0 * norm, p1 * norm };
+}
+
+template <AmpLayout L>
+std::array<double, 2> BasicQuantumState<L>::measurement_probs(size_t qubit) const {
+  if (qubit_map[qubit] == UNALLOCATED)
+    return basis_vals[qubit] ? std::array<double, 2>{ 0.0, 1.0 } : std::array<double, 2>{ 1.0, 0.0 };
+  const size_t pos = qubit_map[qubit];
+  if (pending_perm.empty() && pos < marg.size() && !std::isnan(marg[pos]))
+    return clamp_probs(marg_total - marg[pos], marg[pos]);
+  flush();
+  qubit = qubit_map[qubit];
+  PROFILE_SCOPE("measurement_probs", qubit, psi.size() * sizeof(Complex));
+  size_t bit = 1ULL << qubit;
+  std::array<double, 2> prob = { 0.0, 0.0 };
+
+  if constexpr (L == AmpLayout::split) {
+    // block by block so each half is summed in index order, as in the interleaved loop
+    const double* re = psi.re.data();
+    const double* im = psi.im.data();
+    for (size_t i0 = 0; i0 < psi.size(); i0 += 2 * bit) {
+      for (size_t i = i0; i < i0 + bit; i++)
+        prob[0] += re[i] * re[i] + im[i] * im[i];
+      for (size_t i = i0 + bit; i < i0 + 2 * bit; i++)
+        prob[1] += re[i] * re[i] + im[i] * im[i];
+    }
   }
   else {
-    const double norm = 1 / (prob[0] + prob[1]);
-    prob[0] *= norm;
-    prob[1] *= norm;
+    for (size_t i = 0; i < psi.size(); i++) {
+      prob[((i & bit) != 0)] += std::norm(psi.amps[i]);
+    }
   }
 
-  return prob;
+  return clamp_probs(prob[0], prob[1]);
 }
 
-inline size_t QuantumState::sample_measurement_once(double p1) {
-  double u = uni(rng);
+template <AmpLayout L>
+inline size_t BasicQuantumState<L>::sample_measurement_once(double p1) {
+  double u = rng.uniform();
   return (u < p1) ? 1 : 0;
 }
 
-SampleResult QuantumState::sample_measurement(size_t qubit, size_t num_samples) {
+template <AmpLayout L>
+SampleResult BasicQuantumState<L>::sample_measurement(size_t qubit, size_t num_samples) {
+  PROFILE_SCOPE("sample_measurement", qubit, 0);
   auto prob = measurement_probs(qubit);
   SampleResult res;
 
-  for (size_t i = 0; i < num_samples; i++) {
-    res.results[sample_measurement_once(prob[1])]++;
+  // draw uniforms in bulk rather than one generator call per sample
+  double u[512];
+  for (size_t done = 0; done < num_samples; ) {
+    size_t count = std::min(std::size(u), num_samples - done);
+    rng.fill_uniform(std::span(u, count));
+    size_t ones = 0;
+    for (size_t i = 0; i < count; i++) {
+      ones += (u[i] < prob[1]);
+    }
+    res.results[1] += ones;
+    res.results[0] += count - ones;
+    done += count;
   }
 
   return res;
 }
 
-size_t QuantumState::measure(size_t qubit) {
+template <AmpLayout L>
+size_t BasicQuantumState<L>::measure(size_t qubit) {
+  PROFILE_SCOPE("measure", qubit, sweep_bytes(psi) / 2);
+  marg_hint = UNALLOCATED;
+  // flushes unless the probabilities were already summed
   auto prob = measurement_probs(qubit);
   size_t res = sample_measurement_once(prob[1]);
 
-  size_t bit = 1ULL << qubit;
-  double scl = 1.0 / std::sqrt(prob[res]);
-
-  for (size_t i = 0; i < psi.size(); i++) {
-    if (((i & bit) != 0) == res) {
-      psi[i] *= scl;
-    }
-    else {
-      psi[i] = Complex(0.0, 0.0);
-    }
-  }
+  // the collapsed qubit leaves psi, halving the work for every later gate
+  if (qubit_map[qubit] != UNALLOCATED)
+    project_out(qubit, res, 1.0 / std::sqrt(prob[res]));
 
   return res;
 }
 
-size_t QuantumState::measure_all() {
-  std::vector<size_t> outcomes;
-  std::vector<double> weights;
-  outcomes.reserve(psi.size());
-  weights.reserve(psi.size());
+template <AmpLayout L>
+size_t BasicQuantumState<L>::measure_all() {
+  // the total is known without a pass if a collapse just summed it
+  const bool known = pending_perm.empty() && !marg.empty();
+  flush();
+  PROFILE_SCOPE("measure_all", PROFILE_NO_QUBIT, sweep_bytes(psi));
 
-  double total = 0.0;
-  for (size_t i = 0; i < psi.size(); i++) {
-    double p = std::norm(psi[i]);
-    if (p > EPS) {
-      outcomes.push_back(i);
-      weights.push_back(p);
-      total += p;
+  // amplitudes at or below EPS are never picked
+  double total = known ? marg_total : 0.0;
+  if (!known) {
+    for (size_t i = 0; i < psi.size(); i++) {
+      double p = psi.norm(i);
+      if (p > EPS)
+        total += p;
     }
   }
-
-  if (outcomes.empty() || total < EPS) {
+  if (total < EPS) {
     // TODO: something went wrong
     return 0;
   }
 
-  std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
-  size_t res = outcomes[dist(rng)];
+  // walks the cumulative distribution to a uniform point in it. rounding can leave
+  // the point past the end, which takes the last outcome
+  const double u = rng.uniform() * total;
+  double cum = 0.0;
+  size_t res = SIZE_MAX;
+  for (size_t i = 0; i < psi.size(); i++) {
+    double p = psi.norm(i);
+    if (p <= EPS)
+      continue;
+    res = i;
+    cum += p;
+    if (u < cum)
+      break;
+  }
+  if (res == SIZE_MAX)
+    return 0;
 
-  std::fill(psi.begin(), psi.end(), Complex(0.0, 0.0));
-  psi[res] = Complex(1.0, 0.0);
-  return res;
+  // every qubit is now a basis state, so none need to stay in psi
+  size_t logical = to_logical(res);
+  for (size_t q = 0; q < n; q++) {
+    basis_vals[q] = static_cast<uint8_t>((logical >> q) & 1);
+    qubit_map[q] = UNALLOCATED;
+  }
+  width = 0;
+  psi.assign(1, Complex(1.0, 0.0));
+  return logical;
 }
 
-void QuantumState::apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11) {
-  size_t bit = 1ULL << qubit;
+template <AmpLayout L>
+void BasicQuantumState<L>::reset(size_t qubit) {
+  PROFILE_SCOPE("reset", qubit, 0);
+  if (measure(qubit) == 1) {
+    apply_x(qubit);
+  }
+}
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) == 0) {
-      size_t j = i | bit;
-      Complex a = psi[i];
-      Complex b = psi[j];
-      psi[i] = (u00 * a) + (u01 * b);
-      psi[j] = (u10 * a) + (u11 * b);
+template <AmpLayout L>
+void BasicQuantumState<L>::reset_register(std::span<const size_t> qubits) {
+  PROFILE_SCOPE("reset_register", PROFILE_NO_QUBIT, 2 * sweep_bytes(psi));
+  collapse_register(qubits, {}, true);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::measure_register(std::span<const size_t> qubits, std::span<uint8_t> outcomes) {
+  PROFILE_SCOPE("measure_register", PROFILE_NO_QUBIT, 2 * sweep_bytes(psi));
+  collapse_register(qubits, outcomes, false);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::collapse_register(std::span<const size_t> qubits, std::span<uint8_t> outcomes, bool reset) {
+  flush();
+  marg_hint = UNALLOCATED;
+  for (size_t first = 0; first < qubits.size();) {
+    // the next run of qubits with at most RESET_MAX_QUBITS of them in psi. positions
+    // are read after the previous run has left psi
+    std::array<size_t, RESET_MAX_QUBITS> pos;
+    size_t k = 0, last = first;
+    for (; last < qubits.size(); last++) {
+      size_t p = qubit_map[qubits[last]];
+      if (p == UNALLOCATED)
+        continue;
+      if (k == RESET_MAX_QUBITS)
+        break;
+      pos[k++] = p;
     }
+    collapse_run(qubits.subspan(first, last - first), std::span(pos.data(), k),
+                 outcomes.empty() ? outcomes : outcomes.subspan(first, last - first), reset);
+    first = last;
   }
 }
 
-void QuantumState::apply_hadamard(size_t qubit) {
-  size_t bit = 1ULL << qubit;
-  const double scl = 1.0 / std::sqrt(2);
+template <AmpLayout L>
+void BasicQuantumState<L>::collapse_run(std::span<const size_t> run, std::span<const size_t> pos, std::span<uint8_t> outcomes,
+                                        bool reset) {
+  const size_t k = pos.size();
+  const size_t size = 1ULL << k;
+  std::vector<double> joint(size, 0.0);
+  if (k > 0)
+    sum_joint(psi, joint_lut(pos, width), joint, 0, psi.size());
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) == 0) {
-      size_t j = i | bit;
-      Complex a = psi[i];
-      Complex b = psi[j];
-      psi[i] = (a + b) * scl;
-      psi[j] = (a - b) * scl;
+  // each qubit in psi is sampled from its probabilities given the outcomes before it
+  size_t pattern = 0, j = 0;
+  for (size_t r = 0; r < run.size(); r++) {
+    const size_t q = run[r];
+    size_t res;
+    if (qubit_map[q] == UNALLOCATED) {
+      res = sample_measurement_once(basis_vals[q]);
+      if (reset)
+        basis_vals[q] = 0;
+    }
+    else {
+      const size_t mask = (1ULL << j) - 1;
+      double p[2] = { 0.0, 0.0 };
+      for (size_t t = 0; t < size; t++) {
+        if ((t & mask) == pattern)
+          p[(t >> j) & 1] += joint[t];
+      }
+      res = sample_measurement_once(clamp_probs(p[0], p[1])[1]);
+      pattern |= res << j;
+      j++;
     }
+    if (!outcomes.empty())
+      outcomes[r] = static_cast<uint8_t>(res);
   }
+  if (k == 0)
+    return;
+
+  // keeps the norm psi had, as collapsing the qubits one at a time does
+  double total = 0.0;
+  for (double m : joint)
+    total += m;
+  const double scl = std::sqrt(total / joint[pattern]);
+  size_t mask = 0, val = 0;
+  for (size_t b = 0; b < k; b++) {
+    mask |= 1ULL << pos[b];
+    val |= ((pattern >> b) & 1) << pos[b];
+  }
+  // every source index is at or after the one written, so this runs in place
+  size_t src = 0;
+  const size_t kept = psi.size() >> k;
+  for (size_t i = 0; i < kept; i++) {
+    psi.set(i, psi.get(src | val) * scl);
+    src = ((src | mask) + 1) & ~mask;
+  }
+  psi.resize(kept);
+  trim();
+
+  for (size_t q : run) {
+    if (qubit_map[q] == UNALLOCATED)
+      continue;
+    basis_vals[q] = reset ? 0 : static_cast<uint8_t>((val >> qubit_map[q]) & 1);
+    qubit_map[q] = UNALLOCATED;
+  }
+  for (auto& m : qubit_map) {
+    if (m != UNALLOCATED)
+      m -= std::popcount(mask & ((1ULL << m) - 1));
+  }
+  width -= k;
 }
 
-void QuantumState::apply_s(size_t qubit) {
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11) {
+  if (u01 == Complex(0.0, 0.0) && u10 == Complex(0.0, 0.0) && apply_diagonal_outside(qubit, u00, u11))
+    return;
+  flush();
+  const bool track = marg_hint == qubit;
+  marg_hint = UNALLOCATED;
+  qubit = alloc(qubit);
+  PROFILE_SCOPE("apply_unitary_1q", qubit, sweep_bytes(psi));
   size_t bit = 1ULL << qubit;
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) != 0) {
-      psi[i] *= Complex(0.0, 1.0);
+  if (track) {
+    // the same sweep, summing the new probabilities for the measurement after it
+    const double a_r = u00.real(), a_i = u00.imag(), b_r = u01.real(), b_i = u01.imag();
+    const double c_r = u10.real(), c_i = u10.imag(), d_r = u11.real(), d_i = u11.imag();
+    double p0 = 0.0, p1 = 0.0;
+    for (size_t i0 = 0; i0 < psi.size(); i0 += 2 * bit) {
+      for (size_t i = i0; i < i0 + bit; i++) {
+        const size_t j = i + bit;
+        const Complex p = psi.get(i), q = psi.get(j);
+        const double pr = p.real(), pi = p.imag(), qr = q.real(), qi = q.imag();
+        const double xr = (a_r * pr - a_i * pi) + (b_r * qr - b_i * qi);
+        const double xi = (a_r * pi + a_i * pr) + (b_r * qi + b_i * qr);
+        const double yr = (c_r * pr - c_i * pi) + (d_r * qr - d_i * qi);
+        const double yi = (c_r * pi + c_i * pr) + (d_r * qi + d_i * qr);
+        psi.set(i, Complex(xr, xi));
+        psi.set(j, Complex(yr, yi));
+        p0 += xr * xr + xi * xi;
+        p1 += yr * yr + yi * yi;
+      }
     }
+    set_marg(qubit, p0, p1);
+    return;
   }
+
+  run_unitary(psi, qubit, UNCONTROLLED, u00, u01, u10, u11);
 }
 
-void QuantumState::apply_cnot(size_t cntrl, size_t qubit) {
-  size_t bit = 1ULL << qubit;
-  size_t control_bit = 1ULL << cntrl;
+// gathers the 1 << k amplitudes spanned by the layer's qubits into a local block,
+// applies every gate to it there and writes it back
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_unitary_layer(std::span<const size_t> qubits, std::span<const std::array<Complex, 4>> u) {
+  flush();
+  std::array<size_t, LAYER_MAX_QUBITS> pos;
+  for (size_t j = 0; j < qubits.size(); j++)
+    pos[j] = alloc(qubits[j]);
+  PROFILE_SCOPE("apply_unitary_layer", PROFILE_NO_QUBIT, sweep_bytes(psi));
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & control_bit) != 0 && (i & bit) == 0) {
-      Complex tmp = psi[i];
-      psi[i] = psi[i | bit];
-      psi[i | bit] = tmp;
+  // the arithmetic is written out on doubles, std::complex multiplies go through
+  // a library call checking for infinities
+  std::array<std::array<double, 8>, LAYER_MAX_QUBITS> mat;
+  for (size_t j = 0; j < qubits.size(); j++) {
+    for (size_t e = 0; e < 4; e++) {
+      mat[j][2 * e] = u[j][e].real();
+      mat[j][2 * e + 1] = u[j][e].imag();
     }
   }
+  layer_pass(std::span(pos.data(), qubits.size()), std::span(mat.data(), qubits.size()));
 }
 
-void QuantumState::apply_x(size_t qubit) {
-  size_t bit = 1ULL << qubit;
+template <AmpLayout L>
+void BasicQuantumState<L>::layer_pass(std::span<const size_t> pos, std::span<const std::array<double, 8>> mat) {
+  const size_t k = pos.size();
+  std::array<size_t, LAYER_MAX_QUBITS> bits;
+  size_t mask = 0;
+  for (size_t j = 0; j < k; j++) {
+    bits[j] = 1ULL << pos[j];
+    mask |= bits[j];
+  }
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) == 0) {
-      Complex tmp = psi[i];
-      psi[i] = psi[i | bit];
-      psi[i | bit] = tmp;
+  // offset of each block entry from the block's base index
+  const size_t block = 1ULL << k;
+  std::array<size_t, 1ULL << LAYER_MAX_QUBITS> off;
+  off[0] = 0;
+  for (size_t s = 1; s < block; s++)
+    off[s] = off[s & (s - 1)] | bits[std::countr_zero(s)];
+
+  std::array<double, 1ULL << LAYER_MAX_QUBITS> re, im;
+  // base steps through every index with the mask bits clear
+  for (size_t base = 0; base < psi.size(); base = ((base | mask) + 1) & ~mask) {
+    for (size_t s = 0; s < block; s++) {
+      Complex c = psi.get(base | off[s]);
+      re[s] = c.real();
+      im[s] = c.imag();
     }
+    for (size_t j = 0; j < k; j++) {
+      const size_t stride = 1ULL << j;
+      const auto& m = mat[j];
+      for (size_t s0 = 0; s0 < block; s0 += 2 * stride) {
+        for (size_t s = s0; s < s0 + stride; s++) {
+          const size_t t = s + stride;
+          double pr = re[s], pi = im[s], qr = re[t], qi = im[t];
+          re[s] = (m[0] * pr - m[1] * pi) + (m[2] * qr - m[3] * qi);
+          im[s] = (m[0] * pi + m[1] * pr) + (m[2] * qi + m[3] * qr);
+          re[t] = (m[4] * pr - m[5] * pi) + (m[6] * qr - m[7] * qi);
+          im[t] = (m[4] * pi + m[5] * pr) + (m[6] * qi + m[7] * qr);
+        }
+      }
+    }
+    for (size_t s = 0; s < block; s++)
+      psi.set(base | off[s], Complex(re[s], im[s]));
   }
 }
 
-void QuantumState::apply_y(size_t qubit) {
-  size_t bit = 1ULL << qubit;
-  const Complex I(0.0, 1.0);
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_unitary_register(std::span<const size_t> qubits, Complex u00, Complex u01, Complex u10, Complex u11) {
+  PROFILE_SCOPE("apply_unitary_register", PROFILE_NO_QUBIT, sweep_bytes(psi));
+  const std::array<double, 8> mat = { u00.real(), u00.imag(), u01.real(), u01.imag(),
+                                      u10.real(), u10.imag(), u11.real(), u11.imag() };
+  register_pass(qubits, &mat);
+}
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) == 0) {
-      Complex tmp = psi[i];
-      psi[i] = -I * psi[i | bit];
-      psi[i | bit] = I * tmp;
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_hadamard_register(std::span<const size_t> qubits) {
+  PROFILE_SCOPE("apply_hadamard_register", PROFILE_NO_QUBIT, sweep_bytes(psi));
+  register_pass(qubits, nullptr);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::register_pass(std::span<const size_t> qubits, const std::array<double, 8>* mat) {
+  flush();
+  std::vector<size_t> low, high;
+  for (size_t q : qubits)
+    alloc(q);
+  // after every alloc, so block covers the final width
+  const size_t block = std::min<size_t>(psi.size(), 1ULL << REGISTER_BLOCK_BITS);
+  for (size_t q : qubits)
+    (1ULL << qubit_map[q] < block ? low : high).push_back(qubit_map[q]);
+
+  const double scl = 1.0 / std::sqrt(2);
+  if (!low.empty()) {
+    // the hadamards are left unscaled until the block is written back
+    const double low_scl = mat ? 1.0 : std::pow(scl, static_cast<double>(low.size()));
+
+    std::vector<Complex> buf(block);
+    std::vector<double> re(block), im(block);
+    for (size_t first = 0; first < psi.size(); first += block) {
+      psi.read(first, buf);
+      for (size_t s = 0; s < block; s++) {
+        re[s] = buf[s].real();
+        im[s] = buf[s].imag();
+      }
+      for (size_t p : low) {
+        const size_t stride = 1ULL << p;
+        for (size_t s0 = 0; s0 < block; s0 += 2 * stride) {
+          if (mat) {
+            const auto& m = *mat;
+            for (size_t s = s0; s < s0 + stride; s++) {
+              const size_t t = s + stride;
+              double pr = re[s], pi = im[s], qr = re[t], qi = im[t];
+              re[s] = (m[0] * pr - m[1] * pi) + (m[2] * qr - m[3] * qi);
+              im[s] = (m[0] * pi + m[1] * pr) + (m[2] * qi + m[3] * qr);
+              re[t] = (m[4] * pr - m[5] * pi) + (m[6] * qr - m[7] * qi);
+              im[t] = (m[4] * pi + m[5] * pr) + (m[6] * qi + m[7] * qr);
+            }
+          }
+          else {
+            for (size_t s = s0; s < s0 + stride; s++) {
+              const size_t t = s + stride;
+              double pr = re[s], pi = im[s], qr = re[t], qi = im[t];
+              re[s] = pr + qr;
+              im[s] = pi + qi;
+              re[t] = pr - qr;
+              im[t] = pi - qi;
+            }
+          }
+        }
+      }
+      for (size_t s = 0; s < block; s++)
+        buf[s] = Complex(re[s] * low_scl, im[s] * low_scl);
+      psi.write(first, buf);
     }
   }
+
+  const std::array<double, 8> h = { scl, 0.0, scl, 0.0, scl, 0.0, -scl, 0.0 };
+  std::array<std::array<double, 8>, LAYER_MAX_QUBITS> mats;
+  mats.fill(mat ? *mat : h);
+  for (size_t first = 0; first < high.size(); first += LAYER_MAX_QUBITS) {
+    const size_t k = std::min(LAYER_MAX_QUBITS, high.size() - first);
+    layer_pass(std::span(high).subspan(first, k), std::span(mats.data(), k));
+  }
 }
 
-void QuantumState::apply_z(size_t qubit) {
-  size_t bit = 1ULL << qubit;
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_qft(std::span<const size_t> qubits, bool inverse) {
+  flush();
+  const size_t nq = qubits.size();
+  std::vector<size_t> pos(nq);
+  for (size_t j = 0; j < nq; j++)
+    pos[j] = alloc(qubits[j]);
+  PROFILE_SCOPE("apply_qft", PROFILE_NO_QUBIT, nq * sweep_bytes(psi));
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & bit) != 0) {
-      psi[i] *= -1;
+  // the register's value in a psi index, qubits[0] as its top bit, put together a byte at a time
+  std::vector<std::array<size_t, 256>> lut((width + 7) / 8);
+  for (auto& t : lut)
+    t.fill(0);
+  for (size_t j = 0; j < nq; j++) {
+    for (size_t v = 0; v < 256; v++)
+      lut[pos[j] / 8][v] |= ((v >> (pos[j] % 8)) & 1) << (nq - 1 - j);
+  }
+
+  // twiddle factors e^(2 pi i m / 2^nq), m < 2^(nq - 1), as coarse[m >> fine_bits] * fine[m & fine_mask].
+  // two tables of about 2^(nq / 2) entries rather than one of 2^(nq - 1)
+  const size_t m_bits = nq - 1, fine_bits = m_bits / 2;
+  const size_t fine_mask = (1ULL << fine_bits) - 1;
+  const double unit = (inverse ? -2.0 : 2.0) * std::numbers::pi / std::ldexp(1.0, static_cast<int>(nq));
+  std::vector<double> fine_re(1ULL << fine_bits), fine_im(1ULL << fine_bits);
+  std::vector<double> coarse_re(1ULL << (m_bits - fine_bits)), coarse_im(1ULL << (m_bits - fine_bits));
+  for (size_t m = 0; m < fine_re.size(); m++) {
+    fine_re[m] = std::cos(unit * static_cast<double>(m));
+    fine_im[m] = std::sin(unit * static_cast<double>(m));
+  }
+  for (size_t m = 0; m < coarse_re.size(); m++) {
+    coarse_re[m] = std::cos(unit * static_cast<double>(m << fine_bits));
+    coarse_im[m] = std::sin(unit * static_cast<double>(m << fine_bits));
+  }
+
+  // the butterflies of qubit j on psi indices [first, first + len). the qubits after j
+  // set the twiddle, the phases their controlled gates put on j's |1> half
+  const double scl = 1.0 / std::sqrt(2);
+  auto stage = [&](size_t j, size_t first, size_t len) {
+    const size_t bit = 1ULL << pos[j];
+    const size_t after = (1ULL << (nq - 1 - j)) - 1;
+    const size_t chunk = std::min<size_t>(len, 256);
+    for (size_t i0 = first; i0 < first + len; i0 += chunk) {
+      if (i0 & bit)
+        continue;
+      size_t hi = 0;
+      for (size_t b = 1; b < lut.size(); b++)
+        hi |= lut[b][(i0 >> (8 * b)) & 255];
+      for (size_t i = i0; i < i0 + chunk; i++) {
+        if (i & bit)
+          continue;
+        const size_t m = ((hi | lut[0][i & 255]) & after) << j;
+        const double cr = coarse_re[m >> fine_bits], ci = coarse_im[m >> fine_bits];
+        const double fr = fine_re[m & fine_mask], fi = fine_im[m & fine_mask];
+        const double wr = cr * fr - ci * fi, wi = cr * fi + ci * fr;
+        const Complex a = psi.get(i), b = psi.get(i | bit);
+        const double ar = a.real(), ai = a.imag(), br = b.real(), bi = b.imag();
+        if (!inverse) {
+          // hadamard, then the phase
+          const double dr = (ar - br) * scl, di = (ai - bi) * scl;
+          psi.set(i, Complex((ar + br) * scl, (ai + bi) * scl));
+          psi.set(i | bit, Complex(wr * dr - wi * di, wr * di + wi * dr));
+        }
+        else {
+          // the phase, then hadamard
+          const double tr = wr * br - wi * bi, ti = wr * bi + wi * br;
+          psi.set(i, Complex((ar + tr) * scl, (ai + ti) * scl));
+          psi.set(i | bit, Complex((ar - tr) * scl, (ai - ti) * scl));
+        }
+      }
+    }
+  };
+
+  // consecutive stages on qubits in the low bits all run on one cache sized block
+  // before moving to the next, the rest are a pass over psi each
+  std::vector<size_t> order(nq);
+  for (size_t j = 0; j < nq; j++)
+    order[j] = inverse ? nq - 1 - j : j;
+  const size_t block = std::min<size_t>(psi.size(), 1ULL << REGISTER_BLOCK_BITS);
+  for (size_t s = 0; s < nq;) {
+    size_t e = s;
+    while (e < nq && (1ULL << pos[order[e]]) < block)
+      e++;
+    if (e == s) {
+      stage(order[s++], 0, psi.size());
+      continue;
+    }
+    for (size_t first = 0; first < psi.size(); first += block) {
+      for (size_t t = s; t < e; t++)
+        stage(order[t], first, block);
     }
+    s = e;
   }
 }
 
-void QuantumState::apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit) {
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_hadamard(size_t qubit) {
+  flush();
+  const bool track = marg_hint == qubit;
+  marg_hint = UNALLOCATED;
+  qubit = alloc(qubit);
+  PROFILE_SCOPE("apply_hadamard", qubit, sweep_bytes(psi));
   size_t bit = 1ULL << qubit;
-  size_t control_bit1 = 1ULL << cntrl1;
-  size_t control_bit2 = 1ULL << cntrl2;
+  const double scl = 1.0 / std::sqrt(2);
 
-  for (size_t i = 0; i < psi.size(); i++) {
-    if ((i & control_bit1) != 0 && (i & control_bit2) != 0 && (i & bit) == 0) {
-      Complex tmp = psi[i];
-      psi[i] = psi[i | bit];
-      psi[i | bit] = tmp;
+  if (track) {
+    // as in apply_unitary_1q
+    double p0 = 0.0, p1 = 0.0;
+    for (size_t i0 = 0; i0 < psi.size(); i0 += 2 * bit) {
+      for (size_t i = i0; i < i0 + bit; i++) {
+        const size_t j = i + bit;
+        const Complex p = psi.get(i), q = psi.get(j);
+        const double xr = (p.real() + q.real()) * scl, xi = (p.imag() + q.imag()) * scl;
+        const double yr = (p.real() - q.real()) * scl, yi = (p.imag() - q.imag()) * scl;
+        psi.set(i, Complex(xr, xi));
+        psi.set(j, Complex(yr, yi));
+        p0 += xr * xr + xi * xi;
+        p1 += yr * yr + yi * yi;
+      }
     }
+    set_marg(qubit, p0, p1);
+    return;
+  }
+
+  if constexpr (L == AmpLayout::split) {
+    double* __restrict re = psi.re.data();
+    double* __restrict im = psi.im.data();
+    for (size_t i0 = 0; i0 < psi.size(); i0 += 2 * bit) {
+      for (size_t i = i0; i < i0 + bit; i++) {
+        size_t j = i + bit;
+        double pr = re[i], pi = im[i], qr = re[j], qi = im[j];
+        re[i] = (pr + qr) * scl;
+        im[i] = (pi + qi) * scl;
+        re[j] = (pr - qr) * scl;
+        im[j] = (pi - qi) * scl;
+      }
+    }
+  }
+  else {
+    for (size_t i = 0; i < psi.size(); i++) {
+      if ((i & bit) == 0) {
+        size_t j = i | bit;
+        Complex a = psi.amps[i];
+        Complex b = psi.amps[j];
+        psi.amps[i] = (a + b) * scl;
+        psi.amps[j] = (a - b) * scl;
+      }
+    }
+  }
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_s(size_t qubit) {
+  if (apply_diagonal_outside(qubit, 1.0, Complex(0.0, 1.0)))
+    return;
+  flush();
+  qubit = alloc(qubit);
+  PROFILE_SCOPE("apply_s", qubit, sweep_bytes(psi) / 2);
+  run_unitary(psi, qubit, UNCONTROLLED, 1.0, 0.0, 0.0, Complex(0.0, 1.0));
+}
+
+// a control outside psi is a known classical bit, so the gate either drops out or loses that control
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_cnot(size_t cntrl, size_t qubit) {
+  if (qubit_map[cntrl] == UNALLOCATED) {
+    if (basis_vals[cntrl])
+      apply_x(qubit);
+    return;
+  }
+  queue_perm({PermGate::Kind::CNOT, static_cast<uint32_t>(alloc(qubit)), static_cast<uint32_t>(qubit_map[cntrl])});
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_x(size_t qubit) {
+  if (qubit_map[qubit] == UNALLOCATED) {
+    basis_vals[qubit] ^= 1;
+    return;
+  }
+  queue_perm({PermGate::Kind::X, static_cast<uint32_t>(qubit_map[qubit])});
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_swap(size_t qubit1, size_t qubit2) {
+  std::swap(qubit_map[qubit1], qubit_map[qubit2]);
+  std::swap(basis_vals[qubit1], basis_vals[qubit2]);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_y(size_t qubit) {
+  // y|0> = i|1> and y|1> = -i|0>, a flip and a global phase
+  if (qubit_map[qubit] == UNALLOCATED) {
+    scale_all(basis_vals[qubit] ? Complex(0.0, -1.0) : Complex(0.0, 1.0));
+    basis_vals[qubit] ^= 1;
+    return;
+  }
+  flush();
+  qubit = alloc(qubit);
+  PROFILE_SCOPE("apply_y", qubit, sweep_bytes(psi));
+  run_unitary(psi, qubit, UNCONTROLLED, 0.0, Complex(0.0, -1.0), Complex(0.0, 1.0), 0.0);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_z(size_t qubit) {
+  if (apply_diagonal_outside(qubit, 1.0, -1.0))
+    return;
+  flush();
+  qubit = alloc(qubit);
+  PROFILE_SCOPE("apply_z", qubit, sweep_bytes(psi) / 2);
+  run_unitary(psi, qubit, UNCONTROLLED, 1.0, 0.0, 0.0, -1.0);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit) {
+  if (qubit_map[cntrl1] == UNALLOCATED) {
+    if (basis_vals[cntrl1])
+      apply_cnot(cntrl2, qubit);
+    return;
+  }
+  if (qubit_map[cntrl2] == UNALLOCATED) {
+    if (basis_vals[cntrl2])
+      apply_cnot(cntrl1, qubit);
+    return;
+  }
+  queue_perm({PermGate::Kind::TOFFOLI, static_cast<uint32_t>(alloc(qubit)), static_cast<uint32_t>(qubit_map[cntrl1]),
+              static_cast<uint32_t>(qubit_map[cntrl2])});
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10,
+                                                       Complex u11) {
+  if (qubit_map[cntrl] == UNALLOCATED) {
+    if (basis_vals[cntrl])
+      apply_unitary_1q(qubit, u00, u01, u10, u11);
+    return;
+  }
+  // diagonal on a target outside psi, a phase on the control's |1>
+  if (qubit_map[qubit] == UNALLOCATED && u01 == Complex(0.0, 0.0) && u10 == Complex(0.0, 0.0)) {
+    apply_unitary_1q(cntrl, 1.0, 0.0, 0.0, basis_vals[qubit] ? u11 : u00);
+    return;
+  }
+  flush();
+  qubit = alloc(qubit);
+  cntrl = qubit_map[cntrl];
+  PROFILE_SCOPE("apply_controlled_unitary_1q", qubit, sweep_bytes(psi) / 2);
+  run_unitary(psi, qubit, cntrl, u00, u01, u10, u11);
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_controlled_phase(size_t qubit1, size_t qubit2, Complex phase) {
+  // diagonal, so either qubit can act as the control
+  if (qubit_map[qubit1] == UNALLOCATED) {
+    if (basis_vals[qubit1])
+      apply_unitary_1q(qubit2, 1.0, 0.0, 0.0, phase);
+    return;
+  }
+  if (qubit_map[qubit2] == UNALLOCATED) {
+    if (basis_vals[qubit2])
+      apply_unitary_1q(qubit1, 1.0, 0.0, 0.0, phase);
+    return;
+  }
+  flush();
+  PROFILE_SCOPE("apply_controlled_phase", qubit_map[qubit2], sweep_bytes(psi) / 4);
+  // a phase gate on either, controlled by the other
+  run_unitary(psi, qubit_map[qubit2], qubit_map[qubit1], 1.0, 0.0, 0.0, phase);
+}
+
+// cnot(b, a) toffoli(c, a, b) cnot(b, a)
+template <AmpLayout L>
+void BasicQuantumState<L>::apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2) {
+  if (qubit_map[cntrl] == UNALLOCATED) {
+    if (basis_vals[cntrl])
+      apply_swap(qubit1, qubit2);
+    return;
   }
+  apply_cnot(qubit2, qubit1);
+  apply_toffoli(cntrl, qubit1, qubit2);
+  apply_cnot(qubit2, qubit1);
 }
 
-double QuantumState::total_probability() const {
+template <AmpLayout L>
+double BasicQuantumState<L>::total_probability() const {
+  flush();
+  PROFILE_SCOPE("total_probability", PROFILE_NO_QUBIT, psi.size() * sizeof(Complex));
   double total = 0.0;
-  for (const auto& c : psi) {
-    total += std::norm(c);
+  for (size_t i = 0; i < psi.size(); i++) {
+    total += psi.norm(i);
   }
   return total;
 }
 
+template <AmpLayout L>
+std::vector<Complex> BasicQuantumState<L>::amplitudes(std::span<const uint64_t> indices) const {
+  flush();
+  // qubits outside psi have to match their basis values, the rest pick the psi index
+  uint64_t fixed_mask = 0, fixed_val = 0;
+  std::vector<std::pair<size_t, size_t>> held; // qubit and its bit of the psi index
+  for (size_t q = 0; q < n; q++) {
+    if (qubit_map[q] == UNALLOCATED) {
+      fixed_mask |= 1ULL << q;
+      fixed_val |= uint64_t(basis_vals[q]) << q;
+    }
+    else {
+      held.push_back({ q, qubit_map[q] });
+    }
+  }
+
+  std::vector<Complex> res(indices.size(), 0.0);
+  for (size_t k = 0; k < indices.size(); k++) {
+    if ((indices[k] & fixed_mask) != fixed_val)
+      continue;
+    size_t i = 0;
+    for (auto [q, pos] : held)
+      i |= ((indices[k] >> q) & 1) << pos;
+    res[k] = psi.get(i);
+  }
+  return res;
+}
+
+template <AmpLayout L>
+std::vector<double> BasicQuantumState<L>::marginal(std::span<const size_t> qubits, size_t num_threads) const {
+  flush();
+  PROFILE_SCOPE("marginal", PROFILE_NO_QUBIT, psi.size() * sizeof(Complex));
+  // qubits outside psi fix their bit of every entry, the ones in psi are summed
+  // over into a table of their own
+  std::vector<size_t> pos, bit_of;
+  size_t fixed = 0;
+  for (size_t b = 0; b < qubits.size(); b++) {
+    if (qubit_map[qubits[b]] == UNALLOCATED) {
+      fixed |= size_t(basis_vals[qubits[b]]) << b;
+      continue;
+    }
+    pos.push_back(qubit_map[qubits[b]]);
+    bit_of.push_back(b);
+  }
+
+  // a table per part, parts starting on multiples of 256 as sum_joint wants
+  const size_t size = size_t(1) << pos.size();
+  const size_t parts = std::clamp<size_t>(psi.size() / std::max(QUERY_MIN_PART, size), 1, QUERY_PARTS);
+  const size_t per = ((psi.size() + parts - 1) / parts + 255) & ~size_t(255);
+  const auto lut = joint_lut(pos, width);
+  std::vector<double> partial(parts * size, 0.0);
+  parallel_parts(parts, num_threads, [&](size_t p) {
+    const size_t first = std::min(p * per, psi.size()), last = std::min(first + per, psi.size());
+    sum_joint(psi, lut, std::span(partial).subspan(p * size, size), first, last);
+  });
+
+  std::vector<double> joint(size, 0.0);
+  for (size_t p = 0; p < parts; p++) {
+    for (size_t t = 0; t < size; t++)
+      joint[t] += partial[p * size + t];
+  }
+  double total = 0.0;
+  for (double m : joint)
+    total += m;
+
+  std::vector<double> res(size_t(1) << qubits.size(), 0.0);
+  for (size_t t = 0; t < size; t++) {
+    size_t e = fixed;
+    for (size_t j = 0; j < bit_of.size(); j++)
+      e |= ((t >> j) & 1) << bit_of[j];
+    res[e] = joint[t] / total;
+  }
+  return res;
+}
+
+template <AmpLayout L>
+std::vector<BasisProb> BasicQuantumState<L>::probabilities_above(double threshold, size_t num_threads) const {
+  flush();
+  PROFILE_SCOPE("probabilities_above", PROFILE_NO_QUBIT, psi.size() * sizeof(Complex));
+  const size_t parts = std::clamp<size_t>(psi.size() / QUERY_MIN_PART, 1, QUERY_PARTS);
+  const size_t per = (psi.size() + parts - 1) / parts;
+  std::vector<std::vector<BasisProb>> found(parts);
+  parallel_parts(parts, num_threads, [&](size_t p) {
+    const size_t last = std::min((p + 1) * per, psi.size());
+    for (size_t i = p * per; i < last; i++) {
+      double prob = psi.norm(i);
+      if (prob > threshold)
+        found[p].push_back({ to_logical(i), prob });
+    }
+  });
+
+  std::vector<BasisProb> res;
+  for (auto& f : found)
+    res.insert(res.end(), f.begin(), f.end());
+  std::sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+  return res;
+}
+
 static std::string complex_to_string(Complex c) {
   if (std::fabs(c.imag()) <= EPS && std::fabs(c.real()) <= EPS) {
     return "";
@@ -238,11 +1387,59 @@ static std::string complex_to_string(Complex c) {
   }
 }
 
-void QuantumState::print_state() const {
-  for (int i = 0; i < psi.size(); i++) {
-    auto s = std::bitset<32>(i).to_string().substr(32 - n);
-    if (std::norm(psi[i]) > EPS) {
-      std::println("({:.4} + {:.4}i)|{}>", psi[i].real(), psi[i].imag(), s);
+// both scan psi as it is, qubits outside it staying out, and map indices through tables
+// rather than normalize(), which would grow psi back to every qubit just to print it
+template <AmpLayout L>
+std::vector<BasisAmp> BasicQuantumState<L>::top_amplitudes(size_t k) const {
+  flush();
+  uint64_t fixed = 0;
+  std::vector<std::pair<size_t, size_t>> moves; // psi bit to logical bit
+  for (size_t q = 0; q < n; q++) {
+    if (qubit_map[q] == UNALLOCATED)
+      fixed |= uint64_t(basis_vals[q]) << q;
+    else
+      moves.push_back({ qubit_map[q], q });
+  }
+  const auto lut = bit_lut(moves, width);
+  TopAmps top(k);
+  for (size_t i = 0; i < psi.size(); i++) {
+    if (psi.norm(i) > EPS)
+      top.offer(fixed | move_bits(lut, i), psi.get(i));
+  }
+  return top.take();
+}
+
+template <AmpLayout L>
+void BasicQuantumState<L>::write_state(OutputBuffer& out, size_t top) const {
+  if (n > 64) {
+    out.put(std::format("state over {} qubits, too wide to print basis states\n", n));
+    return;
+  }
+  if (top) {
+    for (const auto& [i, a] : top_amplitudes(top))
+      put_basis_amp(out, i, a, n);
+    return;
+  }
+  flush();
+  // t counts through the qubits in psi ordered by logical qubit, so logical indices
+  // come out increasing: bit j of t is the j-th of them
+  uint64_t fixed = 0;
+  std::vector<std::pair<size_t, size_t>> to_psi, to_logical;
+  for (size_t q = 0; q < n; q++) {
+    if (qubit_map[q] == UNALLOCATED) {
+      fixed |= uint64_t(basis_vals[q]) << q;
+      continue;
     }
+    to_psi.push_back({ to_psi.size(), qubit_map[q] });
+    to_logical.push_back({ to_logical.size(), q });
+  }
+  const auto psi_lut = bit_lut(to_psi, width), logical_lut = bit_lut(to_logical, width);
+  for (size_t t = 0; t < psi.size(); t++) {
+    const size_t i = move_bits(psi_lut, t);
+    if (psi.norm(i) > EPS)
+      put_basis_amp(out, fixed | move_bits(logical_lut, t), psi.get(i), n);
   }
 }
+
+template struct BasicQuantumState<AmpLayout::interleaved>;
+template struct BasicQuantumState<AmpLayout::split>;
@@ -0,0 +1,293 @@
+#include "results.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+static constexpr char SHOT_MAGIC[8] = { 'Q', 'S', 'I', 'M', 'S', 'H', 'O', 'T' };
+static constexpr uint32_t SHOT_VERSION = 1;
+
+OutputBuffer::OutputBuffer() : file(stdout), buf(CAPACITY) {}
+
+OutputBuffer::OutputBuffer(std::string& s, size_t capacity) : sink(&s), buf(std::max(capacity, MAX_FIELD)) {}
+
+OutputBuffer::OutputBuffer(OutputBuffer&& other) noexcept
+  : file(other.file), sink(other.sink), owned(other.owned), failed(other.failed), path(std::move(other.path)),
+    buf(std::move(other.buf)), len(other.len) {
+  other.file = nullptr;
+  other.sink = nullptr;
+  other.owned = false;
+  other.len = 0;
+}
+
+OutputBuffer::~OutputBuffer() {
+  flush();
+  if (owned)
+    std::fclose(file);
+}
+
+std::expected<OutputBuffer, ResultError> OutputBuffer::open(const std::string& path) {
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  if (!f)
+    return std::unexpected(ResultError{ResultError::Code::open_failed, path});
+  OutputBuffer out;
+  out.file = f;
+  out.owned = true;
+  out.path = path;
+  return out;
+}
+
+void OutputBuffer::put(std::string_view s) {
+  put_bytes(s.data(), s.size());
+}
+
+void OutputBuffer::put_bytes(const void* data, size_t size) {
+  auto p = static_cast<const char*>(data);
+  while (size > 0) {
+    if (len == buf.size())
+      flush();
+    size_t n = std::min(size, buf.size() - len);
+    std::memcpy(buf.data() + len, p, n);
+    len += n;
+    p += n;
+    size -= n;
+  }
+}
+
+void OutputBuffer::put_uint(uint64_t v) {
+  if (buf.size() - len < MAX_FIELD)
+    flush();
+  len = std::to_chars(buf.data() + len, buf.data() + buf.size(), v).ptr - buf.data();
+}
+
+void OutputBuffer::put_bits(uint64_t v, size_t num_bits) {
+  if (buf.size() - len < MAX_FIELD)
+    flush();
+  for (size_t i = num_bits; i-- > 0;)
+    buf[len++] = ((v >> i) & 1) ? '1' : '0';
+}
+
+void OutputBuffer::put_bits(std::span<const uint8_t> bits) {
+  for (size_t i = bits.size(); i-- > 0;)
+    put(bits[i] ? '1' : '0');
+}
+
+void OutputBuffer::put_real(double v) {
+  if (buf.size() - len < MAX_FIELD)
+    flush();
+  len = std::to_chars(buf.data() + len, buf.data() + buf.size(), v, std::chars_format::general, 4).ptr - buf.data();
+}
+
+void OutputBuffer::put_amp(Complex a) {
+  if (buf.size() - len < MAX_FIELD)
+    flush();
+  // std::format's {:.4} is to_chars in general form with precision 4
+  char* p = buf.data() + len;
+  char* end = buf.data() + buf.size();
+  *p++ = '(';
+  p = std::to_chars(p, end, a.real(), std::chars_format::general, 4).ptr;
+  *p++ = ' ';
+  *p++ = '+';
+  *p++ = ' ';
+  p = std::to_chars(p, end, a.imag(), std::chars_format::general, 4).ptr;
+  *p++ = 'i';
+  *p++ = ')';
+  len = p - buf.data();
+}
+
+void OutputBuffer::flush() {
+  if (len > 0 && sink)
+    sink->append(buf.data(), len);
+  else if (len > 0 && file && std::fwrite(buf.data(), 1, len, file) != len)
+    failed = true;
+  len = 0;
+}
+
+std::expected<void, ResultError> OutputBuffer::close() {
+  flush();
+  if (file && std::fflush(file) != 0)
+    failed = true;
+  if (owned && std::fclose(file) != 0)
+    failed = true;
+  file = nullptr;
+  owned = false;
+  if (failed)
+    return std::unexpected(ResultError{ResultError::Code::write_failed, path.empty() ? "stdout" : path});
+  return {};
+}
+
+Histogram::Histogram(size_t num_clbits)
+  : num_bits(num_clbits), words(std::max<size_t>((num_clbits + 63) / 64, 1)), slots(64, 0) {}
+
+static uint64_t hash_key(std::span<const uint64_t> key) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t w : key) {
+    h ^= w;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+void Histogram::add(std::span<const uint8_t> clbits, uint64_t count) {
+  // outcomes past 64 bits are rare enough that a small vector per shot is fine
+  uint64_t one[1] = { 0 };
+  std::vector<uint64_t> many;
+  std::span<uint64_t> key(one);
+  if (words > 1) {
+    many.assign(words, 0);
+    key = many;
+  }
+  for (size_t i = 0; i < clbits.size(); i++)
+    key[i / 64] |= static_cast<uint64_t>(clbits[i] & 1) << (i % 64);
+  add_packed(key, count);
+}
+
+void Histogram::add_packed(std::span<const uint64_t> key, uint64_t count) {
+  shots += count;
+  const size_t mask = slots.size() - 1;
+  for (size_t s = hash_key(key) & mask;; s = (s + 1) & mask) {
+    if (slots[s] == 0) {
+      slots[s] = static_cast<uint32_t>(counts.size() + 1);
+      keys.insert(keys.end(), key.begin(), key.end());
+      counts.push_back(count);
+      // kept at most half full
+      if (2 * counts.size() > slots.size())
+        grow();
+      return;
+    }
+    if (std::equal(key.begin(), key.end(), outcome(slots[s] - 1).begin())) {
+      counts[slots[s] - 1] += count;
+      return;
+    }
+  }
+}
+
+void Histogram::grow() {
+  slots.assign(2 * slots.size(), 0);
+  const size_t mask = slots.size() - 1;
+  for (size_t k = 0; k < counts.size(); k++) {
+    size_t s = hash_key(outcome(k)) & mask;
+    while (slots[s] != 0)
+      s = (s + 1) & mask;
+    slots[s] = static_cast<uint32_t>(k + 1);
+  }
+}
+
+void Histogram::merge(const Histogram& other) {
+  for (size_t k = 0; k < other.size(); k++)
+    add_packed(other.outcome(k), other.counts[k]);
+}
+
+std::vector<size_t> Histogram::order() const {
+  std::vector<size_t> idx(counts.size());
+  for (size_t k = 0; k < idx.size(); k++)
+    idx[k] = k;
+  std::sort(idx.begin(), idx.end(), [&](size_t l, size_t r) {
+    if (counts[l] != counts[r])
+      return counts[l] > counts[r];
+    auto a = outcome(l), b = outcome(r);
+    return std::lexicographical_compare(a.rbegin(), a.rend(), b.rbegin(), b.rend());
+  });
+  return idx;
+}
+
+static void put_outcome(OutputBuffer& out, std::span<const uint64_t> key, size_t num_bits) {
+  for (size_t w = key.size(); w-- > 0;)
+    out.put_bits(key[w], std::min<size_t>(num_bits - std::min(num_bits, w * 64), 64));
+}
+
+void Histogram::write_csv(OutputBuffer& out) const {
+  out.put("outcome,count\n");
+  for (size_t k : order()) {
+    put_outcome(out, outcome(k), num_bits);
+    out.put(',');
+    out.put_uint(counts[k]);
+    out.put('\n');
+  }
+}
+
+void Histogram::write_json(OutputBuffer& out) const {
+  out.put("{\"clbits\": ");
+  out.put_uint(num_bits);
+  out.put(", \"shots\": ");
+  out.put_uint(shots);
+  out.put(", \"counts\": {");
+  bool first = true;
+  for (size_t k : order()) {
+    out.put(first ? "\"" : ", \"");
+    first = false;
+    put_outcome(out, outcome(k), num_bits);
+    out.put("\": ");
+    out.put_uint(counts[k]);
+  }
+  out.put("}}\n");
+}
+
+std::expected<void, ResultError> Histogram::write(const std::string& path) const {
+  auto out = OutputBuffer::open(path);
+  if (!out)
+    return std::unexpected(out.error());
+  if (path.ends_with(".json"))
+    write_json(*out);
+  else
+    write_csv(*out);
+  return out->close();
+}
+
+std::expected<ShotWriter, ResultError> ShotWriter::open(const std::string& path, size_t num_clbits) {
+  auto out = OutputBuffer::open(path);
+  if (!out)
+    return std::unexpected(out.error());
+
+  ShotWriter w{std::move(*out), num_clbits, (num_clbits + 7) / 8};
+  ShotFileHeader hdr{};
+  std::memcpy(hdr.magic, SHOT_MAGIC, sizeof(SHOT_MAGIC));
+  hdr.version = SHOT_VERSION;
+  hdr.bytes_per_shot = static_cast<uint32_t>(w.bytes_per_shot);
+  hdr.num_clbits = num_clbits;
+  w.out.put_bytes(&hdr, sizeof(hdr));
+  return w;
+}
+
+void ShotWriter::add(std::span<const uint8_t> clbits) {
+  for (size_t b = 0; b < bytes_per_shot; b++) {
+    uint8_t byte = 0;
+    for (size_t i = b * 8; i < std::min(b * 8 + 8, clbits.size()); i++)
+      byte |= (clbits[i] & 1) << (i % 8);
+    out.put(static_cast<char>(byte));
+  }
+  shots++;
+}
+
+void ShotWriter::add_packed(std::span<const uint8_t> packed) {
+  out.put_bytes(packed.data(), packed.size());
+  shots += bytes_per_shot ? packed.size() / bytes_per_shot : 0;
+}
+
+void pack_shot(std::span<const uint8_t> clbits, std::vector<uint8_t>& out) {
+  const size_t first = out.size();
+  out.resize(first + (clbits.size() + 7) / 8, 0);
+  for (size_t i = 0; i < clbits.size(); i++)
+    out[first + i / 8] |= (clbits[i] & 1) << (i % 8);
+}
+
+void TopAmps::push(uint64_t idx, Complex a) {
+  if (heap.size() == k) {
+    std::pop_heap(heap.begin(), heap.end(), larger_amp);
+    heap.pop_back();
+  }
+  heap.push_back({ idx, a });
+  std::push_heap(heap.begin(), heap.end(), larger_amp);
+}
+
+std::vector<BasisAmp> TopAmps::take() {
+  std::sort_heap(heap.begin(), heap.end(), larger_amp);
+  return std::move(heap);
+}
+
+void put_basis_amp(OutputBuffer& out, uint64_t idx, Complex a, size_t num_qubits) {
+  out.put_amp(a);
+  out.put('|');
+  out.put_bits(idx, num_qubits);
+  out.put(">\n");
+}
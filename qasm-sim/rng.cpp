@@ -0,0 +1,32 @@
+#include "rng.h"
+#include <random>
+
+Rng Rng::from_entropy() {
+  std::random_device rd;
+  uint64_t s = (static_cast<uint64_t>(rd()) << 32) | rd();
+  return Rng(s);
+}
+
+void Rng::fill_uniform(std::span<double> out) {
+  size_t i = 0;
+  if (has_buf && !out.empty())
+    out[i++] = uniform();
+
+  // whole blocks, a batch of independent counters at a time so the
+  // rounds can run side by side in vector registers
+  constexpr size_t LANES = 8;
+  while (out.size() - i >= 2 * LANES) {
+    Block b[LANES];
+    for (size_t l = 0; l < LANES; l++)
+      b[l] = philox(counter + l, stream_id, seed);
+    for (size_t l = 0; l < LANES; l++) {
+      out[i + 2 * l] = to_unit(b[l].w[0] | (static_cast<uint64_t>(b[l].w[1]) << 32));
+      out[i + 2 * l + 1] = to_unit(b[l].w[2] | (static_cast<uint64_t>(b[l].w[3]) << 32));
+    }
+    counter += LANES;
+    i += 2 * LANES;
+  }
+
+  for (; i < out.size(); i++)
+    out[i] = uniform();
+}
@@ -0,0 +1,468 @@
+#include "server.h"
+#include "batch.h"
+#include "optimizer.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// pooled states up to this many qubits are allocated at full size when created.
+// larger ones grow as their qubits join psi and keep whatever they reached
+static constexpr size_t PREFAULT_MAX_QUBITS = 24;
+// most bytes of amplitudes idle states hold between them. a state that would go over
+// is freed instead of pooled
+static constexpr size_t POOL_MAX_BYTES = size_t(4) << 30;
+// most jobs a worker takes off the queue at once
+static constexpr size_t JOB_BATCH = 16;
+
+// where a job's answer goes. answers are written whole under the lock so they never
+// interleave, and the last job of a client to finish closes its connection
+struct Client {
+  int fd = -1; // -1 answers on stdout
+  std::mutex mtx;
+
+  explicit Client(int f = -1) : fd(f) {}
+  Client(const Client&) = delete;
+  ~Client() {
+#ifndef _WIN32
+    if (fd >= 0)
+      ::close(fd);
+#endif
+  }
+
+  void send(std::string_view s) {
+    std::lock_guard lock(mtx);
+    if (fd < 0) {
+      std::fwrite(s.data(), 1, s.size(), stdout);
+      std::fflush(stdout);
+      return;
+    }
+#ifndef _WIN32
+    while (!s.empty()) {
+      ssize_t n = ::write(fd, s.data(), s.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      // the client hung up, its answer goes with it
+      if (n <= 0)
+        return;
+      s.remove_prefix(static_cast<size_t>(n));
+    }
+#endif
+  }
+};
+
+struct Job {
+  std::shared_ptr<Client> client;
+  uint64_t num;
+  std::string line;
+};
+
+struct JobArgs {
+  std::string path;
+  std::optional<uint64_t> seed;
+  std::optional<uint64_t> shots;
+  uint64_t top = 0;
+};
+
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+    s.remove_suffix(1);
+  return s;
+}
+
+static bool parse_uint(std::string_view s, uint64_t& out) {
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+  return !s.empty() && ec == std::errc() && ptr == s.data() + s.size();
+}
+
+static std::expected<JobArgs, std::string> parse_job(std::string_view line) {
+  std::vector<std::string_view> words;
+  while (!(line = trim(line)).empty()) {
+    size_t end = std::min(line.find(' '), line.find('\t'));
+    words.push_back(line.substr(0, end));
+    line.remove_prefix(std::min(end, line.size()));
+  }
+
+  JobArgs args;
+  for (size_t i = 0; i < words.size(); i++) {
+    std::string_view w = words[i];
+    bool has_val = (i + 1 < words.size());
+    uint64_t v;
+    if (w == "--seed" && has_val && parse_uint(words[++i], v))
+      args.seed = v;
+    else if (w == "--shots" && has_val && parse_uint(words[++i], v))
+      args.shots = v;
+    else if (w == "--top" && has_val && parse_uint(words[++i], v))
+      args.top = v;
+    else if (!w.starts_with("--") && args.path.empty())
+      args.path = w;
+    else
+      return std::unexpected(std::format("Bad argument {}", w));
+  }
+  if (args.path.empty())
+    return std::unexpected(std::string("No program given"));
+  return args;
+}
+
+// a compiled program. jobs hold on to the entries they run, so recompiling a changed
+// file doesn't pull the circuit out from under them
+struct CompiledFile {
+  Circuit circ;
+};
+
+using Compiled = std::expected<std::shared_ptr<const CompiledFile>, std::string>;
+
+// the program compiled, or being compiled, from a file as it was at mtime and size
+struct FileEntry {
+  std::filesystem::file_time_type mtime;
+  uintmax_t size;
+  std::shared_future<Compiled> result;
+};
+
+static Compiled compile_file(const std::string& path, bool run_optimizer) {
+  auto l = Lexer::from_file(path);
+  if (!l)
+    return std::unexpected(std::format("Error opening file {}", path));
+  if (auto ok = l->lex_all(); !ok)
+    return std::unexpected(std::format("{} at pos {}", ok.error().err_str(), ok.error().span.pos));
+  auto c = Circuit::compile(*l, std::filesystem::path(path).parent_path());
+  if (!c)
+    return std::unexpected(std::format("{} at pos {}", c.error().err_str(), c.error().span.pos));
+  if (run_optimizer)
+    optimize(*c);
+  return std::make_shared<const CompiledFile>(CompiledFile{std::move(*c)});
+}
+
+struct Server {
+  ServerOptions opts;
+  Rng base;
+  std::atomic<uint64_t> next_stream = 0;
+
+  std::mutex files_mtx;
+  std::unordered_map<std::string, FileEntry> files;
+
+  // idle states by qubit count. a state is only ever out with one job, so there are
+  // never more of a size than workers
+  std::mutex pool_mtx;
+  std::unordered_map<size_t, std::vector<std::unique_ptr<QuantumState>>> pool;
+  size_t pool_bytes = 0;
+
+  std::mutex queue_mtx;
+  std::condition_variable queue_cv;
+  std::deque<Job> queue;
+  bool closing = false;
+  size_t num_workers;
+  std::vector<std::thread> workers;
+
+  explicit Server(const ServerOptions& o)
+    : opts(o), base(o.seed ? Rng(*o.seed) : Rng::from_entropy()) {
+    num_workers = opts.num_threads ? opts.num_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t i = 0; i < num_workers; i++)
+      workers.emplace_back([this] { work(); });
+  }
+
+  // answers every job already submitted before returning
+  ~Server() {
+    {
+      std::lock_guard lock(queue_mtx);
+      closing = true;
+    }
+    queue_cv.notify_all();
+    for (auto& t : workers)
+      t.join();
+  }
+
+  void submit(Job job) {
+    {
+      std::lock_guard lock(queue_mtx);
+      queue.push_back(std::move(job));
+    }
+    queue_cv.notify_one();
+  }
+
+  Compiled load(const std::string& path);
+  std::unique_ptr<QuantumState> acquire(size_t num_qubits, Rng rng);
+  void release(std::unique_ptr<QuantumState> qs);
+  std::expected<void, std::string> run(const JobArgs& args, std::string& text);
+  void work();
+};
+
+Compiled Server::load(const std::string& path) {
+  std::error_code ec;
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  uintmax_t size = ec ? 0 : std::filesystem::file_size(path, ec);
+  if (ec)
+    return std::unexpected(std::format("Error opening file {}", path));
+
+  // the lock only covers the lookup. the first job of a program leaves a placeholder
+  // and compiles outside it, jobs for the same program wait on the placeholder and
+  // jobs for any other go ahead
+  std::promise<Compiled> promise;
+  std::shared_future<Compiled> placed;
+  {
+    std::lock_guard lock(files_mtx);
+    auto& entry = files[path];
+    if (entry.result.valid() && entry.mtime == mtime && entry.size == size)
+      placed = entry.result;
+    else
+      entry = FileEntry{mtime, size, promise.get_future().share()};
+  }
+  if (placed.valid())
+    return placed.get();
+
+  Compiled c = compile_file(path, opts.optimize);
+  promise.set_value(c);
+  // failures aren't kept, the next job tries again
+  if (!c) {
+    std::lock_guard lock(files_mtx);
+    if (auto it = files.find(path); it != files.end() && it->second.mtime == mtime && it->second.size == size)
+      files.erase(it);
+  }
+  return c;
+}
+
+static size_t state_bytes(const QuantumState& qs) {
+  return (qs.psi.capacity() + qs.scratch.capacity()) * sizeof(Complex);
+}
+
+std::unique_ptr<QuantumState> Server::acquire(size_t num_qubits, Rng rng) {
+  std::unique_ptr<QuantumState> qs;
+  {
+    std::lock_guard lock(pool_mtx);
+    auto& idle = pool[num_qubits];
+    if (!idle.empty()) {
+      qs = std::move(idle.back());
+      idle.pop_back();
+      pool_bytes -= state_bytes(*qs);
+    }
+  }
+  if (!qs) {
+    qs = std::make_unique<QuantumState>(num_qubits, 0, rng);
+    if (num_qubits <= PREFAULT_MAX_QUBITS)
+      qs->reserve(num_qubits);
+    else
+      qs->keep_capacity = true;
+  }
+  qs->init(num_qubits, 0);
+  qs->rng = rng;
+  return qs;
+}
+
+void Server::release(std::unique_ptr<QuantumState> qs) {
+  const size_t bytes = state_bytes(*qs);
+  std::lock_guard lock(pool_mtx);
+  if (pool_bytes + bytes > POOL_MAX_BYTES)
+    return; // qs is freed on return, once the lock is let go
+  pool_bytes += bytes;
+  pool[qs->n].push_back(std::move(qs));
+}
+
+// the output a one-off run of the same arguments prints, into text
+std::expected<void, std::string> Server::run(const JobArgs& args, std::string& text) {
+  auto file = load(args.path);
+  if (!file)
+    return std::unexpected(file.error());
+  const Circuit& circ = (*file)->circ;
+  if (!circ.inputs.empty())
+    return std::unexpected(std::string("Program declares inputs"));
+
+  std::vector<double> param_vals;
+  std::vector<uint8_t> clbits;
+  circ.bind({}, param_vals);
+  Rng rng = args.seed ? Rng(*args.seed) : base.stream(next_stream++);
+  const bool stabilizer_sum = circ.prefers_stabilizer_sum(param_vals);
+  OutputBuffer out(text);
+
+  // jobs already keep every worker busy, so each runs on one thread
+  if (args.shots) {
+    SweepOptions so;
+    so.num_threads = 1;
+    so.shots = *args.shots;
+    so.seed = args.seed ? *args.seed : rng();
+    Histogram hist(circ.num_clbits);
+    run_shots(circ, param_vals, hist, nullptr, so, stabilizer_sum);
+    hist.write_csv(out);
+    return {};
+  }
+
+  if (stabilizer_sum) {
+    StabilizerSum ss(circ.num_qubits, rng);
+    ss.num_threads = 1;
+    circ.execute(ss, param_vals, clbits);
+    ss.write_state(out, args.top);
+    circ.write_cregs(out, clbits);
+    return {};
+  }
+
+  auto qs = acquire(circ.num_qubits, rng);
+  circ.execute(*qs, param_vals, clbits);
+  qs->write_state(out, args.top);
+  circ.write_cregs(out, clbits);
+  release(std::move(qs));
+  return {};
+}
+
+void Server::work() {
+  std::vector<Job> batch;
+  std::string text, reply;
+  while (true) {
+    {
+      std::unique_lock lock(queue_mtx);
+      queue_cv.wait(lock, [&] { return closing || !queue.empty(); });
+      if (queue.empty())
+        return;
+      // a long queue is shared out in runs, so a wakeup covers several small jobs
+      const size_t take = std::clamp<size_t>(queue.size() / num_workers, 1, JOB_BATCH);
+      for (size_t i = 0; i < take; i++) {
+        batch.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+    }
+
+    for (auto& job : batch) {
+      text.clear();
+      auto args = parse_job(job.line);
+      auto ok = args ? run(*args, text) : std::unexpected(args.error());
+      if (ok) {
+        reply = std::format("ok {} {}\n", job.num, text.size());
+        reply += text;
+      }
+      else {
+        reply = std::format("error {} {}\n", job.num, ok.error());
+      }
+      job.client->send(reply);
+    }
+    batch.clear();
+  }
+}
+
+void serve_stdio(const ServerOptions& opts) {
+  Server server(opts);
+  auto client = std::make_shared<Client>();
+  uint64_t num = 0;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::string_view job = trim(line);
+    if (job.empty())
+      continue;
+    if (job == "quit")
+      break;
+    server.submit({ client, ++num, std::string(job) });
+  }
+}
+
+std::expected<void, ServerError> serve_socket(const std::string& path, const ServerOptions& opts) {
+#ifdef _WIN32
+  return std::unexpected(ServerError{ServerError::Code::unsupported, path});
+#else
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return std::unexpected(ServerError{ServerError::Code::bind_failed, path});
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0)
+    return std::unexpected(ServerError{ServerError::Code::socket_failed, path});
+  ::unlink(path.c_str());
+  if (::bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(lfd, SOMAXCONN) != 0) {
+    ::close(lfd);
+    return std::unexpected(ServerError{ServerError::Code::bind_failed, path});
+  }
+  // a client hanging up before its answers are written shouldn't take the server with it
+  std::signal(SIGPIPE, SIG_IGN);
+
+  Server server(opts);
+  std::mutex conn_mtx;
+  std::condition_variable conn_cv;
+  std::unordered_set<int> reading; // connections with a reader blocked on them
+  size_t num_readers = 0;
+  bool quit = false;
+
+  // wakes the accept loop and every reader
+  auto stop = [&] {
+    std::lock_guard lock(conn_mtx);
+    quit = true;
+    ::shutdown(lfd, SHUT_RDWR);
+    for (int fd : reading)
+      ::shutdown(fd, SHUT_RD);
+  };
+
+  auto read_client = [&](std::shared_ptr<Client> client) {
+    std::string pending;
+    char buf[1 << 12];
+    uint64_t num = 0;
+    bool done = false;
+    while (!done) {
+      ssize_t n = ::read(client->fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      pending.append(buf, static_cast<size_t>(n));
+      size_t start = 0;
+      for (size_t nl; !done && (nl = pending.find('\n', start)) != std::string::npos; start = nl + 1) {
+        std::string_view job = trim(std::string_view(pending).substr(start, nl - start));
+        if (job == "quit")
+          done = true;
+        else if (!job.empty())
+          server.submit({ client, ++num, std::string(job) });
+      }
+      pending.erase(0, start);
+    }
+    if (done)
+      stop();
+
+    std::lock_guard lock(conn_mtx);
+    reading.erase(client->fd);
+    num_readers--;
+    conn_cv.notify_all();
+  };
+
+  while (true) {
+    int fd = ::accept(lfd, nullptr, nullptr);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    std::lock_guard lock(conn_mtx);
+    if (fd < 0 || quit) {
+      if (fd >= 0)
+        ::close(fd);
+      break;
+    }
+    reading.insert(fd);
+    num_readers++;
+    std::thread(read_client, std::make_shared<Client>(fd)).detach();
+  }
+
+  // the readers submit to server, so they finish before it goes
+  {
+    std::unique_lock lock(conn_mtx);
+    conn_cv.wait(lock, [&] { return num_readers == 0; });
+  }
+  ::close(lfd);
+  ::unlink(path.c_str());
+  return {};
+#endif
+}
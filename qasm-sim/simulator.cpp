@@ -1,32 +1,454 @@
-﻿#include <print>
+﻿#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <print>
 #include "quantum_state.h"
 #include "lexer.h"
+#include "circuit.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "circuit_cache.h"
+#include "optimizer.h"
+#include "profiler.h"
+#include "results.h"
+#include "server.h"
 
-int main()
+struct Options {
+  std::string path = "/home/etai/source/qasm-sim/qasm-sim/examples/test.qasm";
+  bool print_toks = false;
+  std::string sweep_path;
+  std::string out_path = "sweep.csv";
+  SweepOptions sweep;
+  std::string checkpoint_path;
+  std::string resume_path;
+  size_t checkpoint_every = 0; // ops between checkpoints, 0 only saves at the end
+  bool compress = false;
+  std::optional<uint64_t> seed;
+  bool profile = false;
+  bool hw_counters = false;
+  std::string trace_path;
+  std::string cache_dir; // compiled circuits are kept here when set
+  bool optimize = false;
+  bool shots_given = false;
+  std::string hist_path;  // shot counts as .json or csv
+  std::string shots_path; // every shot's outcome, binary
+  size_t top = 0;         // amplitudes printed, 0 prints all of them
+  // queries printed in place of the state
+  std::vector<uint64_t> amp_indices;
+  std::vector<size_t> marginal_qubits;
+  std::optional<double> above;
+  bool serve = false;     // jobs from stdin, see server.h
+  std::string socket_path;
+};
+
+static bool parse_count(const char* s, size_t& out) {
+  auto end = s + std::strlen(s);
+  auto [ptr, ec] = std::from_chars(s, end, out);
+  return ec == std::errc() && ptr == end;
+}
+
+static bool parse_seed(const char* s, std::optional<uint64_t>& out) {
+  uint64_t v;
+  auto end = s + std::strlen(s);
+  auto [ptr, ec] = std::from_chars(s, end, v);
+  if (ec != std::errc() || ptr != end)
+    return false;
+  out = v;
+  return true;
+}
+
+// comma separated counts
+template <class T>
+static bool parse_list(const char* s, std::vector<T>& out) {
+  std::string_view rest = s;
+  while (true) {
+    size_t comma = rest.find(',');
+    std::string_view item = rest.substr(0, comma);
+    T v;
+    auto [ptr, ec] = std::from_chars(item.data(), item.data() + item.size(), v);
+    if (item.empty() || ec != std::errc() || ptr != item.data() + item.size())
+      return false;
+    out.push_back(v);
+    if (comma == std::string_view::npos)
+      return true;
+    rest.remove_prefix(comma + 1);
+  }
+}
+
+static bool parse_args(int argc, char** argv, Options& opts) {
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    bool has_val = (i + 1 < argc);
+
+    if (arg == "--tokens") {
+      opts.print_toks = true;
+    }
+    else if (arg == "--sweep" && has_val) {
+      opts.sweep_path = argv[++i];
+    }
+    else if (arg == "--out" && has_val) {
+      opts.out_path = argv[++i];
+    }
+    else if (arg == "--threads" && has_val) {
+      if (!parse_count(argv[++i], opts.sweep.num_threads))
+        return false;
+    }
+    else if (arg == "--shots" && has_val) {
+      if (!parse_count(argv[++i], opts.sweep.shots))
+        return false;
+      opts.shots_given = true;
+    }
+    else if (arg == "--batch" && has_val) {
+      if (!parse_count(argv[++i], opts.sweep.batch_size))
+        return false;
+    }
+    else if (arg == "--seed" && has_val) {
+      if (!parse_seed(argv[++i], opts.seed))
+        return false;
+      opts.sweep.seed = opts.seed;
+    }
+    else if (arg == "--checkpoint" && has_val) {
+      opts.checkpoint_path = argv[++i];
+    }
+    else if (arg == "--checkpoint-every" && has_val) {
+      if (!parse_count(argv[++i], opts.checkpoint_every))
+        return false;
+    }
+    else if (arg == "--compress") {
+      opts.compress = true;
+    }
+    else if (arg == "--resume" && has_val) {
+      opts.resume_path = argv[++i];
+    }
+    else if (arg == "--profile") {
+      opts.profile = true;
+    }
+    else if (arg == "--hw-counters") {
+      opts.hw_counters = true;
+    }
+    else if (arg == "--trace" && has_val) {
+      opts.trace_path = argv[++i];
+    }
+    else if (arg == "--cache" && has_val) {
+      opts.cache_dir = argv[++i];
+    }
+    else if (arg == "--optimize") {
+      opts.optimize = true;
+    }
+    else if (arg == "--hist" && has_val) {
+      opts.hist_path = argv[++i];
+    }
+    else if (arg == "--shots-out" && has_val) {
+      opts.shots_path = argv[++i];
+    }
+    else if (arg == "--amps" && has_val) {
+      if (!parse_list(argv[++i], opts.amp_indices))
+        return false;
+    }
+    else if (arg == "--marginal" && has_val) {
+      if (!parse_list(argv[++i], opts.marginal_qubits))
+        return false;
+    }
+    else if (arg == "--above" && has_val) {
+      double v;
+      auto end = argv[i + 1] + std::strlen(argv[i + 1]);
+      auto [ptr, ec] = std::from_chars(argv[++i], end, v);
+      if (ec != std::errc() || ptr != end)
+        return false;
+      opts.above = v;
+    }
+    else if (arg == "--serve") {
+      opts.serve = true;
+    }
+    else if (arg == "--socket" && has_val) {
+      opts.socket_path = argv[++i];
+    }
+    else if (arg == "--top" && has_val) {
+      if (!parse_count(argv[++i], opts.top))
+        return false;
+    }
+    else if (!arg.starts_with("--")) {
+      opts.path = arg;
+    }
+    else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool has_queries(const Options& opts) {
+  return !opts.amp_indices.empty() || !opts.marginal_qubits.empty() || opts.above;
+}
+
+// the queries of opts on the final state, one line per amplitude or probability
+static bool write_queries(OutputBuffer& out, const QuantumState& qs, const Options& opts) {
+  const auto& qubits = opts.marginal_qubits;
+  bool ok = qs.n <= 64;
+  for (size_t i = 0; i < qubits.size(); i++)
+    ok = ok && qubits[i] < qs.n && std::find(qubits.begin(), qubits.begin() + i, qubits[i]) == qubits.begin() + i;
+  for (uint64_t idx : opts.amp_indices)
+    ok = ok && (qs.n == 64 || idx >> qs.n == 0);
+  if (!ok) {
+    std::println(stderr, "Error: queries need distinct qubits and basis states of the program's {} qubits", qs.n);
+    return false;
+  }
+  if (qubits.size() > QuantumState::MARGINAL_MAX_QUBITS) {
+    std::println(stderr, "Error: --marginal takes at most {} qubits", QuantumState::MARGINAL_MAX_QUBITS);
+    return false;
+  }
+
+  auto amps = qs.amplitudes(opts.amp_indices);
+  for (size_t k = 0; k < amps.size(); k++)
+    put_basis_amp(out, opts.amp_indices[k], amps[k], qs.n);
+  if (!qubits.empty()) {
+    auto probs = qs.marginal(qubits, opts.sweep.num_threads);
+    for (size_t j = 0; j < probs.size(); j++) {
+      out.put_bits(j, qubits.size());
+      out.put(' ');
+      out.put_real(probs[j]);
+      out.put('\n');
+    }
+  }
+  if (opts.above) {
+    for (auto [idx, p] : qs.probabilities_above(*opts.above, opts.sweep.num_threads)) {
+      out.put_bits(idx, qs.n);
+      out.put(' ');
+      out.put_real(p);
+      out.put('\n');
+    }
+  }
+  return true;
+}
+
+// many shots of one program: a histogram of the outcomes rather than a final state
+static int run_histogram(const Circuit& circ, std::span<const double> param_vals, const Options& opts) {
+  Histogram hist(circ.num_clbits);
+  std::optional<ShotWriter> writer;
+  if (!opts.shots_path.empty()) {
+    auto w = ShotWriter::open(opts.shots_path, circ.num_clbits);
+    if (!w) {
+      w.error().print();
+      return 1;
+    }
+    writer.emplace(std::move(*w));
+  }
+
+  run_shots(circ, param_vals, hist, writer ? &*writer : nullptr, opts.sweep, circ.prefers_stabilizer_sum(param_vals));
+
+  if (writer) {
+    if (auto ok = writer->close(); !ok) {
+      ok.error().print();
+      return 1;
+    }
+  }
+  if (opts.hist_path.empty()) {
+    OutputBuffer out;
+    hist.write_csv(out);
+    return 0;
+  }
+  if (auto ok = hist.write(opts.hist_path); !ok) {
+    ok.error().print();
+    return 1;
+  }
+  return 0;
+}
+
+static int run_server(const Options& opts) {
+  ServerOptions so;
+  so.num_threads = opts.sweep.num_threads;
+  so.seed = opts.seed;
+  so.optimize = opts.optimize;
+  if (opts.socket_path.empty()) {
+    serve_stdio(so);
+    return 0;
+  }
+  if (auto ok = serve_socket(opts.socket_path, so); !ok) {
+    ok.error().print();
+    return 1;
+  }
+  return 0;
+}
+
+static int run(const Options& opts)
 {
-  auto l = Lexer::from_file("/home/etai/source/qasm-sim/qasm-sim/examples/test.qasm");
+  auto l = Lexer::from_file(opts.path);
   if (!l) {
     l.error().print();
     return 1;
   }
   
   auto& lex = l.value();
+  const std::string_view source(lex.file_contents.data(), lex.len);
 
-  while (true) {
-    auto ok = lex.next_tok();
-    if (!ok) {
+  // a cache miss, or an entry from another source or build, just means compiling as usual
+  std::optional<Circuit> compiled;
+  std::string cache_file;
+  if (!opts.cache_dir.empty() && !opts.print_toks) {
+    cache_file = cache_path(opts.cache_dir, source);
+    if (auto c = load_circuit(source, cache_file))
+      compiled = std::move(*c);
+  }
+
+  if (!compiled) {
+    if (auto ok = lex.lex_all(opts.sweep.num_threads); !ok) {
+      ok.error().print();
+      return 1;
+    }
+
+    if (opts.print_toks) {
+      lex.print_toks();
+      return 0;
+    }
+
+    auto c = Circuit::compile(lex, std::filesystem::path(opts.path).parent_path());
+    if (!c) {
+      c.error().print();
+      return 1;
+    }
+    compiled = std::move(*c);
+
+    // the cache is keyed on the main source only, so programs with includes aren't saved
+    if (!cache_file.empty() && compiled->includes.empty()) {
+      if (auto ok = save_circuit(*compiled, source, cache_file); !ok)
+        ok.error().print();
+    }
+  }
+
+  auto& circ = *compiled;
+
+  // after the cache, which keeps the circuit as written. the pass is deterministic,
+  // so a checkpoint resumes at the same op as long as --optimize is given again
+  if (opts.optimize) {
+    auto stats = optimize(circ);
+    std::println(stderr, "optimize: removed {} of {} ops ({} cancelled, {} merged, {} identities, {} fourier transforms)",
+                 stats.removed(), stats.ops_before, stats.cancelled, stats.merged, stats.dropped, stats.transforms);
+  }
+
+  if (!opts.sweep_path.empty()) {
+    auto bindings = BindingTable::from_file(opts.sweep_path, circ);
+    if (!bindings) {
+      bindings.error().print();
+      return 1;
+    }
+    if (auto ok = run_sweep(circ, *bindings, opts.out_path, opts.sweep); !ok) {
       ok.error().print();
       return 1;
     }
-    else if (!ok.value())
-      break;
-    // lex.print_latest_tok();
+    return 0;
+  }
+
+  if (!circ.inputs.empty()) {
+    std::println(stderr, "Error: program declares inputs, run it with --sweep");
+    return 1;
+  }
+
+  std::vector<double> param_vals;
+  std::vector<uint8_t> clbits(circ.num_clbits, 0);
+  circ.bind({}, param_vals);
+
+  if (opts.shots_given || !opts.hist_path.empty() || !opts.shots_path.empty()) {
+    if (!opts.checkpoint_path.empty() || !opts.resume_path.empty()) {
+      std::println(stderr, "Error: checkpoints hold a single run, they can't be combined with shots");
+      return 1;
+    }
+    return run_histogram(circ, param_vals, opts);
+  }
+
+  if ((!opts.checkpoint_path.empty() || !opts.resume_path.empty()) && circ.num_qubits > CHECKPOINT_MAX_QUBITS) {
+    CheckpointError{CheckpointError::Code::too_wide, opts.checkpoint_path.empty() ? opts.resume_path : opts.checkpoint_path}.print();
+    return 1;
+  }
+
+  const Rng rng = opts.seed ? Rng(*opts.seed) : Rng::from_entropy();
+
+  // checkpoints and queries only work on state vectors
+  if (opts.checkpoint_path.empty() && opts.resume_path.empty() && !has_queries(opts) && circ.prefers_stabilizer_sum(param_vals)) {
+    StabilizerSum ss(circ.num_qubits, rng);
+    ss.num_threads = opts.sweep.num_threads;
+    circ.execute(ss, param_vals, clbits);
+    OutputBuffer out;
+    ss.write_state(out, opts.top);
+    circ.write_cregs(out, clbits);
+    return 0;
+  }
+
+  QuantumState qs(circ.num_qubits, 0, rng);
+  size_t next_op = 0;
+
+  // a resumed run continues from the saved state, which may also be a cached prefix of this program
+  if (!opts.resume_path.empty()) {
+    auto info = load_state(qs, opts.resume_path, circ.num_qubits, circ.num_clbits);
+    if (!info) {
+      info.error().print();
+      return 1;
+    }
+    if (info->next_op > circ.ops.size()) {
+      CheckpointError{CheckpointError::Code::wrong_size, opts.resume_path}.print();
+      return 1;
+    }
+    next_op = info->next_op;
+    clbits = std::move(info->clbits);
   }
 
-  lex.print_toks();
-  // QuantumState qs(3, 0b011);
-  // qs.apply_toffoli(0, 1, 2);
-  // qs.print_state();
-	
+  size_t step = opts.checkpoint_every ? opts.checkpoint_every : circ.ops.size();
+  do {
+    size_t last_op = std::min(next_op + step, circ.ops.size());
+    circ.execute_range(qs, param_vals, clbits, next_op, last_op);
+    next_op = last_op;
+
+    if (!opts.checkpoint_path.empty()) {
+      auto ok = save_state(qs, opts.checkpoint_path, {next_op, clbits}, {opts.compress});
+      if (!ok) {
+        ok.error().print();
+        return 1;
+      }
+    }
+  } while (next_op < circ.ops.size());
+
+  OutputBuffer out;
+  if (!has_queries(opts))
+    qs.write_state(out, opts.top);
+  else if (!write_queries(out, qs, opts))
+    return 1;
+  circ.write_cregs(out, clbits);
   return 0;
 }
+
+int main(int argc, char** argv)
+{
+  Options opts;
+  if (!parse_args(argc, argv, opts)) {
+    std::println(stderr, "usage: qasm-sim [file.qasm] [--tokens] [--seed n] [--threads n] [--sweep bindings.csv|.bin [--out results.csv] [--shots n] [--batch n]]\n"
+                 "                [--resume state.ckpt] [--checkpoint state.ckpt [--checkpoint-every n] [--compress]]\n"
+                 "                [--profile] [--trace trace.json] [--hw-counters] [--cache dir] [--optimize]\n"
+                 "                [--shots n] [--hist counts.json|.csv] [--shots-out shots.bin] [--top k]\n"
+                 "                [--amps i,j,..] [--marginal q,q,..] [--above p] [--serve | --socket path]");
+    return 1;
+  }
+
+  bool profiling = opts.profile || !opts.trace_path.empty();
+#ifdef QASM_SIM_PROFILE
+  if (profiling)
+    Profiler::enable(opts.hw_counters);
+#else
+  if (profiling) {
+    std::println(stderr, "Error: profiling needs a build configured with -DQASM_SIM_PROFILE=ON");
+    return 1;
+  }
+#endif
+
+  int rc = (opts.serve || !opts.socket_path.empty()) ? run_server(opts) : run(opts);
+
+#ifdef QASM_SIM_PROFILE
+  if (opts.profile)
+    Profiler::print_summary();
+  if (!opts.trace_path.empty() && !Profiler::write_trace(opts.trace_path)) {
+    std::println(stderr, "Error writing {}", opts.trace_path);
+    return 1;
+  }
+#endif
+
+  return rc;
+}
@@ -0,0 +1,803 @@
+#include "stabilizer.h"
+#include "profiler.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numbers>
+#include <print>
+#include <stdexcept>
+#include <thread>
+
+static constexpr double EPS = 1e-12;
+static constexpr double PRUNE_NORM = 1e-24; // terms this small have cancelled
+static constexpr double PAULI_TOL = 1e-9;   // how close a matrix must be to a pauli to count as one
+
+static inline bool get_bit(const uint64_t* v, size_t q) {
+  return (v[q >> 6] >> (q & 63)) & 1;
+}
+
+static inline void flip_bit(uint64_t* v, size_t q) {
+  v[q >> 6] ^= 1ULL << (q & 63);
+}
+
+static inline void put_bit(uint64_t* v, size_t q, bool b) {
+  v[q >> 6] = (v[q >> 6] & ~(1ULL << (q & 63))) | (static_cast<uint64_t>(b) << (q & 63));
+}
+
+// parity of a & b
+static inline bool dot(const uint64_t* a, const uint64_t* b, size_t words) {
+  uint64_t acc = 0;
+  for (size_t w = 0; w < words; w++)
+    acc ^= a[w] & b[w];
+  return std::popcount(acc) & 1;
+}
+
+static inline Complex i_pow(unsigned k) {
+  switch (k & 3) {
+  case 0: return { 1.0, 0.0 };
+  case 1: return { 0.0, 1.0 };
+  case 2: return { -1.0, 0.0 };
+  default: return { 0.0, -1.0 };
+  }
+}
+
+// a = a * b as paulis over words words, returning the power of i the product picks up.
+// each qubit where the two anticommute adds +i or -i, and the bit planes c1 and c2
+// count those mod 4 for all 64 qubits of a word at once
+static uint8_t mul_paulis(uint64_t* ax, uint64_t* az, const uint64_t* bx, const uint64_t* bz, size_t words) {
+  uint64_t c1 = 0, c2 = 0;
+  for (size_t w = 0; w < words; w++) {
+    const uint64_t x1 = ax[w], z1 = az[w];
+    ax[w] ^= bx[w];
+    az[w] ^= bz[w];
+    const uint64_t x1z2 = x1 & bz[w];
+    const uint64_t anti = (bx[w] & z1) ^ x1z2;
+    c2 ^= (c1 ^ ax[w] ^ az[w] ^ x1z2) & anti;
+    c1 ^= anti;
+  }
+  return static_cast<uint8_t>((std::popcount(c1) + 2 * std::popcount(c2)) & 3);
+}
+
+// normalized probabilities of |0> and |1> from their weights, as in quantum_state.cpp
+static std::array<double, 2> clamp_probs(double p0, double p1) {
+  if (p0 < EPS && p1 < EPS)
+    throw std::runtime_error("At least one probability must be non-zero");
+  if (p0 < EPS)
+    return { 0.0, 1.0 };
+  if (p1 < EPS)
+    return { 1.0, 0.0 };
+  const double norm = 1 / (p0 + p1);
+  return { p0 * norm, p1 * norm };
+}
+
+// runs fn(first, last) over [0, count), split across threads once there are enough terms
+template <typename Fn>
+static void parallel_ranges(size_t count, size_t num_threads, Fn fn) {
+  if (num_threads == 0)
+    num_threads = std::thread::hardware_concurrency();
+  num_threads = std::min(std::max<size_t>(num_threads, 1), std::max<size_t>(count / StabilizerSum::PARALLEL_MIN_TERMS, 1));
+  if (num_threads == 1) {
+    fn(size_t(0), count);
+    return;
+  }
+
+  const size_t per = (count + num_threads - 1) / num_threads;
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads && t * per < count; t++)
+    threads.emplace_back(fn, t * per, std::min(count, (t + 1) * per));
+  fn(size_t(0), per);
+  for (auto& th : threads)
+    th.join();
+}
+
+// open addressing index over keys of words words, held in a vector that may grow
+struct KeyTable {
+  const std::vector<uint64_t>& keys;
+  size_t words;
+  std::vector<uint32_t> slots; // term + 1, 0 if empty
+  size_t mask;
+
+  KeyTable(const std::vector<uint64_t>& k, size_t w, size_t capacity) : keys(k), words(w) {
+    size_t size = std::bit_ceil(std::max<size_t>(2 * capacity, 16));
+    slots.assign(size, 0);
+    mask = size - 1;
+  }
+
+  size_t slot_of(const uint64_t* key) const {
+    uint64_t h = 0x9E3779B97F4A7C15;
+    for (size_t w = 0; w < words; w++) {
+      h = (h ^ key[w]) * 0xBF58476D1CE4E5B9;
+      h ^= h >> 31;
+    }
+    return h & mask;
+  }
+
+  bool equal(size_t t, const uint64_t* key) const {
+    return std::equal(key, key + words, keys.data() + t * words);
+  }
+
+  // the term holding key, or SIZE_MAX
+  size_t find(const uint64_t* key) const {
+    for (size_t s = slot_of(key);; s = (s + 1) & mask) {
+      if (slots[s] == 0)
+        return SIZE_MAX;
+      if (equal(slots[s] - 1, key))
+        return slots[s] - 1;
+    }
+  }
+
+  // adds term t unless an earlier term has its key, returning the term that holds it
+  size_t insert(size_t t) {
+    const uint64_t* key = keys.data() + t * words;
+    for (size_t s = slot_of(key);; s = (s + 1) & mask) {
+      if (slots[s] == 0) {
+        slots[s] = static_cast<uint32_t>(t + 1);
+        return t;
+      }
+      if (equal(slots[s] - 1, key))
+        return slots[s] - 1;
+    }
+  }
+};
+
+using Mat2 = std::array<Complex, 4>;
+
+static Mat2 mul(const Mat2& a, const Mat2& b) {
+  return { a[0] * b[0] + a[1] * b[2], a[0] * b[1] + a[1] * b[3],
+           a[2] * b[0] + a[3] * b[2], a[2] * b[1] + a[3] * b[3] };
+}
+
+static Mat2 adjoint(const Mat2& u) {
+  return { std::conj(u[0]), std::conj(u[2]), std::conj(u[1]), std::conj(u[3]) };
+}
+
+static const Mat2 PAULI_X = { 0.0, 1.0, 1.0, 0.0 };
+static const Mat2 PAULI_Y = { 0.0, Complex(0.0, -1.0), Complex(0.0, 1.0), 0.0 };
+static const Mat2 PAULI_Z = { 1.0, 0.0, 0.0, -1.0 };
+
+// u = c[0] I + c[1] X + c[2] Y + c[3] Z
+static std::array<Complex, 4> pauli_coefs(const Mat2& u) {
+  const Complex i(0.0, 1.0);
+  return { (u[0] + u[3]) / 2.0, (u[1] + u[2]) / 2.0, i * (u[1] - u[2]) / 2.0, (u[0] - u[3]) / 2.0 };
+}
+
+static bool near(const Mat2& a, const Mat2& b) {
+  for (size_t k = 0; k < 4; k++) {
+    if (std::abs(a[k] - b[k]) > PAULI_TOL)
+      return false;
+  }
+  return true;
+}
+
+// where conjugation sends one pauli: (x, z) of the image and whether it's negated
+struct PauliImage {
+  uint8_t x = 0, z = 0, sign = 0;
+};
+
+// m as +-X, +-Y or +-Z, if it is one
+static bool as_pauli(const Mat2& m, PauliImage& out) {
+  auto c = pauli_coefs(m);
+  static constexpr uint8_t xs[] = { 0, 1, 1, 0 }, zs[] = { 0, 0, 1, 1 };
+  for (size_t k = 1; k < 4; k++) {
+    if (std::abs(std::abs(c[k]) - 1.0) > PAULI_TOL)
+      continue;
+    if (std::abs(c[k].imag()) > PAULI_TOL)
+      return false;
+    out = { xs[k], zs[k], static_cast<uint8_t>(c[k].real() < 0) };
+    return true;
+  }
+  return false;
+}
+
+// images of X, Z and Y = iXZ under conjugation by u, indexed by x | z << 1
+static bool clifford_table(const Mat2& u, std::array<PauliImage, 4>& table) {
+  const Mat2 ud = adjoint(u);
+  PauliImage ix, iz;
+  if (!as_pauli(mul(mul(u, PAULI_X), ud), ix) || !as_pauli(mul(mul(u, PAULI_Z), ud), iz))
+    return false;
+  uint64_t px = ix.x, pz = ix.z;
+  const uint64_t qx = iz.x, qz = iz.z;
+  unsigned phase = 1 + 2 * ix.sign + 2 * iz.sign + mul_paulis(&px, &pz, &qx, &qz, 1);
+  table[0] = {};
+  table[1] = ix;
+  table[2] = iz;
+  table[3] = { static_cast<uint8_t>(px), static_cast<uint8_t>(pz), static_cast<uint8_t>((phase >> 1) & 1) };
+  return true;
+}
+
+StabilizerSum::StabilizerSum(size_t num_qubits, Rng r)
+    : n(num_qubits), words(std::max<size_t>((num_qubits + 63) / 64, 1)), rng(r) {
+  xs.assign(2 * n * words, 0);
+  zs.assign(2 * n * words, 0);
+  signs.assign(2 * n, 0);
+  for (size_t q = 0; q < n; q++) {
+    flip_bit(row_x(q), q);
+    flip_bit(row_z(n + q), q);
+  }
+  keys.assign(words, 0);
+  amps.assign(1, 1.0);
+}
+
+StabilizerSum::Pauli StabilizerSum::identity() const {
+  return { std::vector<uint64_t>(words, 0), std::vector<uint64_t>(words, 0), 0 };
+}
+
+StabilizerSum::Pauli StabilizerSum::row(size_t r) const {
+  return { std::vector<uint64_t>(row_x(r), row_x(r) + words), std::vector<uint64_t>(row_z(r), row_z(r) + words),
+           static_cast<uint8_t>(2 * signs[r]) };
+}
+
+void StabilizerSum::mul_row(Pauli& p, size_t r) const {
+  p.phase = (p.phase + 2 * signs[r] + mul_paulis(p.x.data(), p.z.data(), row_x(r), row_z(r), words)) & 3;
+}
+
+void StabilizerSum::rowsum(size_t h, size_t i) {
+  unsigned phase = 2 * signs[h] + 2 * signs[i] + mul_paulis(row_x(h), row_z(h), row_x(i), row_z(i), words);
+  signs[h] = (phase >> 1) & 1;
+}
+
+StabilizerSum::Decomposition StabilizerSum::decompose(const Pauli& p) const {
+  Decomposition d{ std::vector<uint64_t>(words, 0), std::vector<uint64_t>(words, 0), 1.0 };
+  // D^a S^b anticommutes with S_j exactly where a_j is set, and with D_j where b_j is
+  for (size_t j = 0; j < n; j++) {
+    if (dot(p.x.data(), row_z(n + j), words) ^ dot(p.z.data(), row_x(n + j), words))
+      flip_bit(d.a.data(), j);
+    if (dot(p.x.data(), row_z(j), words) ^ dot(p.z.data(), row_x(j), words))
+      flip_bit(d.b.data(), j);
+  }
+  Pauli acc = identity();
+  for (size_t j = 0; j < n; j++) {
+    if (get_bit(d.a.data(), j))
+      mul_row(acc, j);
+  }
+  for (size_t j = 0; j < n; j++) {
+    if (get_bit(d.b.data(), j))
+      mul_row(acc, n + j);
+  }
+  d.lambda = i_pow(p.phase + 4 - acc.phase);
+  return d;
+}
+
+std::vector<StabilizerSum::Pauli> StabilizerSum::x_echelon(std::vector<size_t>& pivots) const {
+  std::vector<Pauli> rows;
+  for (size_t j = 0; j < n; j++)
+    rows.push_back(row(n + j));
+  pivots.clear();
+  for (size_t q = 0; q < n && pivots.size() < n; q++) {
+    const size_t r = pivots.size();
+    size_t i = r;
+    while (i < n && !get_bit(rows[i].x.data(), q))
+      i++;
+    if (i == n)
+      continue;
+    std::swap(rows[i], rows[r]);
+    for (size_t j = r + 1; j < n; j++) {
+      if (get_bit(rows[j].x.data(), q))
+        rows[j].phase = (rows[j].phase + rows[r].phase +
+                         mul_paulis(rows[j].x.data(), rows[j].z.data(), rows[r].x.data(), rows[r].z.data(), words)) & 3;
+    }
+    pivots.push_back(q);
+  }
+  return rows;
+}
+
+Complex StabilizerSum::ref_ratio(size_t qubit) const {
+  // no stabilizer flips the qubit, so phi has a definite value there
+  bool flipped = false;
+  for (size_t j = 0; j < n && !flipped; j++)
+    flipped = get_bit(row_x(n + j), qubit);
+  if (!flipped)
+    return 0.0;
+
+  // a stabilizer P with x bits 1 << qubit gives <ref ^ x|phi> = <ref ^ x|P|phi>,
+  // a phase times <ref|phi>. without one the amplitude is 0
+  std::vector<size_t> pivots;
+  auto rows = x_echelon(pivots);
+  const uint64_t target = 1ULL << qubit;
+  Pauli acc = identity();
+  for (size_t k = 0; k < pivots.size(); k++) {
+    if (((acc.x[0] ^ target) >> pivots[k]) & 1)
+      acc.phase = (acc.phase + rows[k].phase + mul_paulis(acc.x.data(), acc.z.data(), rows[k].x.data(), rows[k].z.data(), 1)) & 3;
+  }
+  if (acc.x[0] != target)
+    return 0.0;
+  Complex r = i_pow(acc.phase + std::popcount(acc.x[0] & acc.z[0]));
+  return (std::popcount(acc.z[0] & ref) & 1) ? -r : r;
+}
+
+void StabilizerSum::apply_clifford_1q(size_t qubit, const std::array<Complex, 4>& u) {
+  std::array<PauliImage, 4> table;
+  if (!clifford_table(u, table))
+    throw std::runtime_error("Not a clifford gate");
+
+  if (track_phase()) {
+    // <ref|phi> and <ref ^ bit|phi> give u phi at both, the ratio only if u mixes them
+    const size_t b = (ref >> qubit) & 1;
+    const Complex same = u[3 * b], other = u[1 + b], to_same = u[2 - b], to_other = u[3 * (1 - b)];
+    const Complex r = (std::abs(other) > EPS || std::abs(to_other) > EPS) ? ref_ratio(qubit) : 0.0;
+    const Complex at_ref = ref_amp * (same + other * r);
+    const Complex at_flip = ref_amp * (to_same + to_other * r);
+    if (std::norm(at_flip) > std::norm(at_ref)) {
+      ref ^= 1ULL << qubit;
+      ref_amp = at_flip;
+    }
+    else {
+      ref_amp = at_ref;
+    }
+  }
+
+  for (size_t r = 0; r < 2 * n; r++) {
+    uint64_t* x = row_x(r);
+    uint64_t* z = row_z(r);
+    const unsigned k = get_bit(x, qubit) | (get_bit(z, qubit) << 1);
+    if (k == 0)
+      continue;
+    put_bit(x, qubit, table[k].x);
+    put_bit(z, qubit, table[k].z);
+    signs[r] ^= table[k].sign;
+  }
+}
+
+void StabilizerSum::apply_hadamard(size_t qubit) {
+  const double s = 1.0 / std::sqrt(2.0);
+  apply_clifford_1q(qubit, { s, s, s, -s });
+}
+
+void StabilizerSum::apply_s(size_t qubit) {
+  apply_clifford_1q(qubit, { 1.0, 0.0, 0.0, Complex(0.0, 1.0) });
+}
+
+void StabilizerSum::apply_cnot(size_t cntrl, size_t qubit) {
+  if (track_phase() && ((ref >> cntrl) & 1))
+    ref ^= 1ULL << qubit;
+  for (size_t r = 0; r < 2 * n; r++) {
+    uint64_t* x = row_x(r);
+    uint64_t* z = row_z(r);
+    const bool xc = get_bit(x, cntrl), zc = get_bit(z, cntrl), xt = get_bit(x, qubit), zt = get_bit(z, qubit);
+    signs[r] ^= xc & zt & (xt ^ zc ^ 1);
+    put_bit(x, qubit, xt ^ xc);
+    put_bit(z, cntrl, zc ^ zt);
+  }
+}
+
+void StabilizerSum::apply_cz(size_t qubit1, size_t qubit2) {
+  if (track_phase() && ((ref >> qubit1) & (ref >> qubit2) & 1))
+    ref_amp = -ref_amp;
+  for (size_t r = 0; r < 2 * n; r++) {
+    uint64_t* x = row_x(r);
+    uint64_t* z = row_z(r);
+    const bool xa = get_bit(x, qubit1), za = get_bit(z, qubit1), xb = get_bit(x, qubit2), zb = get_bit(z, qubit2);
+    signs[r] ^= xa & xb & (za ^ zb);
+    put_bit(z, qubit1, za ^ xb);
+    put_bit(z, qubit2, zb ^ xa);
+  }
+}
+
+void StabilizerSum::apply_cy(size_t cntrl, size_t qubit) {
+  // s cx sdg on the target, the phases of sdg and s cancelling in ref
+  const Complex i(0.0, 1.0);
+  apply_clifford_1q(qubit, { 1.0, 0.0, 0.0, -i });
+  apply_cnot(cntrl, qubit);
+  apply_clifford_1q(qubit, { 1.0, 0.0, 0.0, i });
+}
+
+void StabilizerSum::apply_swap(size_t qubit1, size_t qubit2) {
+  if (track_phase() && (((ref >> qubit1) ^ (ref >> qubit2)) & 1))
+    ref ^= (1ULL << qubit1) | (1ULL << qubit2);
+  for (size_t r = 0; r < 2 * n; r++) {
+    uint64_t* x = row_x(r);
+    uint64_t* z = row_z(r);
+    const bool xa = get_bit(x, qubit1), za = get_bit(z, qubit1);
+    put_bit(x, qubit1, get_bit(x, qubit2));
+    put_bit(z, qubit1, get_bit(z, qubit2));
+    put_bit(x, qubit2, xa);
+    put_bit(z, qubit2, za);
+  }
+}
+
+bool StabilizerSum::is_clifford_1q(const std::array<Complex, 4>& u) {
+  std::array<PauliImage, 4> table;
+  return clifford_table(u, table);
+}
+
+size_t StabilizerSum::num_paulis(const std::array<Complex, 4>& u) {
+  size_t count = 0;
+  for (auto c : pauli_coefs(u))
+    count += std::abs(c) > EPS;
+  return count;
+}
+
+void StabilizerSum::apply_unitary_1q(size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11) {
+  const Mat2 u = { u00, u01, u10, u11 };
+  if (is_clifford_1q(u)) {
+    apply_clifford_1q(qubit, u);
+    return;
+  }
+  auto c = pauli_coefs(u);
+  static constexpr uint8_t xs[] = { 0, 1, 1, 0 }, zs[] = { 0, 0, 1, 1 };
+  std::vector<PauliTerm> terms;
+  for (size_t k = 0; k < 4; k++) {
+    if (std::abs(c[k]) > EPS)
+      terms.push_back({ c[k], { static_cast<uint32_t>(qubit), 0, 0 }, 1, xs[k], zs[k] });
+  }
+  apply_pauli_sum(terms);
+}
+
+void StabilizerSum::apply_controlled_unitary_1q(size_t cntrl, size_t qubit, Complex u00, Complex u01, Complex u10, Complex u11) {
+  const Mat2 u = { u00, u01, u10, u11 };
+  if (near(u, PAULI_X))
+    return apply_cnot(cntrl, qubit);
+  if (near(u, PAULI_Y))
+    return apply_cy(cntrl, qubit);
+  if (near(u, PAULI_Z))
+    return apply_cz(cntrl, qubit);
+  if (near(u, { 1.0, 0.0, 0.0, 1.0 }))
+    return;
+
+  // |0><0| x I + |1><1| x u = (I + Z_c) / 2 x I + (I - Z_c) / 2 x u
+  auto c = pauli_coefs(u);
+  static constexpr uint8_t xs[] = { 0, 1, 1, 0 }, zs[] = { 0, 0, 1, 1 };
+  const std::array<uint32_t, 3> qs = { static_cast<uint32_t>(cntrl), static_cast<uint32_t>(qubit), 0 };
+  std::vector<PauliTerm> terms;
+  for (size_t k = 0; k < 4; k++) {
+    Complex with_i = k == 0 ? (1.0 + c[0]) / 2.0 : c[k] / 2.0;
+    Complex with_z = k == 0 ? (1.0 - c[0]) / 2.0 : -c[k] / 2.0;
+    const uint8_t x = static_cast<uint8_t>(xs[k] << 1), z = static_cast<uint8_t>(zs[k] << 1);
+    if (std::abs(with_i) > EPS)
+      terms.push_back({ with_i, qs, 2, x, z });
+    if (std::abs(with_z) > EPS)
+      terms.push_back({ with_z, qs, 2, x, static_cast<uint8_t>(z | 1) });
+  }
+  apply_pauli_sum(terms);
+}
+
+void StabilizerSum::apply_controlled_phase(size_t qubit1, size_t qubit2, Complex phase) {
+  if (std::abs(phase + 1.0) < PAULI_TOL)
+    return apply_cz(qubit1, qubit2);
+  if (std::abs(phase - 1.0) < PAULI_TOL)
+    return;
+  // diag(1, 1, 1, phase) = ((3 + phase) I + (1 - phase) (Z_1 + Z_2 - Z_1 Z_2)) / 4
+  const std::array<uint32_t, 3> qs = { static_cast<uint32_t>(qubit1), static_cast<uint32_t>(qubit2), 0 };
+  const Complex c = (1.0 - phase) / 4.0;
+  const PauliTerm terms[] = {
+    { (3.0 + phase) / 4.0, qs, 2, 0, 0 },
+    { c, qs, 2, 0, 1 },
+    { c, qs, 2, 0, 2 },
+    { -c, qs, 2, 0, 3 },
+  };
+  apply_pauli_sum(terms);
+}
+
+void StabilizerSum::apply_toffoli(size_t cntrl1, size_t cntrl2, size_t qubit) {
+  // I - (I - Z_1)(I - Z_2)(I - X_t) / 4
+  const std::array<uint32_t, 3> qs = { static_cast<uint32_t>(cntrl1), static_cast<uint32_t>(cntrl2), static_cast<uint32_t>(qubit) };
+  std::vector<PauliTerm> terms;
+  for (uint8_t k = 0; k < 8; k++) {
+    const double sign = (std::popcount(k) & 1) ? 0.25 : -0.25;
+    terms.push_back({ (k == 0 ? 1.0 : 0.0) + sign, qs, 3, static_cast<uint8_t>(k & 4), static_cast<uint8_t>(k & 3) });
+  }
+  apply_pauli_sum(terms);
+}
+
+void StabilizerSum::apply_cswap(size_t cntrl, size_t qubit1, size_t qubit2) {
+  apply_cnot(qubit2, qubit1);
+  apply_toffoli(cntrl, qubit1, qubit2);
+  apply_cnot(qubit2, qubit1);
+}
+
+void StabilizerSum::apply_pauli_sum(std::span<const PauliTerm> terms) {
+  PROFILE_SCOPE("stabilizer_pauli_sum", PROFILE_NO_QUBIT, amps.size() * (sizeof(Complex) + words * sizeof(uint64_t)));
+  std::vector<Decomposition> ds;
+  std::vector<Complex> coefs;
+  for (const auto& t : terms) {
+    Pauli p = identity();
+    for (size_t k = 0; k < t.num_qubits; k++) {
+      put_bit(p.x.data(), t.qubits[k], (t.x >> k) & 1);
+      put_bit(p.z.data(), t.qubits[k], (t.z >> k) & 1);
+    }
+    ds.push_back(decompose(p));
+    coefs.push_back(t.coef);
+  }
+  apply_decomposed(ds, coefs);
+}
+
+void StabilizerSum::apply_decomposed(std::span<const Decomposition> ds, std::span<const Complex> coefs) {
+  // lambda D^a S^b sends D^y phi to lambda (-1)^(b.y) D^(y ^ a) phi
+  std::vector<Complex> c(ds.size());
+  for (size_t g = 0; g < ds.size(); g++)
+    c[g] = coefs[g] * ds[g].lambda;
+
+  std::vector<const uint64_t*> shifts;
+  for (const auto& d : ds) {
+    auto same = [&](const uint64_t* s) { return std::equal(s, s + words, d.a.data()); };
+    if (std::find_if(shifts.begin(), shifts.end(), same) == shifts.end())
+      shifts.push_back(d.a.data());
+  }
+
+  const size_t k = amps.size();
+  if (shifts.size() == 1) {
+    // every term moves by the same a, so none can meet
+    const uint64_t* a = shifts[0];
+    parallel_ranges(k, num_threads, [&](size_t first, size_t last) {
+      for (size_t t = first; t < last; t++) {
+        uint64_t* y = keys.data() + t * words;
+        Complex f = 0.0;
+        for (size_t g = 0; g < ds.size(); g++)
+          f += dot(ds[g].b.data(), y, words) ? -c[g] : c[g];
+        amps[t] *= f;
+        for (size_t w = 0; w < words; w++)
+          y[w] ^= a[w];
+      }
+    });
+    prune();
+    return;
+  }
+
+  // the new keys are the old ones moved by each shift. they're collected first, then
+  // every new amplitude is gathered from the old terms mapping onto it
+  KeyTable old_table(keys, words, k);
+  for (size_t t = 0; t < k; t++)
+    old_table.insert(t);
+  std::vector<uint64_t> new_keys;
+  new_keys.reserve(k * shifts.size() * words);
+  KeyTable new_table(new_keys, words, k * shifts.size());
+  size_t m = 0;
+  for (size_t t = 0; t < k; t++) {
+    const uint64_t* y = keys.data() + t * words;
+    for (const uint64_t* a : shifts) {
+      for (size_t w = 0; w < words; w++)
+        new_keys.push_back(y[w] ^ a[w]);
+      if (new_table.insert(m) == m)
+        m++;
+      else
+        new_keys.resize(m * words);
+    }
+  }
+
+  std::vector<Complex> new_amps(m);
+  parallel_ranges(m, num_threads, [&](size_t first, size_t last) {
+    std::vector<uint64_t> src(words);
+    for (size_t u = first; u < last; u++) {
+      const uint64_t* y = new_keys.data() + u * words;
+      Complex acc = 0.0;
+      for (size_t g = 0; g < ds.size(); g++) {
+        for (size_t w = 0; w < words; w++)
+          src[w] = y[w] ^ ds[g].a[w];
+        const size_t t = old_table.find(src.data());
+        if (t != SIZE_MAX)
+          acc += (dot(ds[g].b.data(), src.data(), words) ? -c[g] : c[g]) * amps[t];
+      }
+      new_amps[u] = acc;
+    }
+  });
+  keys = std::move(new_keys);
+  amps = std::move(new_amps);
+  prune();
+}
+
+void StabilizerSum::prune() {
+  size_t m = 0;
+  for (size_t t = 0; t < amps.size(); t++) {
+    if (std::norm(amps[t]) < PRUNE_NORM)
+      continue;
+    if (m != t) {
+      amps[m] = amps[t];
+      std::copy_n(keys.begin() + t * words, words, keys.begin() + m * words);
+    }
+    m++;
+  }
+  amps.resize(m);
+  keys.resize(m * words);
+}
+
+size_t StabilizerSum::measure(size_t qubit) {
+  PROFILE_SCOPE("stabilizer_measure", qubit, amps.size() * (sizeof(Complex) + words * sizeof(uint64_t)));
+  Pauli zq = identity();
+  flip_bit(zq.z.data(), qubit);
+  const Decomposition d = decompose(zq);
+  const size_t k = amps.size();
+
+  size_t p = 0;
+  while (p < n && !get_bit(d.a.data(), p))
+    p++;
+
+  if (p == n) {
+    // Z_q = lambda S^b, so term y is an eigenstate with eigenvalue lambda (-1)^(b.y)
+    const bool neg = d.lambda.real() < 0;
+    std::vector<uint8_t> outcome(k);
+    double w[2] = { 0.0, 0.0 };
+    for (size_t t = 0; t < k; t++) {
+      outcome[t] = neg ^ dot(d.b.data(), keys.data() + t * words, words);
+      w[outcome[t]] += std::norm(amps[t]);
+    }
+    const size_t res = rng.uniform() < clamp_probs(w[0], w[1])[1];
+    const double scl = 1.0 / std::sqrt(w[res]);
+    size_t m = 0;
+    for (size_t t = 0; t < k; t++) {
+      if (outcome[t] != res)
+        continue;
+      amps[m] = amps[t] * scl;
+      std::copy_n(keys.begin() + t * words, words, keys.begin() + m * words);
+      m++;
+    }
+    amps.resize(m);
+    keys.resize(m * words);
+    return res;
+  }
+
+  // Z_q anticommutes with stabilizer p. the new frame swaps it in for S_p, with the
+  // old S_p as destabilizer p, and phi' = (I + Z_q) phi / sqrt 2. then
+  // phi = (phi' + D'_p phi') / sqrt 2, so every term is a pair of new ones
+  const double s = 1.0 / std::sqrt(2.0);
+  if (track_phase()) {
+    if ((ref >> qubit) & 1) {
+      // phi' is 0 at ref, so it moves to ref ^ x of S_p
+      const uint64_t x = row_x(n + p)[0], z = row_z(n + p)[0];
+      ref_amp *= i_pow(2 * signs[n + p] + std::popcount(x & z));
+      if (std::popcount(z & ref) & 1)
+        ref_amp = -ref_amp;
+      ref ^= x;
+    }
+    ref_amp *= std::numbers::sqrt2;
+  }
+
+  const Pauli old_dp = row(p);
+  for (size_t j = 0; j < n; j++) {
+    if (j == p)
+      continue;
+    if (get_bit(d.a.data(), j))
+      rowsum(n + j, n + p);
+    if (get_bit(d.b.data(), j))
+      rowsum(j, n + p);
+  }
+  std::copy_n(row_x(n + p), words, row_x(p));
+  std::copy_n(row_z(n + p), words, row_z(p));
+  signs[p] = signs[n + p];
+  std::fill_n(row_x(n + p), words, 0);
+  std::fill_n(row_z(n + p), words, 0);
+  flip_bit(row_z(n + p), qubit);
+  signs[n + p] = 0;
+
+  // D_j = D'_j D'_p^(b_j) for j != p, and the old D_p = mu D'^g S'^h gives
+  // D_p phi = mu (D'^g phi' + (-1)^(h_p) D'^(g ^ e_p) phi') / sqrt 2
+  const Decomposition dp = decompose(old_dp);
+  const Complex c_first = dp.lambda * s;
+  const Complex c_second = get_bit(dp.b.data(), p) ? -c_first : c_first;
+  const bool bp = get_bit(d.b.data(), p);
+
+  // each old term as a key with bit p clear and amplitudes for bit p = 0 and 1
+  std::vector<uint64_t> base(k * words);
+  std::vector<std::array<Complex, 2>> pair(k);
+  parallel_ranges(k, num_threads, [&](size_t first, size_t last) {
+    for (size_t t = first; t < last; t++) {
+      const uint64_t* y = keys.data() + t * words;
+      uint64_t* out = base.data() + t * words;
+      const Complex a = amps[t];
+      if (!get_bit(y, p)) {
+        std::copy_n(y, words, out);
+        pair[t] = { a * s, a * s };
+        continue;
+      }
+      const bool c = dot(d.b.data(), y, words) ^ bp;
+      for (size_t w = 0; w < words; w++)
+        out[w] = y[w] ^ dp.a[w];
+      flip_bit(out, p);
+      const bool first_bit = get_bit(out, p) ^ c;
+      put_bit(out, p, false);
+      pair[t][first_bit] = c_first * a;
+      pair[t][!first_bit] = c_second * a;
+    }
+  });
+
+  KeyTable table(base, words, k);
+  size_t m = 0;
+  for (size_t t = 0; t < k; t++) {
+    if (m != t)
+      std::copy_n(base.begin() + t * words, words, base.begin() + m * words);
+    const size_t at = table.insert(m);
+    if (at == m) {
+      pair[m] = pair[t];
+      m++;
+    }
+    else {
+      pair[at][0] += pair[t][0];
+      pair[at][1] += pair[t][1];
+    }
+  }
+
+  double w[2] = { 0.0, 0.0 };
+  for (size_t t = 0; t < m; t++) {
+    w[0] += std::norm(pair[t][0]);
+    w[1] += std::norm(pair[t][1]);
+  }
+  const size_t res = rng.uniform() < clamp_probs(w[0], w[1])[1];
+  const double scl = 1.0 / std::sqrt(w[res]);
+  amps.resize(m);
+  for (size_t t = 0; t < m; t++) {
+    amps[t] = pair[t][res] * scl;
+    put_bit(base.data() + t * words, p, res);
+  }
+  base.resize(m * words);
+  keys = std::move(base);
+  prune();
+  return res;
+}
+
+void StabilizerSum::reset(size_t qubit) {
+  if (measure(qubit) == 1)
+    apply_clifford_1q(qubit, PAULI_X);
+}
+
+void StabilizerSum::write_state(OutputBuffer& out, size_t top) const {
+  auto summary = [&] {
+    out.put(std::format("{} stabilizer terms over {} qubits, too many amplitudes to print\n", amps.size(), n));
+  };
+  if (!track_phase())
+    return summary();
+  std::vector<size_t> pivots;
+  auto rows = x_echelon(pivots);
+  const size_t rank = pivots.size();
+  const bool sparse = rank < 32 && (amps.size() << rank) <= PRINT_MAX_AMPS;
+  // summing into a dense vector takes no more than a state vector would, as long
+  // as each amplitude gets a bounded number of contributions
+  if (!sparse && (n > PRINT_DENSE_MAX_QUBITS || amps.size() > (size_t(64) << (n - rank))))
+    return summary();
+
+  // calls emit(x, a) for each term's D^y phi at every x in its support, D^y |x> being
+  // a phase times |x ^ dx>. phi at ref ^ x for each stabilizer P with x bits x, stepping
+  // through them by gray code
+  auto for_each_amp = [&](auto&& emit) {
+    for (size_t t = 0; t < amps.size(); t++) {
+      Pauli dy = identity();
+      for (size_t j = 0; j < n; j++) {
+        if (get_bit(keys.data() + t * words, j))
+          mul_row(dy, j);
+      }
+      const Complex f = amps[t] * i_pow(dy.phase + std::popcount(dy.x[0] & dy.z[0]));
+      Pauli acc = identity();
+      for (uint64_t g = 0; g < (1ULL << rank); g++) {
+        if (g > 0) {
+          const Pauli& r = rows[std::countr_zero(g)];
+          acc.phase = (acc.phase + r.phase + mul_paulis(acc.x.data(), acc.z.data(), r.x.data(), r.z.data(), 1)) & 3;
+        }
+        Complex a = ref_amp * i_pow(acc.phase + std::popcount(acc.x[0] & acc.z[0]));
+        if (std::popcount(acc.z[0] & ref) & 1)
+          a = -a;
+        const uint64_t x = ref ^ acc.x[0];
+        emit(x ^ dy.x[0], (std::popcount(dy.z[0] & x) & 1) ? -f * a : f * a);
+      }
+    }
+  };
+
+  TopAmps best(top);
+  auto put = [&](uint64_t x, Complex a) {
+    if (std::norm(a) <= EPS)
+      return;
+    if (top)
+      best.offer(x, a);
+    else
+      put_basis_amp(out, x, a, n);
+  };
+
+  if (sparse) {
+    std::vector<BasisAmp> terms;
+    for_each_amp([&](uint64_t x, Complex a) { terms.push_back({ x, a }); });
+    std::sort(terms.begin(), terms.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+    for (size_t i = 0; i < terms.size();) {
+      Complex a = 0.0;
+      const uint64_t x = terms[i].first;
+      for (; i < terms.size() && terms[i].first == x; i++)
+        a += terms[i].second;
+      put(x, a);
+    }
+  }
+  else {
+    std::vector<Complex> dense(1ULL << n);
+    for_each_amp([&](uint64_t x, Complex a) { dense[x] += a; });
+    for (uint64_t x = 0; x < dense.size(); x++)
+      put(x, dense[x]);
+  }
+
+  for (const auto& [x, a] : best.take())
+    put_basis_amp(out, x, a, n);
+}